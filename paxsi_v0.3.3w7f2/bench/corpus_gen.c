@@ -0,0 +1,411 @@
+// Seeded generator of synthetic Paxsi sources.
+//
+// Build (from paxsi_v0.3.3w7f2/):
+//   gcc -O2 -I. bench/corpus_gen.c -o corpus_gen
+// Usage:
+//   ./corpus_gen [--seed N] [--size BYTES] [--mix NAME] > out.px
+// Mixes: balanced (default), idents, literals, comments, nested, compile,
+// directives. Output depends only on the options, so a seed and size
+// name a corpus reproducibly. Link with -DCORPUS_NO_MAIN to use
+// generate_corpus from another program (bench/frontend_bench.c).
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "corpus_gen.h"
+
+typedef enum {
+    STMT_DECL,
+    STMT_ASSIGN,
+    STMT_COMPOUND,
+    STMT_CALL,
+    STMT_IF,
+    STMT_COMMENT,
+    STMT_COMPILE,
+    STMT_DIRECTIVE,
+    STMT_KIND_COUNT
+} StatementKind;
+
+// Relative frequency of each statement kind per mix
+static const int statement_weights[CORPUS_MIX_COUNT][STMT_KIND_COUNT] = {
+    [CORPUS_BALANCED]   = { 15, 35, 10, 10, 15, 15,  0,  0 },
+    [CORPUS_IDENTS]     = { 30, 45,  5, 20,  0,  0,  0,  0 },
+    [CORPUS_LITERALS]   = { 50, 40, 10,  0,  0,  0,  0,  0 },
+    [CORPUS_COMMENTS]   = {  5, 15,  0,  0, 15, 65,  0,  0 },
+    [CORPUS_NESTED]     = {  5, 35,  0,  5, 55,  0,  0,  0 },
+    [CORPUS_COMPILE]    = { 15, 30, 10,  5, 10,  5, 25,  0 },
+    [CORPUS_DIRECTIVES] = { 15, 30, 10,  5, 10,  5,  0, 25 },
+};
+
+// Deepest if nesting and expression nesting per mix
+static const int block_depth[CORPUS_MIX_COUNT] = { 4, 1, 1, 3, 24, 3, 3 };
+static const int expression_depth[CORPUS_MIX_COUNT] = { 3, 3, 2, 2, 12, 3, 3 };
+
+static const char* mix_names[CORPUS_MIX_COUNT] = {
+    "balanced", "idents", "literals", "comments", "nested", "compile", "directives"
+};
+
+static const char* syllables[16] = {
+    "ab", "cor", "del", "fin", "gu", "ka", "lom", "mer",
+    "nu", "pra", "rix", "sol", "tan", "ur", "vek", "zo"
+};
+
+// Names that start like keywords, types and modifiers but are identifiers
+static const char* lookalikes[] = {
+    "iffy", "elsewhere", "realm", "charge", "integer", "voided", "constant",
+    "statics", "returned", "freedom", "docs", "gotos", "sizeof", "mallocs",
+    "parsed", "thisway", "NONEx", "breaks", "compiler", "externs"
+};
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+    size_t target;
+    uint64_t state;
+    CorpusMix mix;
+    int indent;
+} Generator;
+
+// splitmix64: small, fast and identical on every platform
+static uint64_t next_random(Generator* gen) {
+    uint64_t z = (gen->state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static unsigned pick(Generator* gen, unsigned count) {
+    return (unsigned)(next_random(gen) % count);
+}
+
+static void emit(Generator* gen, const char* text, size_t length) {
+    if (gen->failed) return;
+    if (gen->length + length + 1 > gen->capacity) {
+        size_t capacity = gen->capacity ? gen->capacity * 2 : 4096;
+        while (capacity < gen->length + length + 1) capacity *= 2;
+        char* grown = realloc(gen->data, capacity);
+        if (!grown) {
+            gen->failed = true;
+            return;
+        }
+        gen->data = grown;
+        gen->capacity = capacity;
+    }
+    memcpy(gen->data + gen->length, text, length);
+    gen->length += length;
+}
+
+static void emit_text(Generator* gen, const char* text) {
+    emit(gen, text, strlen(text));
+}
+
+static void emit_format(Generator* gen, const char* format, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length > 0) emit(gen, buffer, (size_t)length < sizeof(buffer) ? (size_t)length : sizeof(buffer) - 1);
+}
+
+static void emit_indent(Generator* gen) {
+    int width = gen->mix == CORPUS_COMMENTS ? 16 : 4;
+    for (int i = 0; i < gen->indent * width; i++) emit(gen, " ", 1);
+}
+
+// Identifier number `index`: syllables spelling out its hex digits,
+// never a keyword
+static void emit_name_for(Generator* gen, unsigned index) {
+    emit_text(gen, syllables[index & 15]);
+    index >>= 4;
+    do {
+        emit_text(gen, syllables[index & 15]);
+        index >>= 4;
+    } while (index);
+}
+
+static void emit_name(Generator* gen) {
+    if (gen->mix != CORPUS_IDENTS) {
+        emit_name_for(gen, pick(gen, 64));
+        return;
+    }
+    switch (pick(gen, 4)) {
+        case 0:
+            emit_format(gen, "%s%u", lookalikes[pick(gen, sizeof(lookalikes) / sizeof(*lookalikes))], pick(gen, 100));
+            break;
+        case 1:
+            // Long names in snake case
+            for (unsigned words = 2 + pick(gen, 5), i = 0; i < words; i++) {
+                if (i) emit(gen, "_", 1);
+                emit_name_for(gen, pick(gen, 4096));
+            }
+            break;
+        case 2:
+            emit_format(gen, "%c", 'a' + pick(gen, 26));
+            break;
+        default:
+            emit_name_for(gen, pick(gen, 1u << 20));
+            break;
+    }
+}
+
+static void emit_literal(Generator* gen) {
+    static const char* escapes[] = { "\\n", "\\t", "\\\\", "\\\"", "\\0" };
+    switch (pick(gen, gen->mix == CORPUS_LITERALS ? 9 : 3)) {
+        case 0: emit_format(gen, "%u", pick(gen, 1000)); break;
+        case 1: emit_format(gen, "%u.%u", pick(gen, 100), pick(gen, 1000)); break;
+        case 2: emit_format(gen, "\"text %u\"", pick(gen, 100)); break;
+        case 3: emit_format(gen, "0x%X", (unsigned)next_random(gen)); break;
+        case 4: emit_format(gen, "%llu", (unsigned long long)(next_random(gen) >> 1)); break;
+        case 5:
+            emit_format(gen, "%u.%06ue%c%u", pick(gen, 10), pick(gen, 1000000),
+                        pick(gen, 2) ? '+' : '-', pick(gen, 300));
+            break;
+        case 6: emit_format(gen, "%u_%03u_%03u", 1 + pick(gen, 999), pick(gen, 1000), pick(gen, 1000)); break;
+        case 7:
+            emit(gen, "\"", 1);
+            for (unsigned parts = 1 + pick(gen, 4), i = 0; i < parts; i++) {
+                emit_format(gen, "part%u", pick(gen, 10));
+                emit_text(gen, escapes[pick(gen, sizeof(escapes) / sizeof(*escapes))]);
+            }
+            emit(gen, "\"", 1);
+            break;
+        default:
+            if (pick(gen, 2)) emit_format(gen, "'%c'", 'a' + pick(gen, 26));
+            else emit_format(gen, "'%s'", escapes[pick(gen, 2)]);
+            break;
+    }
+}
+
+static void emit_expression(Generator* gen, int depth);
+
+static void emit_primary(Generator* gen, int depth) {
+    unsigned literal_share = gen->mix == CORPUS_LITERALS ? 8 : gen->mix == CORPUS_IDENTS ? 1 : 4;
+    unsigned choice = pick(gen, 12);
+    if (choice < literal_share) {
+        emit_literal(gen);
+    } else if (choice == 11 && depth > 0) {
+        // Call with one argument or none
+        emit_name(gen);
+        emit(gen, "(", 1);
+        if (pick(gen, 3)) emit_expression(gen, depth - 1);
+        emit(gen, ")", 1);
+    } else {
+        emit_name(gen);
+    }
+}
+
+static void emit_expression(Generator* gen, int depth) {
+    // No "<=" or ">=": the lexer reads them as a comparison followed by
+    // '=' unless another character sits in between
+    static const char* binary[] = {
+        "+", "-", "*", "/", "|", "&", "^", "<<", ">>", "==", "!=", "<", ">"
+    };
+    static const char* unary[] = { "-", "!", "~" };
+    if (depth <= 0 || pick(gen, 3) == 0) {
+        emit_primary(gen, depth);
+        return;
+    }
+    switch (pick(gen, gen->mix == CORPUS_NESTED ? 4 : 8)) {
+        case 0:
+        case 1:
+            emit(gen, "(", 1);
+            emit_expression(gen, depth - 1);
+            emit(gen, ")", 1);
+            break;
+        case 2:
+            emit_text(gen, unary[pick(gen, 3)]);
+            emit_primary(gen, depth - 1);
+            break;
+        default:
+            emit_expression(gen, depth - 1);
+            emit_format(gen, " %s ", binary[pick(gen, sizeof(binary) / sizeof(*binary))]);
+            emit_expression(gen, depth - 1);
+            break;
+    }
+}
+
+static void emit_statements(Generator* gen, int depth, unsigned count);
+
+static void emit_block(Generator* gen, int depth) {
+    emit_text(gen, " {\n");
+    gen->indent++;
+    emit_statements(gen, depth, 1 + pick(gen, 4));
+    gen->indent--;
+    emit_indent(gen);
+    emit_text(gen, "}");
+}
+
+static void emit_statement(Generator* gen, int depth) {
+    static const char* types[] = { "int", "real", "char" };
+    static const char* compound[] = { "+=", "-=", "*=", "/=", "|=", "&=", "^=" };
+    const int* weights = statement_weights[gen->mix];
+    int total = 0;
+    for (int i = 0; i < STMT_KIND_COUNT; i++) total += weights[i];
+
+    // Nested ifs stop at the mix's depth limit, and once the target size
+    // is reached, so that open blocks close quickly
+    int roll = (int)pick(gen, (unsigned)total);
+    StatementKind kind = STMT_DECL;
+    while (roll >= weights[kind]) roll -= weights[kind++];
+    if (kind == STMT_IF && (depth >= block_depth[gen->mix] || gen->length >= gen->target)) kind = STMT_ASSIGN;
+
+    int expression = expression_depth[gen->mix];
+    emit_indent(gen);
+    switch (kind) {
+        case STMT_DECL:
+            emit(gen, "$", 1);
+            emit_name(gen);
+            emit_format(gen, ": %s", types[pick(gen, 3)]);
+            if (pick(gen, 4)) {
+                emit_text(gen, " = ");
+                emit_expression(gen, expression);
+            }
+            emit_text(gen, ";\n");
+            break;
+        case STMT_ASSIGN:
+        case STMT_COMPOUND:
+            emit_name(gen);
+            emit_format(gen, " %s ", kind == STMT_ASSIGN ? "=" : compound[pick(gen, 7)]);
+            emit_expression(gen, expression);
+            emit_text(gen, ";\n");
+            break;
+        case STMT_CALL:
+            emit_name(gen);
+            emit(gen, "(", 1);
+            if (pick(gen, 4)) emit_expression(gen, expression);
+            emit_text(gen, ");\n");
+            break;
+        case STMT_IF:
+            emit_text(gen, "if ");
+            emit_expression(gen, expression);
+            emit_block(gen, depth + 1);
+            for (unsigned elifs = pick(gen, 3) == 0 ? 1 + pick(gen, 2) : 0; elifs > 0; elifs--) {
+                emit_text(gen, " elif ");
+                emit_expression(gen, expression);
+                emit_block(gen, depth + 1);
+            }
+            if (pick(gen, 2)) {
+                emit_text(gen, " else");
+                emit_block(gen, depth + 1);
+            }
+            emit_text(gen, "\n");
+            break;
+        case STMT_COMMENT:
+            if (pick(gen, 2)) {
+                emit_format(gen, "# note %u: keep ", pick(gen, 1000));
+                emit_name(gen);
+                emit_text(gen, " in sync with the caller\n");
+            } else {
+                emit_text(gen, "</ disabled:\n");
+                emit_indent(gen);
+                emit_name(gen);
+                emit_text(gen, " = ");
+                emit_expression(gen, expression);
+                emit_text(gen, ";\n");
+                if (pick(gen, 2)) {
+                    emit_indent(gen);
+                    emit_text(gen, "</ nested remark />\n");
+                }
+                emit_indent(gen);
+                emit_text(gen, "/>\n");
+            }
+            break;
+        case STMT_COMPILE:
+            emit_format(gen, "compile(target_%u) {\n", pick(gen, 4));
+            emit_indent(gen);
+            emit_text(gen, "    mov rax, { raw ");
+            emit_name(gen);
+            emit_text(gen, " };\n");
+            emit_indent(gen);
+            emit_text(gen, "}\n");
+            break;
+        case STMT_DIRECTIVE:
+            switch (pick(gen, 6)) {
+                case 0: emit_text(gen, "%define "); emit_name(gen); emit_format(gen, " %u\n", pick(gen, 100)); break;
+                case 1: emit_text(gen, "%ifdef "); emit_name(gen); emit_text(gen, "\n"); break;
+                case 2: emit_text(gen, "%endif\n"); break;
+                case 3: emit_text(gen, "%pragma once\n"); break;
+                case 4: emit_format(gen, "%%line %u\n", 1 + pick(gen, 5000)); break;
+                default: emit_text(gen, "%incfile \"common.px\"\n"); break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void emit_statements(Generator* gen, int depth, unsigned count) {
+    for (unsigned i = 0; i < count; i++) emit_statement(gen, depth);
+}
+
+char* generate_corpus(const CorpusOptions* options, size_t* length) {
+    Generator gen = { 0 };
+    gen.state = options->seed;
+    gen.target = options->size;
+    gen.mix = options->mix < CORPUS_MIX_COUNT ? options->mix : CORPUS_BALANCED;
+
+    // A few globals, then everything else in the start function
+    emit_text(&gen, "# Generated corpus\n");
+    for (int i = 0; i < 8; i++) emit_statement(&gen, block_depth[gen.mix]);
+    emit_text(&gen, "__start(argc) {\n");
+    gen.indent = 1;
+    while (!gen.failed && gen.length < options->size) emit_statement(&gen, 0);
+    emit_text(&gen, "}\n");
+
+    if (gen.failed) {
+        free(gen.data);
+        return NULL;
+    }
+    gen.data[gen.length] = '\0';
+    *length = gen.length;
+    return gen.data;
+}
+
+const char* corpus_mix_name(CorpusMix mix) {
+    return mix < CORPUS_MIX_COUNT ? mix_names[mix] : "unknown";
+}
+
+bool corpus_mix_from_name(const char* name, CorpusMix* mix) {
+    for (int i = 0; i < CORPUS_MIX_COUNT; i++) {
+        if (strcmp(name, mix_names[i]) == 0) {
+            *mix = (CorpusMix)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool corpus_mix_parses(CorpusMix mix) {
+    return mix != CORPUS_COMPILE && mix != CORPUS_DIRECTIVES;
+}
+
+#ifndef CORPUS_NO_MAIN
+int main(int argc, char* argv[]) {
+    CorpusOptions options = { 1, 1u << 20, CORPUS_BALANCED };
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) options.seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) options.size = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc && corpus_mix_from_name(argv[i + 1], &options.mix)) i++;
+        else {
+            fprintf(stderr, "Usage: %s [--seed N] [--size BYTES] [--mix balanced|idents|literals|"
+                            "comments|nested|compile|directives]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    size_t length;
+    char* source = generate_corpus(&options, &length);
+    if (!source) {
+        perror("generate_corpus");
+        return 1;
+    }
+    fwrite(source, 1, length, stdout);
+    free(source);
+    return 0;
+}
+#endif
@@ -0,0 +1,39 @@
+// Seeded generator of synthetic Paxsi sources for the benchmarks.
+// The same options always produce the same bytes.
+
+#ifndef CORPUS_GEN_H
+#define CORPUS_GEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// What the generated source is made of. All mixes except CORPUS_COMPILE
+// and CORPUS_DIRECTIVES produce programs the parser accepts; those two
+// contain constructs only the lexer understands.
+typedef enum {
+    CORPUS_BALANCED,    // declarations, expressions, control flow, comments
+    CORPUS_IDENTS,      // many distinct, long and keyword-like names
+    CORPUS_LITERALS,    // numbers in every base and notation, strings, chars
+    CORPUS_COMMENTS,    // line and block comments, deep indentation
+    CORPUS_NESTED,      // deeply nested blocks and parenthesized expressions
+    CORPUS_COMPILE,     // compile(...) { ... } blocks between statements
+    CORPUS_DIRECTIVES,  // % preprocessor directives between statements
+    CORPUS_MIX_COUNT
+} CorpusMix;
+
+typedef struct {
+    uint64_t seed;
+    size_t size;        // approximate output size in bytes
+    CorpusMix mix;
+} CorpusOptions;
+
+// Generate a source of about options->size bytes, NUL-terminated, in a
+// malloc'd buffer; its length goes to *length. NULL if out of memory.
+char* generate_corpus(const CorpusOptions* options, size_t* length);
+
+const char* corpus_mix_name(CorpusMix mix);
+bool corpus_mix_from_name(const char* name, CorpusMix* mix);
+bool corpus_mix_parses(CorpusMix mix);
+
+#endif
@@ -0,0 +1,466 @@
+// Frontend benchmark: lexing and parsing throughput, allocations and peak
+// RSS per phase, on generated corpora or on source files.
+//
+// Build (from paxsi_v0.3.3w7f2/):
+//   gcc -O2 -DPAXSI_NO_MAIN -DCORPUS_NO_MAIN -I. -Ibench -o frontend_bench
+//       bench/frontend_bench.c bench/corpus_gen.c lexer.c parser.c
+// Usage:
+//   ./frontend_bench [--mix NAME|all] [--seed N] [--size BYTES]
+//                    [--iterations N] [--parse-jobs N] [--lex-only] [--json]
+//                    [source_file...]
+// Without files a corpus is generated (bench/corpus_gen.c; default: the
+// balanced mix, seed 1, 8 MB). Phases:
+//   lex    tokenize() into a TokenBuffer
+//   parse  parse() over that buffer
+//   pparse parse_parallel() over that buffer on --parse-jobs N threads
+//          (only with N > 1), including freeing its AST
+//   free   free_ast() and free_lexer()
+//   pull   parse_lexer(): lexing on demand while parsing, then freeing
+// Each phase reports its best time over the iterations. Every parsed input
+// is also checked once, untimed: parse_lexer() over a stream lexer with a
+// small window must give the same AST as parse(), or the process fails;
+// so must a few built-in inputs that once broke the front end.
+// Mixes the parser rejects (compile, directives) and files given with
+// --lex-only only run the lex phase: parse errors end the process. --json
+// prints one object per run for tracking results over time.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "lexer.h"
+#include "parser.h"
+#include "corpus_gen.h"
+
+// Count heap traffic by interposing the allocator (glibc only)
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static size_t alloc_count = 0;
+
+void* malloc(size_t size) { alloc_count++; return __libc_malloc(size); }
+void* calloc(size_t count, size_t size) { alloc_count++; return __libc_calloc(count, size); }
+void* realloc(void* ptr, size_t size) { alloc_count++; return __libc_realloc(ptr, size); }
+void free(void* ptr) { __libc_free(ptr); }
+#define ALLOC_COUNTING 1
+#else
+static size_t alloc_count = 0;
+#define ALLOC_COUNTING 0
+#endif
+
+typedef enum {
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_PARALLEL_PARSE,
+    PHASE_FREE,
+    PHASE_PULL,
+    PHASE_COUNT
+} Phase;
+
+static const char* phase_names[PHASE_COUNT] = { "lex", "parse", "pparse", "free", "pull" };
+
+typedef struct {
+    bool ran;
+    double seconds;        // best over the iterations
+    size_t allocations;
+    long peak_rss_kb;      // -1 if unavailable
+} PhaseResult;
+
+typedef struct {
+    const char* input;
+    size_t bytes;
+    size_t tokens;
+    size_t nodes;
+    PhaseResult phases[PHASE_COUNT];
+} RunResult;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Peak RSS per phase: Linux lets a process reset its high-water mark
+// through /proc/self/clear_refs; elsewhere the process-wide peak is all
+// there is. Heap the previous phase freed is handed back first so it
+// doesn't count against the next one.
+static void reset_peak_rss(void) {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if (file) {
+        fputs("5", file);
+        fclose(file);
+    }
+#endif
+}
+
+static long peak_rss_kb(void) {
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/status", "r");
+    if (file) {
+        char line[256];
+        long peak = -1;
+        while (fgets(line, sizeof(line), file)) {
+            if (strncmp(line, "VmHWM:", 6) == 0) peak = strtol(line + 6, NULL, 10);
+        }
+        fclose(file);
+        if (peak >= 0) return peak;
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) return usage.ru_maxrss;
+#endif
+    return -1;
+}
+
+typedef struct {
+    double start;
+    size_t allocations;
+} PhaseClock;
+
+static PhaseClock phase_begin(void) {
+    reset_peak_rss();
+    return (PhaseClock){ now_seconds(), alloc_count };
+}
+
+static void phase_end(PhaseResult* result, PhaseClock clock) {
+    double elapsed = now_seconds() - clock.start;
+    if (!result->ran || elapsed < result->seconds) result->seconds = elapsed;
+    result->allocations = alloc_count - clock.allocations;
+    // The parser still leaks some node text, so later iterations start
+    // from a larger heap; the first one is the representative peak
+    if (!result->ran) result->peak_rss_kb = peak_rss_kb();
+    result->ran = true;
+}
+
+// Number of AST nodes, walking the same links free_ast_node does
+typedef struct {
+    const ASTNode** items;
+    size_t count;
+    size_t capacity;
+} NodeStack;
+
+static void push_node(NodeStack* stack, const ASTNode* node) {
+    if (!node) return;
+    if (stack->count == stack->capacity) {
+        stack->capacity = stack->capacity ? stack->capacity * 2 : 64;
+        stack->items = realloc(stack->items, stack->capacity * sizeof(*stack->items));
+        if (!stack->items) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    stack->items[stack->count++] = node;
+}
+
+// Walks a heap stack rather than recursing, so deeply nested inputs
+// count as safely as they parse
+static size_t count_ast_nodes(const AST* ast) {
+    NodeStack stack = { 0 };
+    size_t count = 0;
+    for (int i = 0; i < ast->count; i++) {
+        push_node(&stack, ast->nodes[i]);
+        while (stack.count) {
+            const ASTNode* node = stack.items[--stack.count];
+            count++;
+            if (node->type == AST_BLOCK && node->extra) {
+                const AST* block = (const AST*)node->extra;
+                for (int k = 0; k < block->count; k++) push_node(&stack, block->nodes[k]);
+                continue;
+            }
+            push_node(&stack, node->left);
+            push_node(&stack, node->right);
+            if (node->type == AST_IF || node->type == AST_ELIF || node->type == AST_CONDITIONAL) {
+                push_node(&stack, node->extra);
+            }
+        }
+    }
+    free(stack.items);
+    return count;
+}
+
+// In-memory reader for the stream check: fills whatever room the lexer
+// window has, as read() on a file does
+typedef struct {
+    const char* data;
+    size_t length;
+    size_t position;
+} MemoryReader;
+
+static int64_t read_memory(void* context, char* buffer, size_t size) {
+    MemoryReader* reader = context;
+    size_t count = reader->length - reader->position;
+    if (count > size) count = size;
+    memcpy(buffer, reader->data + reader->position, count);
+    reader->position += count;
+    return (int64_t)count;
+}
+
+// Parse the input again through a stream lexer whose window keeps moving
+// under the parser and compare its serialized AST with parse()'s
+#define STREAM_CHECK_WINDOW 64
+
+static void check_stream_parse(const RunResult* result, const char* source, size_t size,
+                               const uint8_t* expected, size_t expected_length) {
+    MemoryReader reader = { source, size, 0 };
+    Lexer* lexer = init_stream_lexer(read_memory, &reader, STREAM_CHECK_WINDOW);
+    AST* ast = lexer ? parse_lexer(lexer) : NULL;
+    size_t length = 0;
+    uint8_t* image = ast ? serialize_ast(ast, &length) : NULL;
+    bool same = image && length == expected_length && memcmp(image, expected, length) == 0;
+    free(image);
+    free_ast(ast);
+    if (lexer) free_lexer(lexer);
+    if (!same) {
+        fprintf(stderr, "%s: parse_lexer over a stream lexer differs from parse()\n", result->input);
+        exit(1);
+    }
+}
+
+// Inputs that once lexed wrong, parsed before any run: each must parse,
+// and to the same AST through a stream lexer
+static const char* regression_inputs[] = {
+    // The ':' of a ?: followed by a name that starts with a type name
+    "__start() {\n"
+    "    $a: int = 1;\n"
+    "    $real_total: real = 2.5;\n"
+    "    $y: int = a ? a : real_total;\n"
+    "    $z: char = a ? int2 : charge;\n"
+    "}\n",
+};
+
+static void check_regressions(void) {
+    for (size_t i = 0; i < sizeof(regression_inputs) / sizeof(*regression_inputs); i++) {
+        RunResult result = { .input = "regression input" };
+        const char* source = regression_inputs[i];
+        size_t size = strlen(source);
+        Lexer* lexer = init_lexer_n(source, size);
+        tokenize(lexer);
+        AST* ast = parse(&lexer->tokens);
+        size_t length = 0;
+        uint8_t* image = ast ? serialize_ast(ast, &length) : NULL;
+        if (!image) {
+            fprintf(stderr, "regression input %zu: parse failed\n", i + 1);
+            exit(1);
+        }
+        check_stream_parse(&result, source, size, image, length);
+        free(image);
+        free_ast(ast);
+        free_lexer(lexer);
+    }
+}
+
+static void run_benchmark(RunResult* result, const char* source, size_t size, int iterations, bool parse_input,
+                          int parse_jobs) {
+    for (int i = 0; i < iterations; i++) {
+        PhaseClock clock = phase_begin();
+        Lexer* lexer = init_lexer_n(source, size);
+        tokenize(lexer);
+        phase_end(&result->phases[PHASE_LEX], clock);
+        result->tokens = lexer->tokens.count;
+
+        AST* ast = NULL;
+        if (parse_input) {
+            clock = phase_begin();
+            ast = parse(&lexer->tokens);
+            phase_end(&result->phases[PHASE_PARSE], clock);
+            if (!ast) {
+                fprintf(stderr, "%s: parse failed\n", result->input);
+                exit(1);
+            }
+            result->nodes = count_ast_nodes(ast);
+            if (i == 0) {
+                size_t length = 0;
+                uint8_t* image = serialize_ast(ast, &length);
+                if (!image) {
+                    fprintf(stderr, "%s: serialize_ast failed\n", result->input);
+                    exit(1);
+                }
+                check_stream_parse(result, source, size, image, length);
+                free(image);
+            }
+        }
+
+        if (parse_input && parse_jobs > 1) {
+            clock = phase_begin();
+            AST* parallel_ast = parse_parallel(&lexer->tokens, parse_jobs, stderr, 0);
+            free_ast(parallel_ast);
+            phase_end(&result->phases[PHASE_PARALLEL_PARSE], clock);
+        }
+
+        clock = phase_begin();
+        free_ast(ast);
+        free_lexer(lexer);
+        phase_end(&result->phases[PHASE_FREE], clock);
+
+        if (parse_input) {
+            clock = phase_begin();
+            lexer = init_lexer_n(source, size);
+            ast = parse_lexer(lexer);
+            free_ast(ast);
+            free_lexer(lexer);
+            phase_end(&result->phases[PHASE_PULL], clock);
+        }
+    }
+}
+
+// Phase rates; tokens and nodes count for the phases that produce or
+// consume them
+static void phase_rates(const RunResult* result, Phase phase, double* mb, double* tokens, double* nodes) {
+    double seconds = result->phases[phase].seconds > 0 ? result->phases[phase].seconds : 1e-9;
+    *mb = result->bytes / seconds / 1e6;
+    *tokens = phase == PHASE_FREE ? 0 : result->tokens / seconds;
+    *nodes = phase == PHASE_LEX ? 0 : result->nodes / seconds;
+}
+
+static void print_text(const RunResult* result) {
+    printf("input:        %s, %zu bytes, %zu tokens, %zu AST nodes\n",
+           result->input, result->bytes, result->tokens, result->nodes);
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        const PhaseResult* entry = &result->phases[phase];
+        if (!entry->ran) continue;
+        double mb, tokens, nodes;
+        phase_rates(result, (Phase)phase, &mb, &tokens, &nodes);
+        printf("  %-6s %9.3f ms %9.2f MB/s %8.2f Mtokens/s %8.2f Mnodes/s",
+               phase_names[phase], entry->seconds * 1e3, mb, tokens / 1e6, nodes / 1e6);
+        if (ALLOC_COUNTING) printf(" %10zu allocs", entry->allocations);
+        if (entry->peak_rss_kb >= 0) printf(" %8ld KB peak", entry->peak_rss_kb);
+        printf("\n");
+    }
+}
+
+static void print_json_string(const char* text) {
+    putchar('"');
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') printf("\\%c", *text);
+        else if ((unsigned char)*text < 0x20) printf("\\u%04x", *text);
+        else putchar(*text);
+    }
+    putchar('"');
+}
+
+static void print_json(const RunResult* result, int iterations, long long seed, bool generated) {
+    printf("{\"benchmark\": \"frontend\", \"input\": ");
+    print_json_string(result->input);
+    if (generated) printf(", \"seed\": %lld", seed);
+    printf(", \"iterations\": %d, \"bytes\": %zu, \"tokens\": %zu, \"nodes\": %zu, \"phases\": {",
+           iterations, result->bytes, result->tokens, result->nodes);
+    bool first = true;
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        const PhaseResult* entry = &result->phases[phase];
+        if (!entry->ran) continue;
+        double mb, tokens, nodes;
+        phase_rates(result, (Phase)phase, &mb, &tokens, &nodes);
+        printf("%s\"%s\": {\"seconds\": %.6f, \"mb_per_s\": %.3f, \"tokens_per_s\": %.0f, "
+               "\"nodes_per_s\": %.0f, \"allocations\": ",
+               first ? "" : ", ", phase_names[phase], entry->seconds, mb, tokens, nodes);
+        if (ALLOC_COUNTING) printf("%zu", entry->allocations);
+        else printf("null");
+        printf(", \"peak_rss_kb\": ");
+        if (entry->peak_rss_kb >= 0) printf("%ld}", entry->peak_rss_kb);
+        else printf("null}");
+        first = false;
+    }
+    printf("}}\n");
+}
+
+static char* load_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror("Couldn't open the file");
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    rewind(file);
+    char* buffer = malloc(file_size + 1);
+    if (buffer && fread(buffer, 1, file_size, file) != (size_t)file_size) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+    if (!buffer) return NULL;
+    buffer[file_size] = '\0';
+    *size = file_size;
+    return buffer;
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--mix balanced|idents|literals|comments|nested|compile|directives|all] "
+                    "[--seed N] [--size BYTES] [--iterations N] [--parse-jobs N] [--lex-only] [--json] [source_file...]\n",
+            program);
+}
+
+int main(int argc, char* argv[]) {
+    CorpusOptions options = { 1, 8u << 20, CORPUS_BALANCED };
+    bool all_mixes = false;
+    bool lex_only = false;
+    bool json = false;
+    int iterations = 5;
+    int parse_jobs = 0;
+    int files = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) options.seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) options.size = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) iterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--parse-jobs") == 0 && i + 1 < argc) parse_jobs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--lex-only") == 0) lex_only = true;
+        else if (strcmp(argv[i], "--json") == 0) json = true;
+        else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "all") == 0) all_mixes = true;
+            else if (!corpus_mix_from_name(argv[i], &options.mix)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            argv[++files] = argv[i];
+        }
+    }
+    if (iterations <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    check_regressions();
+    int runs = files ? files : all_mixes ? CORPUS_MIX_COUNT : 1;
+    for (int run = 0; run < runs; run++) {
+        RunResult result = { 0 };
+        bool parse_input;
+        char* source;
+        if (files) {
+            result.input = argv[run + 1];
+            source = load_file(result.input, &result.bytes);
+            parse_input = !lex_only;
+        } else {
+            if (all_mixes) options.mix = (CorpusMix)run;
+            result.input = corpus_mix_name(options.mix);
+            source = generate_corpus(&options, &result.bytes);
+            parse_input = !lex_only && corpus_mix_parses(options.mix);
+        }
+        if (!source) return 1;
+
+        run_benchmark(&result, source, result.bytes, iterations, parse_input, parse_jobs);
+        if (json) print_json(&result, iterations, (long long)options.seed, !files);
+        else print_text(&result);
+        free(source);
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+// Common entry point of the lexer generations compared by history_bench.c.
+// Every generation is built from bench/history_adapter.c into a shared
+// library exporting a HistoryLexer named HISTORY_ENTRY; the current lexer
+// is linked into the harness directly.
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+
+#define HISTORY_ENTRY "history_lexer"
+
+// One token in a form every generation can produce. type is the name
+// from the generation's token_names table (NULL if it has none or the
+// entry is empty; type_id is the raw enum value then). text is not
+// NUL-terminated.
+typedef struct {
+    const char* type;
+    int type_id;
+    const char* text;
+    size_t length;
+    long line;
+    long column;
+} HistoryToken;
+
+typedef struct {
+    // Lex a NUL-terminated source of the given length; returns an opaque
+    // run that owns the tokens
+    void* (*lex)(const char* source, size_t length);
+    size_t (*count)(void* run);
+    void (*token)(void* run, size_t index, HistoryToken* token);
+    void (*release)(void* run);
+} HistoryLexer;
+
+#endif
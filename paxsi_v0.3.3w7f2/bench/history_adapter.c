@@ -0,0 +1,61 @@
+// Builds one historical lexer generation (the single-file lexers kept at
+// the top of the repository) as a shared library for history_bench.c.
+// The generation's source is compiled into this file with its main()
+// renamed; the library exports its init_lexer/tokenize/free_lexer behind
+// a HistoryLexer.
+//
+// Build (from paxsi_v0.3.3w7f2/), once per generation:
+//   gcc -O2 -w -shared -fPIC -Wl,-Bsymbolic -Ibench -o history/0.2.11.so
+//       -DHISTORY_SOURCE='"../../paxsi 0.2.11.c"' bench/history_adapter.c
+// HISTORY_SOURCE is included, so it is relative to bench/.
+// Add -DHISTORY_NO_TOKEN_NAMES for generations without a token_names
+// table (lfml 0.2.10_2.c): their token types are compared
+// by number only. -Wl,-Bsymbolic keeps the generations' identically named
+// functions from binding to each other once several are loaded.
+// bench/history_build.sh builds every generation that still compiles.
+
+#ifndef HISTORY_SOURCE
+#error "HISTORY_SOURCE must name the lexer source to wrap"
+#endif
+
+#define main history_legacy_main
+#include HISTORY_SOURCE
+#undef main
+
+#include "history.h"
+
+static void* history_lex(const char* source, size_t length) {
+    (void)length;
+    Lexer* lexer = init_lexer(source);
+    tokenize(lexer);
+    return lexer;
+}
+
+static size_t history_count(void* run) {
+    return ((Lexer*)run)->token_count;
+}
+
+static void history_token(void* run, size_t index, HistoryToken* token) {
+    const Token* source_token = &((Lexer*)run)->tokens[index];
+    token->type_id = (int)source_token->type;
+#ifdef HISTORY_NO_TOKEN_NAMES
+    token->type = NULL;
+#else
+    token->type = token_names[source_token->type];
+#endif
+    token->text = source_token->value;
+    token->length = source_token->value ? (size_t)source_token->length : 0;
+    token->line = source_token->line;
+    token->column = source_token->column;
+}
+
+static void history_release(void* run) {
+    free_lexer((Lexer*)run);
+}
+
+const HistoryLexer history_lexer = {
+    history_lex,
+    history_count,
+    history_token,
+    history_release
+};
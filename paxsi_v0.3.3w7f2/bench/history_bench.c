@@ -0,0 +1,593 @@
+// Cross-version lexer benchmark: runs the current lexer and every
+// historical generation built by bench/history_build.sh on the same
+// corpus, reports throughput and memory per version and compares each
+// version's token stream with the current one.
+//
+// Build (from paxsi_v0.3.3w7f2/):
+//   bench/history_build.sh
+//   gcc -O2 -DPAXSI_NO_MAIN -DCORPUS_NO_MAIN -I. -Ibench -o history_bench
+//       bench/history_bench.c bench/corpus_gen.c lexer.c parser.c -ldl
+// Usage:
+//   ./history_bench [--mix NAME] [--seed N] [--size BYTES] [--input FILE]
+//                   [--iterations N] [--timeout SECONDS] [--json]
+//                   history/*.so
+// Without --input a corpus is generated (bench/corpus_gen.c; default: the
+// balanced mix, seed 1, 2 MB). Every version runs in a child process, so
+// one that crashes or hangs on newer syntax is reported instead of taking
+// the harness down. Per version: best tokenize() time over the
+// iterations, MB/s, tokens/s, heap allocations and how far the peak RSS
+// rose above the process baseline while lexing.
+//
+// Token streams are compared on the overlap of the grammars: tokens of a
+// type the other version never produced on this input are skipped, the
+// rest must agree in type name and text. The first difference is shown.
+// 3.3w4 to 3.3w7 never leave a block comment that spans lines, so they
+// time out on the balanced and comments mixes; the idents, literals and
+// nested mixes stay within their grammar.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "lexer.h"
+#include "corpus_gen.h"
+#include "history.h"
+
+// Count heap traffic by interposing the allocator (glibc only); the
+// generations' libraries resolve malloc to these as well
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static size_t alloc_count = 0;
+
+void* malloc(size_t size) { alloc_count++; return __libc_malloc(size); }
+void* calloc(size_t count, size_t size) { alloc_count++; return __libc_calloc(count, size); }
+void* realloc(void* ptr, size_t size) { alloc_count++; return __libc_realloc(ptr, size); }
+void free(void* ptr) { __libc_free(ptr); }
+#define ALLOC_COUNTING 1
+#else
+static size_t alloc_count = 0;
+#define ALLOC_COUNTING 0
+#endif
+
+// The current lexer behind the same interface as the generations
+
+static void* current_lex(const char* source, size_t length) {
+    Lexer* lexer = init_lexer_n(source, length);
+    tokenize(lexer);
+    return lexer;
+}
+
+static size_t current_count(void* run) {
+    return ((Lexer*)run)->tokens.count;
+}
+
+static void current_token(void* run, size_t index, HistoryToken* token) {
+    Token source_token = token_at(&((Lexer*)run)->tokens, index);
+    token->type_id = (int)source_token.type;
+    token->type = token_names[source_token.type];
+    token->text = source_token.value;
+    token->length = source_token.value ? source_token.length : 0;
+    token->line = (long)source_token.line;
+    token->column = (long)source_token.column;
+}
+
+static void current_release(void* run) {
+    free_lexer((Lexer*)run);
+}
+
+static const HistoryLexer current_lexer = {
+    current_lex,
+    current_count,
+    current_token,
+    current_release
+};
+
+// What a child reports back ahead of its token stream
+typedef struct {
+    double seconds;
+    size_t allocations;
+    long peak_rss_kb;   // -1 if unavailable
+    size_t count;
+} RunStats;
+
+// A version's token stream as read back by the parent. Type names are
+// interned into type_names so streams can be compared by number.
+typedef struct {
+    uint32_t* types;
+    uint32_t* text_offsets;
+    uint32_t* text_lengths;
+    long* lines;
+    long* columns;
+    char* text;
+    size_t count;
+} TokenDump;
+
+typedef enum {
+    VERSION_OK,
+    VERSION_LOAD_FAILED,
+    VERSION_CRASHED,
+    VERSION_TIMED_OUT
+} VersionStatus;
+
+typedef struct {
+    const char* name;
+    VersionStatus status;
+    int signal;
+    RunStats stats;
+    TokenDump dump;
+    // Comparison with the reference (the current lexer)
+    size_t compared;
+    size_t matching;
+    bool identical;
+    size_t difference;        // first differing token in the reference...
+    size_t difference_other;  // ...and in this version (count = at the end)
+} Version;
+
+#define MAX_TYPE_NAMES 1024
+
+static char* type_names[MAX_TYPE_NAMES];
+static size_t type_name_count = 0;
+
+// Older generations spell type names as "<INT>", newer ones as "INT"
+static uint32_t intern_type_name(const char* name) {
+    size_t length = strlen(name);
+    if (length > 2 && name[0] == '<' && name[length - 1] == '>') {
+        name++;
+        length -= 2;
+    }
+    for (size_t i = 0; i < type_name_count; i++) {
+        if (strncmp(type_names[i], name, length) == 0 && type_names[i][length] == '\0') return (uint32_t)i;
+    }
+    if (type_name_count == MAX_TYPE_NAMES) return MAX_TYPE_NAMES - 1;
+    type_names[type_name_count] = strndup(name, length);
+    return (uint32_t)type_name_count++;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long status_field_kb(const char* field) {
+    FILE* file = fopen("/proc/self/status", "r");
+    if (!file) return -1;
+    char line[256];
+    size_t field_length = strlen(field);
+    long value = -1;
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, field, field_length) == 0) value = strtol(line + field_length, NULL, 10);
+    }
+    fclose(file);
+    return value;
+}
+
+// Reset the high-water mark (Linux) and return the RSS it starts from:
+// a child inherits the parent's resident pages, so only the rise above
+// this baseline belongs to the lexer
+static long reset_peak_rss(void) {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if (!file) return -1;
+    fputs("5", file);
+    fclose(file);
+    return status_field_kb("VmRSS:");
+}
+
+static void write_token(FILE* out, const HistoryToken* token) {
+    char number[16];
+    const char* type = token->type;
+    if (!type) {
+        snprintf(number, sizeof(number), "#%d", token->type_id);
+        type = number;
+    }
+    uint32_t type_length = (uint32_t)strlen(type);
+    uint32_t text_length = (uint32_t)token->length;
+    fwrite(&type_length, sizeof(type_length), 1, out);
+    fwrite(type, 1, type_length, out);
+    fwrite(&text_length, sizeof(text_length), 1, out);
+    fwrite(token->text, 1, text_length, out);
+    fwrite(&token->line, sizeof(token->line), 1, out);
+    fwrite(&token->column, sizeof(token->column), 1, out);
+}
+
+// Child side: lex, measure, write the stats and the last run's tokens
+static void run_version(const HistoryLexer* lexer, const char* source, size_t size, int iterations, FILE* out) {
+    RunStats stats = { 0 };
+    void* run = NULL;
+    for (int i = 0; i < iterations; i++) {
+        if (run) lexer->release(run);
+        long baseline = reset_peak_rss();
+        size_t allocations = alloc_count;
+        double start = now_seconds();
+        run = lexer->lex(source, size);
+        double elapsed = now_seconds() - start;
+        if (i == 0 || elapsed < stats.seconds) stats.seconds = elapsed;
+        if (i == 0) {
+            long peak = status_field_kb("VmHWM:");
+            stats.allocations = alloc_count - allocations;
+            stats.peak_rss_kb = baseline >= 0 && peak >= 0 ? peak - baseline : -1;
+        }
+    }
+    stats.count = lexer->count(run);
+    fwrite(&stats, sizeof(stats), 1, out);
+    for (size_t i = 0; i < stats.count; i++) {
+        HistoryToken token;
+        lexer->token(run, i, &token);
+        write_token(out, &token);
+    }
+    lexer->release(run);
+    fflush(out);
+}
+
+static bool read_dump(FILE* in, TokenDump* dump, size_t count) {
+    size_t text_capacity = 1 << 16, text_length = 0;
+    dump->types = malloc(count * sizeof(uint32_t));
+    dump->text_offsets = malloc(count * sizeof(uint32_t));
+    dump->text_lengths = malloc(count * sizeof(uint32_t));
+    dump->lines = malloc(count * sizeof(long));
+    dump->columns = malloc(count * sizeof(long));
+    dump->text = malloc(text_capacity);
+    dump->count = 0;
+    char type[256];
+    for (size_t i = 0; i < count; i++) {
+        uint32_t type_length, length;
+        if (fread(&type_length, sizeof(type_length), 1, in) != 1 || type_length >= sizeof(type)) return false;
+        if (fread(type, 1, type_length, in) != type_length) return false;
+        type[type_length] = '\0';
+        if (fread(&length, sizeof(length), 1, in) != 1) return false;
+        if (text_length + length > text_capacity) {
+            while (text_length + length > text_capacity) text_capacity *= 2;
+            dump->text = realloc(dump->text, text_capacity);
+        }
+        if (fread(dump->text + text_length, 1, length, in) != length) return false;
+        if (fread(&dump->lines[i], sizeof(long), 1, in) != 1) return false;
+        if (fread(&dump->columns[i], sizeof(long), 1, in) != 1) return false;
+        dump->types[i] = intern_type_name(type);
+        dump->text_offsets[i] = (uint32_t)text_length;
+        dump->text_lengths[i] = length;
+        text_length += length;
+        dump->count++;
+    }
+    return true;
+}
+
+static void free_dump(TokenDump* dump) {
+    free(dump->types);
+    free(dump->text_offsets);
+    free(dump->text_lengths);
+    free(dump->lines);
+    free(dump->columns);
+    free(dump->text);
+}
+
+// Parent side: run one version in a child and collect what it wrote
+static void measure_version(Version* version, const char* library, const char* source, size_t size,
+                            int iterations, int timeout) {
+    FILE* results = tmpfile();
+    if (!results) {
+        perror("tmpfile");
+        exit(1);
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (child == 0) {
+        const HistoryLexer* lexer = &current_lexer;
+        if (library) {
+            void* handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+            lexer = handle ? dlsym(handle, HISTORY_ENTRY) : NULL;
+            if (!lexer) {
+                fprintf(stderr, "%s\n", dlerror());
+                _exit(2);
+            }
+        }
+        alarm(timeout);
+        run_version(lexer, source, size, iterations, results);
+        _exit(0);
+    }
+
+    int status;
+    waitpid(child, &status, 0);
+    if (WIFSIGNALED(status)) {
+        version->signal = WTERMSIG(status);
+        version->status = version->signal == SIGALRM ? VERSION_TIMED_OUT : VERSION_CRASHED;
+    } else if (WEXITSTATUS(status) != 0) {
+        version->status = VERSION_LOAD_FAILED;
+    } else {
+        rewind(results);
+        if (fread(&version->stats, sizeof(version->stats), 1, results) != 1 ||
+            !read_dump(results, &version->dump, version->stats.count)) {
+            version->status = VERSION_CRASHED;
+        }
+    }
+    fclose(results);
+}
+
+// Compare on the types both streams contain; see the header comment
+static void compare_versions(const TokenDump* reference, Version* version) {
+    const TokenDump* dump = &version->dump;
+    bool in_reference[MAX_TYPE_NAMES] = { false };
+    bool in_version[MAX_TYPE_NAMES] = { false };
+    for (size_t i = 0; i < reference->count; i++) in_reference[reference->types[i]] = true;
+    for (size_t i = 0; i < dump->count; i++) in_version[dump->types[i]] = true;
+
+    size_t i = 0, j = 0;
+    version->compared = version->matching = 0;
+    version->identical = true;
+    for (;;) {
+        while (i < reference->count && !in_version[reference->types[i]]) i++;
+        while (j < dump->count && !in_reference[dump->types[j]]) j++;
+        if (i == reference->count || j == dump->count) {
+            if (i != reference->count || j != dump->count) version->identical = false;
+            break;
+        }
+        version->compared++;
+        if (reference->types[i] != dump->types[j] ||
+            reference->text_lengths[i] != dump->text_lengths[j] ||
+            memcmp(reference->text + reference->text_offsets[i], dump->text + dump->text_offsets[j],
+                   reference->text_lengths[i]) != 0) {
+            version->identical = false;
+            break;
+        }
+        version->matching++;
+        i++;
+        j++;
+    }
+    version->difference = i;
+    version->difference_other = j;
+}
+
+static const char* status_text(const Version* version) {
+    switch (version->status) {
+        case VERSION_OK:          return "ok";
+        case VERSION_LOAD_FAILED: return "load failed";
+        case VERSION_CRASHED:     return "crashed";
+        case VERSION_TIMED_OUT:   return "timed out";
+    }
+    return "?";
+}
+
+// "TYPE \"text\" at line:column", text shortened to fit a report line
+static void describe_token(char* buffer, size_t size, const TokenDump* dump, size_t index) {
+    if (index >= dump->count) {
+        snprintf(buffer, size, "end of stream");
+        return;
+    }
+    char text[48];
+    size_t length = 0;
+    const char* source = dump->text + dump->text_offsets[index];
+    for (size_t i = 0; i < dump->text_lengths[index] && length + 5 < sizeof(text); i++) {
+        unsigned char c = (unsigned char)source[i];
+        if (c == '"' || c == '\\') {
+            text[length++] = '\\';
+            text[length++] = (char)c;
+        } else if (c < 0x20) {
+            length += snprintf(text + length, sizeof(text) - length, "\\x%02x", c);
+        } else {
+            text[length++] = (char)c;
+        }
+    }
+    text[length] = '\0';
+    if (length + 5 >= sizeof(text)) strcpy(text + length, "...");
+    snprintf(buffer, size, "%s \"%s\" at %ld:%ld", type_names[dump->types[index]], text,
+             dump->lines[index], dump->columns[index]);
+}
+
+static void version_rates(const Version* version, size_t size, double* mb, double* tokens) {
+    double seconds = version->stats.seconds > 0 ? version->stats.seconds : 1e-9;
+    *mb = size / seconds / 1e6;
+    *tokens = version->stats.count / seconds;
+}
+
+static void print_text(const Version* versions, int count, const char* input, size_t size) {
+    printf("input: %s, %zu bytes\n", input, size);
+    printf("%-16s %10s %9s %9s %10s %10s %9s\n",
+           "version", "ms", "MB/s", "Mtok/s", "allocs", "peak KB", "tokens");
+    for (int v = 0; v < count; v++) {
+        const Version* version = &versions[v];
+        if (version->status != VERSION_OK) {
+            printf("%-16s %s", version->name, status_text(version));
+            if (version->status == VERSION_CRASHED && version->signal) printf(" (signal %d)", version->signal);
+            printf("\n");
+            continue;
+        }
+        double mb, tokens;
+        version_rates(version, size, &mb, &tokens);
+        printf("%-16s %10.3f %9.2f %9.2f", version->name, version->stats.seconds * 1e3, mb, tokens / 1e6);
+        if (ALLOC_COUNTING) printf(" %10zu", version->stats.allocations);
+        else printf(" %10s", "-");
+        if (version->stats.peak_rss_kb >= 0) printf(" %10ld", version->stats.peak_rss_kb);
+        else printf(" %10s", "-");
+        printf(" %9zu\n", version->stats.count);
+    }
+
+    if (count < 2 || versions[0].status != VERSION_OK) return;
+    printf("\ntoken streams against %s:\n", versions[0].name);
+    for (int v = 1; v < count; v++) {
+        const Version* version = &versions[v];
+        if (version->status != VERSION_OK) continue;
+        if (version->compared == 0 && version->identical) {
+            printf("%-16s no token types in common\n", version->name);
+            continue;
+        }
+        if (version->identical) {
+            printf("%-16s identical on %zu shared tokens\n", version->name, version->compared);
+            continue;
+        }
+        char expected[128], actual[128];
+        describe_token(expected, sizeof(expected), &versions[0].dump, version->difference);
+        describe_token(actual, sizeof(actual), &version->dump, version->difference_other);
+        printf("%-16s %zu shared tokens match, then %s\n%-16s   instead of %s\n",
+               version->name, version->matching, actual, "", expected);
+    }
+}
+
+static void print_json_string(const char* text) {
+    putchar('"');
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') printf("\\%c", *text);
+        else if ((unsigned char)*text < 0x20) printf("\\u%04x", *text);
+        else putchar(*text);
+    }
+    putchar('"');
+}
+
+static void print_json(const Version* versions, int count, const char* input, size_t size, int iterations) {
+    printf("{\"benchmark\": \"history\", \"input\": ");
+    print_json_string(input);
+    printf(", \"bytes\": %zu, \"iterations\": %d, \"versions\": [", size, iterations);
+    for (int v = 0; v < count; v++) {
+        const Version* version = &versions[v];
+        printf("%s{\"name\": ", v ? ", " : "");
+        print_json_string(version->name);
+        printf(", \"status\": ");
+        print_json_string(status_text(version));
+        if (version->status == VERSION_OK) {
+            double mb, tokens;
+            version_rates(version, size, &mb, &tokens);
+            printf(", \"seconds\": %.6f, \"mb_per_s\": %.3f, \"tokens_per_s\": %.0f, \"tokens\": %zu",
+                   version->stats.seconds, mb, tokens, version->stats.count);
+            if (ALLOC_COUNTING) printf(", \"allocations\": %zu", version->stats.allocations);
+            else printf(", \"allocations\": null");
+            if (version->stats.peak_rss_kb >= 0) printf(", \"peak_rss_kb\": %ld", version->stats.peak_rss_kb);
+            else printf(", \"peak_rss_kb\": null");
+            if (v > 0 && versions[0].status == VERSION_OK) {
+                printf(", \"compared\": %zu, \"matching\": %zu, \"identical\": %s",
+                       version->compared, version->matching, version->identical ? "true" : "false");
+                if (!version->identical) {
+                    char expected[128], actual[128];
+                    describe_token(expected, sizeof(expected), &versions[0].dump, version->difference);
+                    describe_token(actual, sizeof(actual), &version->dump, version->difference_other);
+                    printf(", \"first_difference\": {\"expected\": ");
+                    print_json_string(expected);
+                    printf(", \"actual\": ");
+                    print_json_string(actual);
+                    printf("}");
+                }
+            }
+        }
+        printf("}");
+    }
+    printf("]}\n");
+}
+
+static char* load_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror("Couldn't open the file");
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    rewind(file);
+    char* buffer = malloc(file_size + 1);
+    if (buffer && fread(buffer, 1, file_size, file) != (size_t)file_size) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+    if (!buffer) return NULL;
+    buffer[file_size] = '\0';
+    *size = file_size;
+    return buffer;
+}
+
+// "history/0.2.12.so" -> "0.2.12"
+static const char* version_name(const char* library) {
+    const char* slash = strrchr(library, '/');
+    const char* name = slash ? slash + 1 : library;
+    size_t length = strlen(name);
+    if (length > 3 && strcmp(name + length - 3, ".so") == 0) length -= 3;
+    return strndup(name, length);
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--mix NAME] [--seed N] [--size BYTES] [--input FILE] "
+                    "[--iterations N] [--timeout SECONDS] [--json] library.so...\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    CorpusOptions options = { 1, 2u << 20, CORPUS_BALANCED };
+    const char* input_file = NULL;
+    bool json = false;
+    int iterations = 3;
+    int timeout = 30;
+    int libraries = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) options.seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) options.size = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) input_file = argv[++i];
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) iterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) timeout = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--json") == 0) json = true;
+        else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+            if (!corpus_mix_from_name(argv[++i], &options.mix)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            argv[++libraries] = argv[i];
+        }
+    }
+    if (iterations <= 0 || timeout <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char input[64];
+    size_t size;
+    char* source;
+    if (input_file) {
+        source = load_file(input_file, &size);
+    } else {
+        snprintf(input, sizeof(input), "%s, seed %llu", corpus_mix_name(options.mix),
+                 (unsigned long long)options.seed);
+        source = generate_corpus(&options, &size);
+    }
+    if (!source) return 1;
+
+    int count = libraries + 1;
+    Version* versions = calloc(count, sizeof(Version));
+    versions[0].name = "current";
+    measure_version(&versions[0], NULL, source, size, iterations, timeout);
+    for (int v = 1; v < count; v++) {
+        versions[v].name = version_name(argv[v]);
+        measure_version(&versions[v], argv[v], source, size, iterations, timeout);
+        if (versions[0].status == VERSION_OK && versions[v].status == VERSION_OK) {
+            compare_versions(&versions[0].dump, &versions[v]);
+        }
+    }
+
+    if (json) print_json(versions, count, input_file ? input_file : input, size, iterations);
+    else print_text(versions, count, input_file ? input_file : input, size);
+
+    for (int v = 0; v < count; v++) {
+        if (versions[v].status == VERSION_OK) free_dump(&versions[v].dump);
+    }
+    free(versions);
+    free(source);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Builds every historical lexer generation into history/<version>.so for
+# history_bench.c (see bench/history_adapter.c). Run from paxsi_v0.3.3w7f2/.
+#
+# Not built, because the sources don't compile as they were kept:
+#   lfml_0.2.0.c       parse_variable_usage declared and called, never defined
+#   lfml_0.2.9.c       TokenType closed twice
+#   paxsi 0.2.11.c     doubled UTF-8 byte order mark
+#   paxsi 0.3.1w1.c, paxsi 0.3.1w2.c, paxsi 0.3.2w1.c
+#                      token_names refers to the removed TOKEN_IDENTIFIER
+#   paxsi 3.2w3        corrupted identifier in tokenize()
+#   paxsi 3.3w3.c      SHIFT called with one argument, missing semicolons
+
+set -e
+mkdir -p history
+
+build() {
+    version=$1
+    source=$2
+    shift 2
+    gcc -O2 -w -shared -fPIC -Wl,-Bsymbolic -Ibench "$@" \
+        -DHISTORY_SOURCE="\"../../$source\"" bench/history_adapter.c \
+        -o "history/$version.so"
+    echo "history/$version.so"
+}
+
+build lfml-0.2.10    "lfml 0.2.10.c"
+build lfml-0.2.10_2  "lfml 0.2.10_2.c" -DHISTORY_NO_TOKEN_NAMES
+build 0.2.12         "paxsi 0.2.12.c"
+build 0.2.13w1       "paxsi 0.2.13w1.c"
+build 0.2.14w3       "paxsi 0.2.14w3.c"
+build 0.2.14w4       "paxsi 0.2.14w4.c"
+build 0.3.0w1        "paxsi 0.3.0w1.c"
+build 3.2w2          "paxsi 3.2w2/lexer 3.2w2.c"
+build 3.2w4          "paxsi 3.2w4/lexer 3.2w4.c"
+build 3.3w1          "paxsi 3.3w1/lexer 3.3w1.c"
+build 3.3w4          "paxsi 3.3w4/lexer.c"
+build 3.3w5f2        "paxsi 3.3w5f2/lexer.c"
+build 3.3w6          "paxsi 3.3w6/lexer.c"
+build 3.3w7          "paxsi 3.3w7/lexer.c"
@@ -0,0 +1,175 @@
+// Lexer throughput benchmark: tokens/sec and heap allocations per tokenize().
+//
+// Build (from paxsi_v0.3.3w7f2/):
+//   gcc -O2 -DPAXSI_NO_MAIN -I. bench/lexer_bench.c lexer.c parser.c -o lexer_bench
+// Usage:
+//   ./lexer_bench [source_file | --idents | --comments] [iterations] [threads]
+// Without a source file a synthetic ~8 MB input is generated in memory;
+// --idents generates identifier-dense input (keywords, types, modifiers
+// and plain names) to measure word classification; --comments generates
+// license headers, commented-out blocks and deep indentation. With
+// threads > 1 the input is lexed by tokenize_parallel (link with -pthread).
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lexer.h"
+
+// Count heap traffic by interposing the allocator (glibc only)
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static size_t alloc_count = 0;
+static size_t free_count = 0;
+
+void* malloc(size_t size) { alloc_count++; return __libc_malloc(size); }
+void* calloc(size_t count, size_t size) { alloc_count++; return __libc_calloc(count, size); }
+void* realloc(void* ptr, size_t size) { alloc_count++; return __libc_realloc(ptr, size); }
+void free(void* ptr) { if (ptr) free_count++; __libc_free(ptr); }
+#define ALLOC_COUNTING 1
+#else
+static size_t alloc_count = 0;
+static size_t free_count = 0;
+#define ALLOC_COUNTING 0
+#endif
+
+// Representative mix of declarations, expressions, literals and comments
+static const char* sample =
+    "$counter: int = 0x1F_FF;\n"
+    "$ratio: [const, static] real:64 = 1.5e+10;\n"
+    "$name: char = \"plain text\";\n"
+    "$escaped: char = \"tab\\there\\n\";\n"
+    "$letter: char = 'z';\n"
+    "</ block comment />\n"
+    "__start(argc) {\n"
+    "    counter = counter + 1 * (ratio - 2) / value;\n"
+    "    if counter == 10 { ratio += helper(counter); } else { counter -= 1; }\n"
+    "    flags = flags | mask & bits ^ other >> 2 << 3;\n"
+    "    result = alloc(size) + malloc(count) ** 2;\n"
+    "}\n";
+
+// Words only: exercises identifier scanning and keyword classification
+static const char* ident_sample =
+    "counter if iffy value else elsewhere elif int integer real realm char\n"
+    "void const constant static statics return returned ralloc malloc free\n"
+    "freedom do docs goto continue compile_flags alloc allocator parse this\n"
+    "NONE NONEx size sizeof delete ealloc extern global local regis dynam\n"
+    "protected unsig signed break breaks alpha beta gamma delta epsilon zeta\n";
+
+// Comment- and whitespace-heavy: measures skip_whitespace/skip_comments
+static const char* comment_sample =
+    "##########################################################################\n"
+    "# Copyright (c) The Paxsi authors. Licensed under the terms found in the  \n"
+    "# LICENSE file at the root of this distribution. Provided as is, without \n"
+    "# warranty of any kind, express or implied.                              \n"
+    "##########################################################################\n"
+    "</ Disabled while the allocator is reworked:\n"
+    "    $pool: [static] int = alloc(4096);\n"
+    "    </ nested: release(pool); />\n"
+    "    pool = NONE;\n"
+    "/>\n"
+    "__start(argc) {\n"
+    "                if counter == 10 {\n"
+    "                                ratio += 1;\n"
+    "                }\n"
+    "\n"
+    "\n"
+    "}\n";
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char* load_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        perror("Couldn't open the file");
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    rewind(file);
+    char* buffer = malloc(file_size + 1);
+    if (buffer && fread(buffer, 1, file_size, file) != (size_t)file_size) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+    if (!buffer) return NULL;
+    buffer[file_size] = '\0';
+    *size = file_size;
+    return buffer;
+}
+
+static char* make_synthetic(const char* pattern, size_t target, size_t* size) {
+    size_t sample_len = strlen(pattern);
+    size_t copies = target / sample_len + 1;
+    char* buffer = malloc(copies * sample_len + 1);
+    if (!buffer) return NULL;
+    for (size_t i = 0; i < copies; i++) {
+        memcpy(buffer + i * sample_len, pattern, sample_len);
+    }
+    buffer[copies * sample_len] = '\0';
+    *size = copies * sample_len;
+    return buffer;
+}
+
+int main(int argc, char* argv[]) {
+    size_t size = 0;
+    char* source;
+    if (argc <= 1) source = make_synthetic(sample, 8u << 20, &size);
+    else if (strcmp(argv[1], "--idents") == 0) source = make_synthetic(ident_sample, 8u << 20, &size);
+    else if (strcmp(argv[1], "--comments") == 0) source = make_synthetic(comment_sample, 8u << 20, &size);
+    else source = load_file(argv[1], &size);
+    int iterations = argc > 2 ? atoi(argv[2]) : 5;
+    int threads = argc > 3 ? atoi(argv[3]) : 1;
+    if (!source || iterations <= 0 || threads <= 0) {
+        fprintf(stderr, "Usage: %s [source_file | --idents | --comments] [iterations] [threads]\n", argv[0]);
+        return 1;
+    }
+
+    double best = 0;
+    size_t tokens = 0;
+    size_t allocs = 0;
+    size_t frees = 0;
+    for (int i = 0; i < iterations; i++) {
+        size_t allocs_before = alloc_count;
+        size_t frees_before = free_count;
+        double start = now_seconds();
+
+        Lexer* lexer = init_lexer(source);
+        if (threads > 1) tokenize_parallel(lexer, threads);
+        else tokenize(lexer);
+        tokens = lexer->tokens.count;
+        free_lexer(lexer);
+
+        double elapsed = now_seconds() - start;
+        if (i == 0 || elapsed < best) best = elapsed;
+        allocs = alloc_count - allocs_before;
+        frees = free_count - frees_before;
+    }
+
+    printf("input:        %zu bytes\n", size);
+    printf("threads:      %d\n", threads);
+    printf("tokens:       %zu\n", tokens);
+    printf("best time:    %.3f ms\n", best * 1e3);
+    printf("throughput:   %.2f Mtokens/s, %.2f MB/s\n",
+           tokens / best / 1e6, size / best / 1e6);
+    if (ALLOC_COUNTING) {
+        printf("allocations:  %zu (%.3f per token), frees: %zu\n",
+               allocs, tokens ? (double)allocs / tokens : 0.0, frees);
+    } else {
+        printf("allocations:  not available on this platform\n");
+    }
+
+    free(source);
+    return 0;
+}
@@ -5,9 +5,34 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <float.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define PAXSI_HAVE_MMAP 1
+#include <dirent.h>
+#define PAXSI_HAVE_DIRENT 1
+#include <pthread.h>
+#define PAXSI_HAVE_THREADS 1
+#endif
+
+// Vector kernels for whitespace and comments; build with -DPAXSI_NO_SIMD
+// to force the scalar versions
+#if !defined(PAXSI_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define PAXSI_HAVE_X86_SIMD 1
+#endif
 
 #include "parser.h"
 #include "lexer.h"
+#include "power_of_five.h"
 
 // Mapping of token types to their string names
 const char* token_names[] = {
@@ -112,7 +137,9 @@ const char* token_names[] = {
     [TOKEN_ERROR]               =   "ERROR"
 };
 
-// File header structure for token binary files
+// File header structure for token binary files (version 1, host byte
+// order; each token follows as type, value length, value, line, column
+// and length)
 typedef struct {
     char signature[4];
     uint16_t version;
@@ -120,49 +147,765 @@ typedef struct {
     uint32_t token_count;
 } TokenFileHeader;
 
-// Initialize lexer with source code input
+// Version 2 of the token file, little-endian throughout:
+//   0   "PAXT", u16 version = 2, u16 record size
+//   8   u64 token count
+//   16  u64 offset of the records (= TOKEN_FILE_HEADER_SIZE)
+//   24  u64 offset of the string pool
+//   32  u64 length of the string pool
+//   40  u64 checksum of everything after the header
+//   48  zero up to TOKEN_FILE_HEADER_SIZE
+// Then one fixed-size record per token:
+//   0   u32 type, u32 symbol, u32 value length, u32 number kind
+//   16  u64 value offset in the string pool
+//   24  i64 line, i64 column
+//   40  u64 number (int64, uint64 or IEEE double bits)
+// and the string pool, every value followed by a NUL. Sections start and
+// end on 8-byte boundaries, so a mapped file can be read in place.
+#define TOKEN_FILE_VERSION 2
+#define TOKEN_FILE_HEADER_SIZE 64
+#define TOKEN_RECORD_SIZE 48
+
+// Character classes for the scanner's hot loops. Indexed by unsigned
+// byte, so unlike <ctype.h> they ignore the locale and never see negative
+// values. The NUL sentinel after the input has class 0, which terminates
+// every run without a separate bounds check.
+enum {
+    CHAR_ALPHA       = 1 << 0,  // A-Z a-z
+    CHAR_DIGIT       = 1 << 1,  // 0-9
+    CHAR_IDENT_START = 1 << 2,  // A-Z a-z _
+    CHAR_IDENT       = 1 << 3,  // A-Z a-z 0-9 _
+    CHAR_SPACE       = 1 << 4   // space, tab, newline
+};
+
+#define A (CHAR_ALPHA | CHAR_IDENT_START | CHAR_IDENT)
+#define D (CHAR_DIGIT | CHAR_IDENT)
+#define U (CHAR_IDENT_START | CHAR_IDENT)
+#define W CHAR_SPACE
+static const uint8_t char_class[256] = {
+    /* 0x00 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  W,  W,  0,  0,  0,  0,  0,
+    /* 0x10 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0x20 */  W,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0x30 */  D,  D,  D,  D,  D,  D,  D,  D,  D,  D,  0,  0,  0,  0,  0,  0,
+    /* 0x40 */  0,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,
+    /* 0x50 */  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  0,  0,  0,  0,  U,
+    /* 0x60 */  0,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,
+    /* 0x70 */  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  A,  0,  0,  0,  0,  0,
+    /* 0x80 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0x90 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0xA0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0xB0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0xC0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0xD0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0xE0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0xF0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0
+};
+#undef A
+#undef D
+#undef U
+#undef W
+
+// Value of a digit in any base up to 36; X marks non-digits
+#define X 0xFF
+static const uint8_t digit_value[256] = {
+    /* 0x00 */  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    /* 0x10 */  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    /* 0x20 */  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    /* 0x30 */  0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  X,  X,  X,  X,  X,  X,
+    /* 0x40 */  X, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24,
+    /* 0x50 */ 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35,  X,  X,  X,  X,  X,
+    /* 0x60 */  X, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24,
+    /* 0x70 */ 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35,  X,  X,  X,  X,  X,
+    /* 0x80 */  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    /* 0x90 */  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    /* 0xA0 */  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    /* 0xB0 */  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    /* 0xC0 */  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    /* 0xD0 */  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    /* 0xE0 */  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    /* 0xF0 */  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X
+};
+#undef X
+
+#define CHAR_CLASS(c) (char_class[(unsigned char)(c)])
+
+// Bulk scans over whitespace, comment text and literals. Each kernel
+// returns the position where the scan stopped (or `end`); lines are not
+// tracked while scanning but resolved later from the newline index.
+
+// Skip spaces, tabs and newlines
+static size_t scan_blank_scalar(const char* input, size_t position, size_t end) {
+    while (position < end && (CHAR_CLASS(input[position]) & CHAR_SPACE)) position++;
+    return position;
+}
+
+// Position of the first `a`, `b` or `c` in input[position, end), or end
+static size_t find_any_scalar(const char* input, size_t position, size_t end, char a, char b, char c) {
+    while (position < end && input[position] != a && input[position] != b && input[position] != c) {
+        position++;
+    }
+    return position;
+}
+
+// Number of newlines in input[position, end)
+static size_t count_newlines_scalar(const char* input, size_t position, size_t end) {
+    size_t count = 0;
+    for (; position < end; position++) count += input[position] == '\n';
+    return count;
+}
+
+// Store the offset just past every newline in input[position, end)
+static size_t list_newlines_scalar(const char* input, size_t position, size_t end, uint32_t* starts) {
+    size_t count = 0;
+    for (; position < end; position++) {
+        if (input[position] == '\n') starts[count++] = (uint32_t)(position + 1);
+    }
+    return count;
+}
+
+#ifdef PAXSI_HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t scan_blank_sse2(const char* input, size_t position, size_t end) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; position + 16 <= end; position += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(input + position));
+        __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(chunk, newline),
+                                     _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                                                  _mm_cmpeq_epi8(chunk, tab)));
+        uint32_t stop = ~(uint32_t)_mm_movemask_epi8(blank) & 0xFFFF;
+        if (stop) return position + __builtin_ctz(stop);
+    }
+    return scan_blank_scalar(input, position, end);
+}
+
+__attribute__((target("sse2")))
+static size_t find_any_sse2(const char* input, size_t position, size_t end, char a, char b, char c) {
+    const __m128i first = _mm_set1_epi8(a);
+    const __m128i second = _mm_set1_epi8(b);
+    const __m128i third = _mm_set1_epi8(c);
+    for (; position + 16 <= end; position += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(input + position));
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(chunk, first),
+                                     _mm_or_si128(_mm_cmpeq_epi8(chunk, second),
+                                                  _mm_cmpeq_epi8(chunk, third)));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(found);
+        if (mask) return position + __builtin_ctz(mask);
+    }
+    return find_any_scalar(input, position, end, a, b, c);
+}
+
+__attribute__((target("sse2")))
+static size_t count_newlines_sse2(const char* input, size_t position, size_t end) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    for (; position + 16 <= end; position += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(input + position));
+        count += __builtin_popcount((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+    }
+    return count + count_newlines_scalar(input, position, end);
+}
+
+__attribute__((target("sse2")))
+static size_t list_newlines_sse2(const char* input, size_t position, size_t end, uint32_t* starts) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    for (; position + 16 <= end; position += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(input + position));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        for (; mask; mask &= mask - 1) starts[count++] = (uint32_t)(position + __builtin_ctz(mask) + 1);
+    }
+    return count + list_newlines_scalar(input, position, end, starts + count);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_blank_avx2(const char* input, size_t position, size_t end) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; position + 32 <= end; position += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(input + position));
+        __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, newline),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space),
+                                                        _mm256_cmpeq_epi8(chunk, tab)));
+        uint32_t stop = ~(uint32_t)_mm256_movemask_epi8(blank);
+        if (stop) return position + __builtin_ctz(stop);
+    }
+    return scan_blank_sse2(input, position, end);
+}
+
+__attribute__((target("avx2")))
+static size_t find_any_avx2(const char* input, size_t position, size_t end, char a, char b, char c) {
+    const __m256i first = _mm256_set1_epi8(a);
+    const __m256i second = _mm256_set1_epi8(b);
+    const __m256i third = _mm256_set1_epi8(c);
+    for (; position + 32 <= end; position += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(input + position));
+        __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, first),
+                                        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, second),
+                                                        _mm256_cmpeq_epi8(chunk, third)));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(found);
+        if (mask) return position + __builtin_ctz(mask);
+    }
+    return find_any_sse2(input, position, end, a, b, c);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_newlines_avx2(const char* input, size_t position, size_t end) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    for (; position + 32 <= end; position += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(input + position));
+        count += __builtin_popcount((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline)));
+    }
+    return count + count_newlines_sse2(input, position, end);
+}
+
+__attribute__((target("avx2")))
+static size_t list_newlines_avx2(const char* input, size_t position, size_t end, uint32_t* starts) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    for (; position + 32 <= end; position += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(input + position));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        for (; mask; mask &= mask - 1) starts[count++] = (uint32_t)(position + __builtin_ctz(mask) + 1);
+    }
+    return count + list_newlines_sse2(input, position, end, starts + count);
+}
+#endif
+
+// Kernels for the running CPU, chosen once at load time
+static struct {
+    size_t (*blank)(const char* input, size_t position, size_t end);
+    size_t (*find_any)(const char* input, size_t position, size_t end, char a, char b, char c);
+    size_t (*count_newlines)(const char* input, size_t position, size_t end);
+    size_t (*list_newlines)(const char* input, size_t position, size_t end, uint32_t* starts);
+} scan_kernels = { scan_blank_scalar, find_any_scalar, count_newlines_scalar, list_newlines_scalar };
+
+#ifdef PAXSI_HAVE_X86_SIMD
+__attribute__((constructor))
+static void select_scan_kernels(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_kernels.blank = scan_blank_avx2;
+        scan_kernels.find_any = find_any_avx2;
+        scan_kernels.count_newlines = count_newlines_avx2;
+        scan_kernels.list_newlines = list_newlines_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_kernels.blank = scan_blank_sse2;
+        scan_kernels.find_any = find_any_sse2;
+        scan_kernels.count_newlines = count_newlines_sse2;
+        scan_kernels.list_newlines = list_newlines_sse2;
+    }
+}
+#endif
+
+// Resize every column of the token buffer to hold `capacity` tokens
+static void grow_tokens(TokenBuffer* tokens, size_t capacity) {
+    tokens->kinds = realloc(tokens->kinds, capacity * sizeof(uint8_t));
+    tokens->offsets = realloc(tokens->offsets, capacity * sizeof(uint32_t));
+    tokens->lengths = realloc(tokens->lengths, capacity * sizeof(uint32_t));
+    tokens->values = realloc(tokens->values, capacity * sizeof(uint32_t));
+    tokens->capacity = capacity;
+}
+
+// Whether --stats counters are being collected; they are compiled in but
+// off by default, so the branch is laid out for that case
+#define STATS(lexer) __builtin_expect((lexer)->stats != NULL, 0)
+
+// Cheap timestamp for the stats: the TSC on x86, a monotonic clock elsewhere
+static inline uint64_t stats_clock(void) {
+#ifdef PAXSI_HAVE_X86_SIMD
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Book a scanned construct: the input it consumed since absolute offset
+// `from` and the time since `clock`
+static void record_stats(Lexer* lexer, LexBytes bytes, LexTime timer, uint64_t from, uint64_t clock) {
+    lexer->stats->bytes[bytes] += lexer->base + lexer->position - from;
+    lexer->stats->ticks[timer] += stats_clock() - clock;
+    lexer->stats->calls[timer]++;
+}
+
+// Run a subscanner, timing it when stats are on
+#define MEASURED(lexer, bytes, timer, call) do {                               \
+        if (STATS(lexer)) {                                                    \
+            uint64_t from_ = (lexer)->base + (lexer)->position;                \
+            uint64_t clock_ = stats_clock();                                   \
+            call;                                                              \
+            record_stats((lexer), (bytes), (timer), from_, clock_);            \
+        } else {                                                               \
+            call;                                                              \
+        }                                                                      \
+    } while (0)
+
+// Count the final tokens [from, count) by type
+static void count_tokens(Lexer* lexer, size_t from) {
+    for (size_t i = from; i < lexer->tokens.count; i++) lexer->stats->tokens[lexer->tokens.kinds[i]]++;
+}
+
+// Initialize lexer with NUL-terminated source code input
 Lexer* init_lexer(const char* input) {
+    return init_lexer_n(input, strlen(input));
+}
+
+// Initialize lexer with an explicit input length. The LEXER_PADDING bytes
+// after the input must be readable and '\0': they are the sentinel that
+// stops the scanner's inner loops
+Lexer* init_lexer_n(const char* input, size_t length) {
     Lexer* lexer = malloc(sizeof(Lexer));
     lexer->input = input;
-    lexer->length = strlen(input);
+    lexer->length = length;
     lexer->position = 0;
+    lexer->tokens = (TokenBuffer){ .source = input, .source_length = length };
+    lexer->tokens.line_index = calloc(1, sizeof(LineIndex));
+    lexer->tokens.symbol_table = calloc(1, sizeof(SymbolTable));
+    grow_tokens(&lexer->tokens, 100);
+    lexer->reader = NULL;
+    lexer->reader_context = NULL;
+    lexer->window = NULL;
+    lexer->window_capacity = 0;
+    lexer->base = 0;
+    lexer->stream_eof = true;
+    lexer->speculating = false;
+    lexer->line_cursor = 0;
     lexer->line = 1;
-    lexer->column = 1;
-    lexer->token_count = 0;
-    lexer->token_capacity = 100;
-    lexer->tokens = malloc(lexer->token_capacity * sizeof(Token));
+    lexer->line_start = 0;
+    lexer->next_token = 0;
+    lexer->finished = false;
+    lexer->scratch = NULL;
+    lexer->stats = NULL;
+    return lexer;
+}
+
+// Initialize a streaming lexer that pulls input through a bounded window
+Lexer* init_stream_lexer(LexerReader reader, void* context, size_t window_size) {
+    if (window_size < 2 * LEXER_LOOKAHEAD) window_size = LEXER_WINDOW_SIZE;
+
+    char* window = malloc(window_size + LEXER_PADDING);
+    if (!window) return NULL;
+    window[0] = '\0';
+
+    Lexer* lexer = init_lexer_n(window, 0);
+    lexer->reader = reader;
+    lexer->reader_context = context;
+    lexer->window = window;
+    lexer->window_capacity = window_size;
+    lexer->stream_eof = false;
     return lexer;
 }
 
+// Block of the scratch arena that holds decoded literals. Blocks are
+// never moved, so token values stay valid until the arena is reset.
+struct ScratchBlock {
+    struct ScratchBlock* next;
+    size_t used;
+    size_t capacity;
+    char data[];
+};
+
+#define SCRATCH_BLOCK_SIZE 4096
+
+// Reserve `size` bytes of scratch space owned by the lexer
+static char* scratch_alloc(Lexer* lexer, size_t size) {
+    struct ScratchBlock* block = lexer->scratch;
+    if (!block || block->capacity - block->used < size) {
+        size_t capacity = block ? block->capacity * 2 : SCRATCH_BLOCK_SIZE;
+        if (capacity < size) capacity = size;
+        block = malloc(sizeof(struct ScratchBlock) + capacity);
+        block->next = lexer->scratch;
+        block->used = 0;
+        block->capacity = capacity;
+        lexer->scratch = block;
+    }
+    char* memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+// Forget everything in the arena, keeping the newest (largest) block
+static void scratch_reset(Lexer* lexer) {
+    struct ScratchBlock* block = lexer->scratch;
+    if (!block) return;
+    while (block->next) {
+        struct ScratchBlock* next = block->next->next;
+        free(block->next);
+        block->next = next;
+    }
+    block->used = 0;
+}
+
+// Forget tokens [from, count), releasing the payloads they own
+static void drop_tokens(Lexer* lexer, size_t from) {
+    TokenBuffer* tokens = &lexer->tokens;
+    while (tokens->payload_count > 0 && tokens->payloads[tokens->payload_count - 1].token >= from) {
+        TokenPayload* payload = &tokens->payloads[--tokens->payload_count];
+        if (payload->owned) free((char*)payload->value);
+    }
+    for (size_t i = from; i < tokens->count; i++) {
+        if (tokens->kinds[i] == TOKEN_INT || tokens->kinds[i] == TOKEN_REAL) {
+            tokens->number_count = tokens->values[i];
+            break;
+        }
+    }
+    tokens->count = from;
+    if (from == 0) scratch_reset(lexer);
+}
+
+// Whether `text` lies in one of the scratch blocks starting at `block`
+static bool in_scratch(const struct ScratchBlock* block, const char* text) {
+    for (; block; block = block->next) {
+        if (text >= block->data && text < block->data + block->used) return true;
+    }
+    return false;
+}
+
+// Forget the first `count` tokens and keep the rest. Decoded texts of the
+// kept tokens move to a fresh scratch arena, so the old one can be freed
+// even though the buffer never runs empty.
+static void discard_tokens(Lexer* lexer, size_t count) {
+    TokenBuffer* tokens = &lexer->tokens;
+    size_t kept = tokens->count - count;
+    if (kept == 0) {
+        drop_tokens(lexer, 0);
+        return;
+    }
+
+    size_t payload = 0;
+    for (; payload < tokens->payload_count && tokens->payloads[payload].token < count; payload++) {
+        if (tokens->payloads[payload].owned) free((char*)tokens->payloads[payload].value);
+    }
+    tokens->payload_count -= payload;
+    if (payload) memmove(tokens->payloads, tokens->payloads + payload, tokens->payload_count * sizeof(TokenPayload));
+
+    size_t number = tokens->number_count;
+    for (size_t i = count; i < tokens->count; i++) {
+        if (tokens->kinds[i] == TOKEN_INT || tokens->kinds[i] == TOKEN_REAL) {
+            number = tokens->values[i];
+            break;
+        }
+    }
+    tokens->number_count -= number;
+    if (number) memmove(tokens->numbers, tokens->numbers + number, tokens->number_count * sizeof(NumberValue));
+
+    memmove(tokens->kinds, tokens->kinds + count, kept * sizeof(uint8_t));
+    memmove(tokens->offsets, tokens->offsets + count, kept * sizeof(uint32_t));
+    memmove(tokens->lengths, tokens->lengths + count, kept * sizeof(uint32_t));
+    memmove(tokens->values, tokens->values + count, kept * sizeof(uint32_t));
+    for (size_t i = 0; i < kept; i++) {
+        if (tokens->kinds[i] == TOKEN_INT || tokens->kinds[i] == TOKEN_REAL) tokens->values[i] -= number;
+    }
+    tokens->count = kept;
+
+    struct ScratchBlock* old = lexer->scratch;
+    lexer->scratch = NULL;
+    for (size_t i = 0; i < tokens->payload_count; i++) {
+        TokenPayload* entry = &tokens->payloads[i];
+        entry->token -= count;
+        if (!entry->owned && in_scratch(old, entry->value)) {
+            char* copy = scratch_alloc(lexer, entry->length ? entry->length : 1);
+            memcpy(copy, entry->value, entry->length);
+            entry->value = copy;
+        }
+    }
+    while (old) {
+        struct ScratchBlock* next = old->next;
+        free(old);
+        old = next;
+    }
+}
+
 // Free lexer and all allocated resources
 void free_lexer(Lexer* lexer) {
-    for (int i = 0; i < lexer->token_count; i++) {
-        free(lexer->tokens[i].value);
-    }
-    free(lexer->tokens);
+    drop_tokens(lexer, 0);
+    free(lexer->scratch);
+    free(lexer->tokens.kinds);
+    free(lexer->tokens.offsets);
+    free(lexer->tokens.lengths);
+    free(lexer->tokens.values);
+    free(lexer->tokens.payloads);
+    free(lexer->tokens.numbers);
+    free(lexer->tokens.line_index->starts);
+    free(lexer->tokens.line_index);
+    free_symbol_table(lexer->tokens.symbol_table);
+    free(lexer->window);
     free(lexer);
 }
 
-// Add a new token to the lexer's token list
-void add_token(Lexer* lexer, TokenType type, const char* value, int length) {
-    // Expand token array if needed
-    if (lexer->token_count >= lexer->token_capacity) {
-        lexer->token_capacity *= 2;
-        lexer->tokens = realloc(lexer->tokens, lexer->token_capacity * sizeof(Token));
+// Move the line cursor forward to absolute offset `offset`, counting the
+// newlines in between (in stream mode they must still be in the window)
+static void advance_line_cursor(Lexer* lexer, uint64_t offset) {
+    if (offset <= lexer->line_cursor) return;
+    size_t from = lexer->line_cursor - lexer->base;
+    size_t to = offset - lexer->base;
+    size_t newlines = scan_kernels.count_newlines(lexer->input, from, to);
+    if (newlines) {
+        lexer->line += newlines;
+        size_t last = to;
+        while (lexer->input[last - 1] != '\n') last--;
+        lexer->line_start = lexer->base + last;
+    }
+    lexer->line_cursor = offset;
+}
+
+// Make `count` bytes past the current position available. In stream mode
+// the consumed part of the window is discarded and the reader is called;
+// the window only grows when a single token does not fit into it.
+static bool lexer_fill(Lexer* lexer, size_t count) {
+    if (lexer->position + count <= lexer->length) return true;
+    if (lexer->stream_eof || lexer->speculating) return false;
+
+    // Keep the bytes that tokens not yet handed out still refer to
+    size_t keep = lexer->position;
+    if (lexer->tokens.count > 0 && lexer->tokens.offsets[0] < keep) keep = lexer->tokens.offsets[0];
+    if (keep > 0) {
+        advance_line_cursor(lexer, lexer->base + keep);
+        memmove(lexer->window, lexer->window + keep, lexer->length - keep);
+        lexer->base += keep;
+        lexer->length -= keep;
+        lexer->position -= keep;
+        for (size_t i = 0; i < lexer->tokens.count; i++) lexer->tokens.offsets[i] -= keep;
+    }
+
+    while (lexer->position + count > lexer->length && !lexer->stream_eof) {
+        if (lexer->length == lexer->window_capacity) {
+            size_t capacity = lexer->window_capacity * 2;
+            char* window = realloc(lexer->window, capacity + LEXER_PADDING);
+            if (!window) {
+                lexer->stream_eof = true;
+                break;
+            }
+            lexer->window = window;
+            lexer->window_capacity = capacity;
+        }
+
+        int64_t bytes_read = lexer->reader(lexer->reader_context,
+                                           lexer->window + lexer->length,
+                                           lexer->window_capacity - lexer->length);
+        if (bytes_read <= 0) lexer->stream_eof = true;
+        else lexer->length += bytes_read;
+    }
+
+    lexer->window[lexer->length] = '\0';
+    lexer->input = lexer->window;
+    lexer->tokens.source = lexer->window;
+    return lexer->position + count <= lexer->length;
+}
+
+// Check that `num` more bytes can be read, refilling the stream if needed
+#define AVAILABLE(lexer, num) ((lexer)->position + (num) <= (lexer)->length || lexer_fill((lexer), (num)))
+
+// Append a token that starts at input offset `offset` without copying its
+// text: text equal to the input there is stored as a span, anything else
+// goes to the payload table
+static void push_token(Lexer* lexer, TokenType type, size_t offset, const char* value, size_t length, bool owned) {
+    TokenBuffer* tokens = &lexer->tokens;
+    if (tokens->count >= tokens->capacity) {
+        grow_tokens(tokens, tokens->capacity * 2);
+        if (STATS(lexer)) lexer->stats->token_reallocations++;
+    }
+
+    size_t index = tokens->count++;
+    tokens->kinds[index] = (uint8_t)type;
+    tokens->offsets[index] = (uint32_t)offset;
+    tokens->values[index] = SYMBOL_NONE;
+    if (!owned && offset + length <= lexer->length &&
+        (value == lexer->input + offset || memcmp(lexer->input + offset, value, length) == 0)) {
+        tokens->lengths[index] = (uint32_t)length;
+        return;
+    }
+
+    if (tokens->payload_count >= tokens->payload_capacity) {
+        tokens->payload_capacity = tokens->payload_capacity ? tokens->payload_capacity * 2 : 16;
+        tokens->payloads = realloc(tokens->payloads, tokens->payload_capacity * sizeof(TokenPayload));
+        if (STATS(lexer)) lexer->stats->token_reallocations++;
+    }
+    tokens->payloads[tokens->payload_count++] = (TokenPayload){ index, value, length, owned };
+    tokens->lengths[index] = TOKEN_PAYLOAD;
+}
+
+// Text of token `index`: a span of the source or its payload
+const char* token_value(const TokenBuffer* tokens, size_t index, size_t* length) {
+    if (tokens->lengths[index] != TOKEN_PAYLOAD) {
+        *length = tokens->lengths[index];
+        return tokens->source + tokens->offsets[index];
+    }
+
+    size_t low = 0, high = tokens->payload_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (tokens->payloads[middle].token < index) low = middle + 1;
+        else high = middle;
+    }
+    *length = tokens->payloads[low].length;
+    return tokens->payloads[low].value;
+}
+
+// Decoded value of number token `index`; NUMBER_NONE for other tokens
+NumberValue token_number(const TokenBuffer* tokens, size_t index) {
+    TokenType type = (TokenType)tokens->kinds[index];
+    if (type == TOKEN_INT || type == TOKEN_REAL) return tokens->numbers[tokens->values[index]];
+    return (NumberValue){ .kind = NUMBER_NONE };
+}
+
+#ifdef PAXSI_HAVE_THREADS
+// Line indexes are built only for diagnostics, so one lock serves them all
+static pthread_mutex_t line_index_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Record where every line of the source starts, once. Threads reading
+// the same buffer may get here together: the first one builds the index
+// under the lock and publishes `built`, the others wait and reuse it
+static void build_line_index(const TokenBuffer* tokens) {
+    LineIndex* index = tokens->line_index;
+    if (__atomic_load_n(&index->built, __ATOMIC_ACQUIRE)) return;
+#ifdef PAXSI_HAVE_THREADS
+    pthread_mutex_lock(&line_index_lock);
+#endif
+    if (!index->built) {
+        size_t count = scan_kernels.count_newlines(tokens->source, 0, tokens->source_length);
+        index->starts = malloc((count ? count : 1) * sizeof(uint32_t));
+        index->count = scan_kernels.list_newlines(tokens->source, 0, tokens->source_length, index->starts);
+        __atomic_store_n(&index->built, true, __ATOMIC_RELEASE);
+    }
+#ifdef PAXSI_HAVE_THREADS
+    pthread_mutex_unlock(&line_index_lock);
+#endif
+}
+
+// Line and column of token `index`, found by binary search in the line
+// index. Only diagnostics need them, so the index is built on first use.
+void token_position(const TokenBuffer* tokens, size_t index, int64_t* line, int64_t* column) {
+    LineIndex* lines = tokens->line_index;
+    build_line_index(tokens);
+
+    // Number of line starts at or before the token's offset
+    uint32_t offset = tokens->offsets[index];
+    size_t low = 0, high = lines->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (lines->starts[middle] <= offset) low = middle + 1;
+        else high = middle;
     }
+    *line = (int64_t)low + 1;
+    *column = (int64_t)(offset - (low ? lines->starts[low - 1] : 0)) + 1;
+}
 
-    // Create new token
+// Token `index` as a standalone record; its value is borrowed from the buffer
+Token token_at(const TokenBuffer* tokens, size_t index) {
     Token token;
-    token.type = type;
-    token.value = malloc(length + 1);
-    strncpy(token.value, value, length);
-    token.value[length] = '\0';
-    token.line = lexer->line;
-    token.column = lexer->column - length;  // Adjust for current position
-    token.length = length;
+    token.type = (TokenType)tokens->kinds[index];
+    token.value = token_value(tokens, index, &token.length);
+    token_position(tokens, index, &token.line, &token.column);
+    token.symbol = token.type == TOKEN_ID ? tokens->values[index] : SYMBOL_NONE;
+    token.number = token_number(tokens, index);
+    token.owned = false;
+    return token;
+}
+
+// Release a symbol table allocated with calloc
+void free_symbol_table(SymbolTable* table) {
+    if (!table) return;
+    free(table->entries);
+    free(table->names);
+    free(table->slots);
+    free(table);
+}
+
+// Hash of a name (FNV-1a)
+static uint32_t hash_name(const char* name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash;
+}
 
-    // Add to token list
-    lexer->tokens[lexer->token_count++] = token;
+// Resize the slot array of the symbol table and reinsert every symbol
+static void grow_symbol_slots(SymbolTable* table, size_t slot_count) {
+    free(table->slots);
+    table->slots = calloc(slot_count, sizeof(uint32_t));
+    table->slot_count = slot_count;
+    for (size_t i = 0; i < table->count; i++) {
+        size_t slot = table->entries[i].hash & (slot_count - 1);
+        while (table->slots[slot]) slot = (slot + 1) & (slot_count - 1);
+        table->slots[slot] = (uint32_t)i + 1;
+    }
+}
+
+// Symbol number of a name, adding the name on its first occurrence
+uint32_t intern_symbol(SymbolTable* table, const char* name, size_t length) {
+    uint32_t hash = hash_name(name, length);
+    if (table->slot_count == 0) grow_symbol_slots(table, 256);
+
+    size_t mask = table->slot_count - 1;
+    size_t slot = hash & mask;
+    for (; table->slots[slot]; slot = (slot + 1) & mask) {
+        uint32_t symbol = table->slots[slot] - 1;
+        const Symbol* entry = &table->entries[symbol];
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(table->names + entry->offset, name, length) == 0) return symbol;
+    }
+
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 64;
+        table->entries = realloc(table->entries, table->capacity * sizeof(Symbol));
+    }
+    if (table->names_length + length + 1 > table->names_capacity) {
+        size_t capacity = table->names_capacity ? table->names_capacity * 2 : 1024;
+        while (capacity < table->names_length + length + 1) capacity *= 2;
+        table->names = realloc(table->names, capacity);
+        table->names_capacity = capacity;
+    }
+    uint32_t symbol = (uint32_t)table->count++;
+    table->entries[symbol] = (Symbol){ table->names_length, (uint32_t)length, hash };
+    memcpy(table->names + table->names_length, name, length);
+    table->names[table->names_length + length] = '\0';
+    table->names_length += length + 1;
+
+    // Keep the table at most half full
+    if (table->count * 2 > table->slot_count) grow_symbol_slots(table, table->slot_count * 2);
+    else table->slots[slot] = symbol + 1;
+    return symbol;
+}
+
+// NUL-terminated name of a symbol; valid until the next intern_symbol
+const char* symbol_name(const SymbolTable* table, uint32_t symbol) {
+    return table->names + table->entries[symbol].offset;
+}
+
+// Add a new token whose text is a span of the input (or a static string).
+// Spans start where they point; fixed spellings ("+", "::") are added
+// before the lexer moves past them, at the current position.
+void add_token(Lexer* lexer, TokenType type, const char* value, size_t length) {
+    uintptr_t input = (uintptr_t)lexer->input;
+    size_t offset = (uintptr_t)value >= input && (uintptr_t)value <= input + lexer->length ?
+        (size_t)((uintptr_t)value - input) : lexer->position;
+    push_token(lexer, type, offset, value, length, false);
+}
+
+// Add an identifier span together with its symbol. A stream lexer may
+// still roll the token back, so there it is interned by sink_tokens.
+static void add_identifier(Lexer* lexer, size_t start, size_t length) {
+    push_token(lexer, TOKEN_ID, start, lexer->input + start, length, false);
+    if (!lexer->speculating) {
+        lexer->tokens.values[lexer->tokens.count - 1] =
+            intern_symbol(lexer->tokens.symbol_table, lexer->input + start, length);
+    }
+}
+
+// Add a token at `offset` whose text is decoded into the scratch arena
+static void add_decoded_token(Lexer* lexer, TokenType type, size_t offset, const char* value, size_t length) {
+    push_token(lexer, type, offset, value, length, false);
+}
+
+// Add a token that takes ownership of a heap buffer (error messages)
+static void add_owned_token(Lexer* lexer, TokenType type, char* value, size_t length) {
+    push_token(lexer, type, lexer->position, value, length, true);
 }
 
 // Add an error token with formatted message
@@ -170,44 +913,52 @@ void add_error(Lexer* lexer, const char* format, ...) {
     char buffer[128];
     va_list args;
     va_start(args, format);
-    vsnprintf(buffer, sizeof(buffer), format, args);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
     va_end(args);
 
-    add_token(lexer, TOKEN_ERROR, buffer, strlen(buffer));
+    if (length < 0) length = 0;
+    if (length >= (int)sizeof(buffer)) length = sizeof(buffer) - 1;
+    char* message = malloc(length + 1);
+    memcpy(message, buffer, length + 1);
+    add_owned_token(lexer, TOKEN_ERROR, message, length);
 }
 
-// Skip whitespace characters (space, tab)
+// Skip whitespace characters (space, tab, newline)
 void skip_whitespace(Lexer* lexer) {
-    while (lexer->position < lexer->length) {
-        if (lexer->input[lexer->position] == ' ' || 
-            lexer->input[lexer->position]  == '\t') { 
-            SHIFT(lexer, 1);
-        } else if (lexer->input[lexer->position] == '\n') {
-            lexer->position++;
-            lexer->line++;
-            lexer->column = 1;
-        } else break;
-    }
+    uint64_t from = lexer->base + lexer->position;
+    do {
+        lexer->position = scan_kernels.blank(lexer->input, lexer->position, lexer->length);
+    } while (lexer->position == lexer->length && lexer_fill(lexer, 1));
+    if (STATS(lexer)) lexer->stats->bytes[LEX_BYTES_WHITESPACE] += lexer->base + lexer->position - from;
 }
 
 // Skip comments and preprocessing directives
 void skip_comments(Lexer* lexer) {
-    while (lexer->position < lexer->length) {
+    while (AVAILABLE(lexer, 1)) {
+        uint64_t from = lexer->base + lexer->position;
+        uint64_t clock = STATS(lexer) ? stats_clock() : 0;
+
         // Single-line comments starting with #
         if (lexer->input[lexer->position] == '#') {
-            while (lexer->position < lexer->length &&
-                   lexer->input[lexer->position] != '\n') {
-                lexer->position++;
-            }
-            lexer->column = 1;
+            do {
+                lexer->position = scan_kernels.find_any(lexer->input, lexer->position, lexer->length,
+                                                        '\n', '\n', '\n');
+            } while (lexer->position == lexer->length && lexer_fill(lexer, 1));
         } 
         // Multi-line comments: </ ... />
-        else if (lexer->position < lexer->length - 1 &&
+        else if (AVAILABLE(lexer, 2) &&
                    lexer->input[lexer->position] == '<' && 
                    lexer->input[lexer->position + 1] == '/') {
             SHIFT(lexer, 2);
             int depth = 1;
-            while (depth > 0 && lexer->position < lexer->length - 1) {
+            while (depth > 0 && AVAILABLE(lexer, 2)) {
+                // Jump over the comment text to the next '<' or '/'. The
+                // last byte is left out so that a delimiter split by a
+                // stream refill is still seen whole.
+                lexer->position = scan_kernels.find_any(lexer->input, lexer->position, lexer->length - 1,
+                                                        '<', '/', '/');
+                if (!AVAILABLE(lexer, 2)) break;
+
                 if (lexer->input[lexer->position] == '<' &&
                     lexer->input[lexer->position + 1] == '/') {
                     depth++;
@@ -216,41 +967,412 @@ void skip_comments(Lexer* lexer) {
                            lexer->input[lexer->position + 1] == '>') {
                     depth--;
                     SHIFT(lexer, 2);
-                } else {
-                    if (lexer->input[lexer->position] == '\n') {
-                        lexer->line++;
-                        lexer->column = 1;
-                    } else SHIFT(lexer, 1);
-                }
+                } else SHIFT(lexer, 1);
             }
             if (depth > 0) add_error(lexer, "Unclosed comment");
         } else break;
+        if (STATS(lexer)) record_stats(lexer, LEX_BYTES_COMMENT, LEX_TIME_COMMENT, from, clock);
+
+        // The newline ending a comment is whitespace, not a token
+        skip_whitespace(lexer);
     }
 }
 
+// Length of the run of characters in `mask` classes starting at position
+static inline size_t scan_class(const char* input, size_t position, uint8_t mask) {
+    size_t end = position;
+    while (CHAR_CLASS(input[end]) & mask) end++;
+    return end - position;
+}
+
 // Check if character is valid digit in given base
-static bool is_valid_digit(char character, int base) {
-    if (base <= 10) return character >= '0' && character < '0' + base;
+static inline bool is_valid_digit(char character, int base) {
+    return digit_value[(unsigned char)character] < base;
+}
+
+// Parse number literals (integers and floats)
+// Numeric literals are decoded right after they are scanned, so later
+// stages never parse the text again. Integers are checked for overflow;
+// reals are rounded correctly (Clinger's exact path, then Eisel-Lemire,
+// with strtod only for the rare undecidable long mantissa).
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LOAD_LE64(word) __builtin_bswap64(word)
+#else
+#define LOAD_LE64(word) (word)
+#endif
+
+// Number of leading zero bits of a nonzero word
+static inline int leading_zeros(uint64_t word) {
+#ifdef __GNUC__
+    return __builtin_clzll(word);
+#else
+    int count = 0;
+    while (!(word & (UINT64_C(1) << 63))) {
+        word <<= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+// Full 64 x 64 -> 128 bit product
+static inline void multiply_128(uint64_t a, uint64_t b, uint64_t* high, uint64_t* low) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = (unsigned __int128)a * b;
+    *high = (uint64_t)(product >> 64);
+    *low = (uint64_t)product;
+#else
+    uint64_t a_low = (uint32_t)a, a_high = a >> 32;
+    uint64_t b_low = (uint32_t)b, b_high = b >> 32;
+    uint64_t low_low = a_low * b_low;
+    uint64_t middle = a_high * b_low + (low_low >> 32);
+    uint64_t middle2 = a_low * b_high + (uint32_t)middle;
+    *high = a_high * b_high + (middle >> 32) + (middle2 >> 32);
+    *low = (middle2 << 32) | (uint32_t)low_low;
+#endif
+}
+
+static inline double double_from_bits(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Whether the 8 bytes at `text` are all decimal digits (SWAR)
+static inline bool is_eight_digits(const char* text) {
+    uint64_t word;
+    memcpy(&word, text, sizeof(word));
+    word = LOAD_LE64(word);
+    return ((word & UINT64_C(0xF0F0F0F0F0F0F0F0)) |
+            (((word + UINT64_C(0x0606060606060606)) & UINT64_C(0xF0F0F0F0F0F0F0F0)) >> 4)) ==
+           UINT64_C(0x3333333333333333);
+}
+
+// Value of 8 decimal digits at `text`: pairs, then quads, then the whole
+// word are combined with three multiplications
+static inline uint32_t parse_eight_digits(const char* text) {
+    uint64_t word;
+    memcpy(&word, text, sizeof(word));
+    word = LOAD_LE64(word) - UINT64_C(0x3030303030303030);
+    word = word * 10 + (word >> 8);
+    word = ((word & UINT64_C(0x000000FF000000FF)) * UINT64_C(0x000F424000000064) +
+            ((word >> 16) & UINT64_C(0x000000FF000000FF)) * UINT64_C(0x0000271000000001)) >> 32;
+    return (uint32_t)word;
+}
+
+// Bits per digit of a power-of-two base, 0 for base 10
+static inline int base_bits(int base) {
+    switch (base) {
+        case 2: return 1;
+        case 4: return 2;
+        case 8: return 3;
+        case 16: return 4;
+        default: return 0;
+    }
+}
+
+// Decode the digits of an integer literal (prefix already skipped)
+static const char* decode_integer(const char* text, const char* end, int base, NumberValue* value) {
+    int bits = base_bits(base);
+    uint64_t result = 0;
+    size_t digits = 0;
+    while (text < end) {
+        if (*text == '_') {
+            text++;
+            continue;
+        }
+        if (!bits && end - text >= 8 && is_eight_digits(text)) {
+            uint32_t chunk = parse_eight_digits(text);
+            if (result > (UINT64_MAX - chunk) / 100000000) return "Integer literal out of range";
+            result = result * 100000000 + chunk;
+            text += 8;
+            digits += 8;
+            continue;
+        }
+
+        unsigned digit = digit_value[(unsigned char)*text++];
+        if (digit >= (unsigned)base) return "Malformed number literal";
+        if (bits) {
+            if (result >> (64 - bits)) return "Integer literal out of range";
+            result = (result << bits) | digit;
+        } else {
+            if (result > (UINT64_MAX - digit) / 10) return "Integer literal out of range";
+            result = result * 10 + digit;
+        }
+        digits++;
+    }
+    if (digits == 0) return "Malformed number literal";
+
+    if (result > INT64_MAX) {
+        value->kind = NUMBER_UINT;
+        value->as.uinteger = result;
+    } else {
+        value->kind = NUMBER_INT;
+        value->as.integer = (int64_t)result;
+    }
+    return NULL;
+}
+
+// Mantissa and exponent of a real literal: value = mantissa * base^exponent.
+// Digits that do not fit are dropped; `truncated` tells that one of them
+// was not zero.
+typedef struct {
+    uint64_t mantissa;
+    int64_t exponent;
+    bool truncated;
+} RealParts;
+
+// Exponents beyond this are out of range for a double in any base
+#define EXPONENT_LIMIT 100000
+
+// Split a real literal into mantissa and exponent
+static const char* split_real(const char* text, const char* end, int base, RealParts* parts) {
+    int bits = base_bits(base);
+    uint64_t limit = bits ? UINT64_MAX >> bits : (UINT64_MAX - 9) / 10;
+    uint64_t mantissa = 0;
+    int64_t scale = 0;
+    size_t digits = 0;
+    bool fraction = false;
+    bool truncated = false;
+
+    while (text < end && !(*text == 'e' && base != 16)) {
+        char c = *text;
+        if (c == '_') {
+            text++;
+            continue;
+        }
+        if (c == '.') {
+            if (fraction) return "Malformed number literal";
+            fraction = true;
+            text++;
+            continue;
+        }
+        if (!bits && mantissa < UINT64_C(100000000000) && end - text >= 8 && is_eight_digits(text)) {
+            mantissa = mantissa * 100000000 + parse_eight_digits(text);
+            if (fraction) scale -= 8;
+            text += 8;
+            digits += 8;
+            continue;
+        }
+
+        unsigned digit = digit_value[(unsigned char)c];
+        if (digit >= (unsigned)base) return "Malformed number literal";
+        if (mantissa <= limit) {
+            mantissa = bits ? (mantissa << bits) | digit : mantissa * 10 + digit;
+            if (fraction) scale--;
+        } else {
+            // No room left: the digit only moves the point
+            if (digit) truncated = true;
+            if (!fraction) scale++;
+        }
+        text++;
+        digits++;
+    }
+    if (digits == 0) return "Malformed number literal";
+
+    if (text < end) {
+        // Exponent: a power of the literal's base, written in that base
+        text++;
+        bool negative = false;
+        if (text < end && (*text == '+' || *text == '-')) negative = *text++ == '-';
+        int64_t exponent = 0;
+        size_t exponent_digits = 0;
+        for (; text < end; text++) {
+            if (*text == '_') continue;
+            unsigned digit = digit_value[(unsigned char)*text];
+            if (digit >= (unsigned)base) return "Malformed number literal";
+            if (exponent < EXPONENT_LIMIT) exponent = exponent * base + digit;
+            exponent_digits++;
+        }
+        if (exponent_digits == 0) return "Malformed number literal";
+        scale += negative ? -exponent : exponent;
+    }
+
+    parts->mantissa = mantissa;
+    parts->exponent = scale;
+    parts->truncated = truncated;
+    return NULL;
+}
+
+// Round mantissa * 2^exponent (plus a nonzero tail below it when `sticky`)
+// to the nearest double, ties to even
+static double binary_to_double(uint64_t mantissa, int64_t exponent, bool sticky) {
+    if (mantissa == 0) return 0.0;
+    int zeros = leading_zeros(mantissa);
+    mantissa <<= zeros;
+    exponent -= zeros;
+
+    // Keep 53 bits, fewer for subnormals
+    int64_t leading = exponent + 63;
+    int64_t shift = 11;
+    if (leading < -1022) shift += -1022 - leading;
+    if (shift > 64) return 0.0;
+
+    uint64_t kept, rest, half;
+    if (shift == 64) {
+        kept = 0;
+        rest = mantissa;
+        half = UINT64_C(1) << 63;
+    } else {
+        kept = mantissa >> shift;
+        rest = mantissa & ((UINT64_C(1) << shift) - 1);
+        half = UINT64_C(1) << (shift - 1);
+    }
+    if (rest > half || (rest == half && (sticky || (kept & 1)))) kept++;
+
+    // A subnormal's bits are its mantissa; rounding up into the smallest
+    // normal number carries into the exponent field by itself
+    if (leading < -1022) return double_from_bits(kept);
+    if (kept >> 53) {
+        kept >>= 1;
+        leading++;
+    }
+    if (leading > 1023) return double_from_bits(UINT64_C(0x7FF) << 52);
+    return double_from_bits((uint64_t)(leading + 1023) << 52 | (kept & ((UINT64_C(1) << 52) - 1)));
+}
+
+// Correctly rounded mantissa * 10^exponent for a nonzero mantissa of at
+// most 19 digits (Eisel-Lemire)
+static double eisel_lemire(uint64_t mantissa, int64_t exponent) {
+    if (exponent < POWER_OF_FIVE_MIN) return 0.0;
+    if (exponent > POWER_OF_FIVE_MAX) return double_from_bits(UINT64_C(0x7FF) << 52);
+
+    int zeros = leading_zeros(mantissa);
+    mantissa <<= zeros;
+
+    // Product with the 128-bit power of five, refined with its low half
+    // only when the bits that decide the rounding are all ones
+    size_t index = 2 * (size_t)(exponent - POWER_OF_FIVE_MIN);
+    uint64_t high, low;
+    multiply_128(mantissa, power_of_five_128[index], &high, &low);
+    if ((high & 0x1FF) == 0x1FF) {
+        uint64_t second_high, second_low;
+        multiply_128(mantissa, power_of_five_128[index + 1], &second_high, &second_low);
+        low += second_high;
+        if (second_high > low) high++;
+    }
+
+    int upper = (int)(high >> 63);
+    int shift = upper + 9;
+    uint64_t bits = high >> shift;
+    // floor(log2(10^exponent)) + 63 + bias
+    int64_t power = (((152170 + 65536) * exponent) >> 16) + 63 + upper - zeros + 1023;
+
+    if (power <= 0) {
+        // Subnormal result
+        if (-power + 1 >= 64) return 0.0;
+        bits >>= -power + 1;
+        bits += bits & 1;
+        bits >>= 1;
+        power = bits < (UINT64_C(1) << 52) ? 0 : 1;
+        return double_from_bits((uint64_t)power << 52 | (bits & ((UINT64_C(1) << 52) - 1)));
+    }
+
+    // Exactly halfway: round to even instead of up
+    if (low <= 1 && exponent >= -4 && exponent <= 23 && (bits & 3) == 1 &&
+        (bits << shift) == high) {
+        bits &= ~UINT64_C(1);
+    }
+    bits += bits & 1;
+    bits >>= 1;
+    if (bits >= (UINT64_C(2) << 52)) {
+        bits = UINT64_C(1) << 52;
+        power++;
+    }
+    if (power >= 0x7FF) return double_from_bits(UINT64_C(0x7FF) << 52);
+    return double_from_bits((uint64_t)power << 52 | (bits & ((UINT64_C(1) << 52) - 1)));
+}
+
+// Exact powers of ten for Clinger's fast path
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-    if (character >= '0' && character <= '9') return true;
-    if (character >= 'A' && character <= 'A' + base - 11) return true;
-    if (character >= 'a' && character <= 'a' + base - 11) return true;
+// mantissa * 10^exponent when both factors are exact doubles: a single
+// multiplication or division then rounds correctly
+static bool clinger_fast_path(uint64_t mantissa, int64_t exponent, double* result) {
+#if FLT_EVAL_METHOD == 0
+    if (exponent < -22 || exponent > 22 || mantissa > (UINT64_C(1) << 53)) return false;
+    *result = (double)mantissa;
+    if (exponent < 0) *result /= exact_powers_of_ten[-exponent];
+    else *result *= exact_powers_of_ten[exponent];
+    return true;
+#else
+    (void)mantissa;
+    (void)exponent;
+    (void)result;
     return false;
+#endif
+}
+
+// Slow path for a long decimal mantissa: strtod over the literal without
+// separators
+static double decimal_with_strtod(const char* text, const char* end) {
+    char* copy = malloc(end - text + 1);
+    size_t length = 0;
+    for (; text < end; text++) {
+        if (*text != '_') copy[length++] = *text;
+    }
+    copy[length] = '\0';
+    double value = strtod(copy, NULL);
+    free(copy);
+    return value;
+}
+
+// Decode the digits of a real literal (prefix already skipped)
+static const char* decode_real(const char* text, const char* end, int base, NumberValue* value) {
+    RealParts parts;
+    const char* problem = split_real(text, end, base, &parts);
+    if (problem) return problem;
+
+    double result;
+    int bits = base_bits(base);
+    if (bits) {
+        // Powers of two: scaling is exact, only one rounding happens
+        result = binary_to_double(parts.mantissa, parts.exponent * bits, parts.truncated);
+    } else if (parts.mantissa == 0) {
+        result = 0.0;
+    } else if (!parts.truncated) {
+        if (!clinger_fast_path(parts.mantissa, parts.exponent, &result)) {
+            result = eisel_lemire(parts.mantissa, parts.exponent);
+        }
+    } else {
+        // Dropped digits lie between mantissa and mantissa + 1
+        result = eisel_lemire(parts.mantissa, parts.exponent);
+        if (result != eisel_lemire(parts.mantissa + 1, parts.exponent)) result = decimal_with_strtod(text, end);
+    }
+
+    if (result > DBL_MAX) return "Real literal out of range";
+    value->kind = NUMBER_REAL;
+    value->as.real = result;
+    return NULL;
+}
+
+// Record the value of the number token just added
+static void add_number(Lexer* lexer, NumberValue value) {
+    TokenBuffer* tokens = &lexer->tokens;
+    if (tokens->number_count >= tokens->number_capacity) {
+        tokens->number_capacity = tokens->number_capacity ? tokens->number_capacity * 2 : 16;
+        tokens->numbers = realloc(tokens->numbers, tokens->number_capacity * sizeof(NumberValue));
+        if (STATS(lexer)) lexer->stats->token_reallocations++;
+    }
+    tokens->values[tokens->count - 1] = (uint32_t)tokens->number_count;
+    tokens->numbers[tokens->number_count++] = value;
 }
 
-// Parse number literals (integers and floats)
 void parse_number(Lexer* lexer) {
-    int start = lexer->position;
+    const char* input = lexer->input;
+    size_t start = lexer->position;
+    size_t position = start;
     int base = 10;
-    bool has_base = false;
     bool is_real = false;
-    bool has_exponent = false;
 
     // Check for base prefixes (0x, 0d, 0o, etc.)
-    if (lexer->position < lexer->length - 1 &&
-        lexer->input[lexer->position] == '0') {
+    if (position + 1 < lexer->length && input[position] == '0') {
         bool valid_prefix = true;
-        switch (NEXT(lexer, 1)) {
+        switch (input[position + 1]) {
             case 'x': base = 16; break;
             case 'd': base = 10; break;
             case 'o': base = 8; break;
@@ -258,39 +1380,73 @@ void parse_number(Lexer* lexer) {
             case 'q': base = 4; break;
             default: valid_prefix = false;
         }
-        if (valid_prefix) {
-            SHIFT(lexer, 2);
-            has_base = true;
-        }
+        if (valid_prefix) position += 2;
     }
-
-    // Process number digits
-    while (lexer->position < lexer->length) {
-        if (NEXT(lexer, 0) == '.') is_real = true;
-        else if (NEXT(lexer, 0) == '_') {SHIFT(lexer, 1);}
-        else if (NEXT(lexer, 0) == 'e') { 
+    size_t digits = position;
+
+    // Process number digits; the sentinel is never a digit
+    for (;;) {
+        char c = input[position];
+        if (c == '.') is_real = true;
+        else if (c == '_') {
+            // Separator skips the following character as well
+            if (position + 2 > lexer->length) {
+                position = lexer->length;
+                break;
+            }
+            position++;
+        } else if (c == 'e' && base != 16) {
+            // In hexadecimal 'e' is a digit, elsewhere it starts the exponent
             is_real = true;
-            has_exponent = true;
             // Skip exponent sign if present
-            if (lexer->position + 1 < lexer->length) {
-                if (NEXT(lexer, 1) == '+' || NEXT(lexer, 1) == '-') SHIFT(lexer, 1);
-            }
-        } else if (!is_valid_digit(NEXT(lexer, 0), base)) break;
-        SHIFT(lexer, 1);
+            if (input[position + 1] == '+' || input[position + 1] == '-') position++;
+        } else if (!is_valid_digit(c, base)) break;
+        position++;
     }
 
-    // Validate and add token
-    int length = lexer->position - start;
-    if (length == 0) {
-        add_error(lexer, "Empty number literal");
-        return;
+    // Decode the value; an error is reported where the literal starts
+    NumberValue value;
+    const char* problem = is_real ?
+        decode_real(input + digits, input + position, base, &value) :
+        decode_integer(input + digits, input + position, base, &value);
+    if (problem) add_error(lexer, "%s", problem);
+    else {
+        add_token(lexer, is_real ? TOKEN_REAL : TOKEN_INT, input + start, position - start);
+        add_number(lexer, value);
     }
-    
-    TokenType type = is_real ? TOKEN_REAL : TOKEN_INT;
-    add_token(lexer, type, lexer->input + start, length);
+    lexer->position = position;
 }
 
 // Parse character literals
+// Value of the escape sequence whose letter is `c` (after the backslash)
+static inline char unescape(char c) {
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case '0': return '\0';
+        default: return c;  // \' \" \\ and unknown escapes stand for themselves
+    }
+}
+
+// Decode a literal body with complete escape sequences into `out`, which
+// must hold `length` bytes. Returns the decoded length.
+static size_t decode_escapes(const char* text, size_t length, char* out) {
+    const char* end = text + length;
+    char* start = out;
+    while (text < end) {
+        const char* escape = memchr(text, '\\', end - text);
+        size_t run = (escape ? escape : end) - text;
+        memcpy(out, text, run);
+        out += run;
+        text += run;
+        if (!escape) break;
+        *out++ = unescape(text[1]);
+        text += 2;
+    }
+    return out - start;
+}
+
 void parse_char(Lexer* lexer) {
     SHIFT(lexer, 1); // Skip opening quote
     char value = 0;
@@ -302,22 +1458,15 @@ void parse_char(Lexer* lexer) {
     }
 
     // Handle escape sequences
-    if (NEXT(lexer, 0) == '\\') {
+    size_t start = lexer->position;
+    bool escaped = NEXT(lexer, 0) == '\\';
+    if (escaped) {
         SHIFT(lexer, 1); 
         if (lexer->position >= lexer->length) {
             add_error(lexer, "Incomplete escape sequence");
             return;
         }
-        switch (NEXT(lexer, 0)) {
-            case 'n': value = '\n'; break;
-            case 't': value = '\t'; break;
-            case 'r': value = '\r'; break;
-            case '0': value = '\0'; break;
-            case '\'': value = '\''; break;
-            case '"': value = '\"'; break;
-            case '\\': value = '\\'; break;
-            default: value = NEXT(lexer, 0);
-        }
+        value = unescape(NEXT(lexer, 0));
         SHIFT(lexer, 1);
     } else {
         value = NEXT(lexer, 0);
@@ -330,712 +1479,1294 @@ void parse_char(Lexer* lexer) {
         return;
     }
 
-    // Add character token
-    char str_val[2] = { value, '\0' };
-    add_token(lexer, TOKEN_CHAR, str_val, 1);
+    // Add character token: plain characters point into the source
+    if (escaped) {
+        char* decoded = scratch_alloc(lexer, 1);
+        decoded[0] = value;
+        add_decoded_token(lexer, TOKEN_CHAR, start, decoded, 1);
+    } else add_token(lexer, TOKEN_CHAR, lexer->input + start, 1);
     SHIFT(lexer, 1); // Skip closing quote
 }
 
-// Parse string literals
+// Parse string literals. Literals without escapes become spans of the
+// input; the rest are decoded into the lexer's scratch arena.
 void parse_string(Lexer* lexer) {
     SHIFT(lexer, 1); // Skip opening quote
-    int buf_size = 128;
-    char* buffer = malloc(lexer->length - lexer->position + 1);
-    int buf_index = 0;
-
-    while (lexer->position < lexer->length) {
-        // Expand buffer if needed
-        if (buf_index >= buf_size - 1) {
-            buf_size *= 2;
-            buffer = realloc(buffer, buf_size);
-        }
-
-        // Handle escape sequences
-        if (NEXT(lexer, 0) == '\\') {
-            SHIFT(lexer, 1);
-            if (lexer->position >= lexer->length) {
-                add_error(lexer, "Incomplete escape sequence");
-                free(buffer);
-                return;
-            }
-            switch (NEXT(lexer, 0)) {
-                case 'n': buffer[buf_index++] = '\n'; break;
-                case 't': buffer[buf_index++] = '\t'; break;
-                case 'r': buffer[buf_index++] = '\r'; break;
-                case '0': buffer[buf_index++] = '\0'; break;
-                case '\'': buffer[buf_index++] = '\''; break;
-                case '"': buffer[buf_index++] = '"'; break;
-                case '\\': buffer[buf_index++] = '\\'; break;
-                default: buffer[buf_index++] = NEXT(lexer, 0);
-            }
-            SHIFT(lexer, 1);
-        } 
-        // Check for closing quote
-        else if (NEXT(lexer, 0) == '"') break;
-        // Check for newline in string (invalid)
-        else if (NEXT(lexer, 0) == '\n') {
-            add_error(lexer, "Unclosed string literal");
-            free(buffer);
+    const char* input = lexer->input;
+    size_t length = lexer->length;
+    size_t start = lexer->position;
+
+    // Find the closing quote, skipping escaped characters
+    bool escaped = false;
+    size_t position = scan_kernels.find_any(input, start, length, '"', '\\', '\n');
+    while (position < length && input[position] == '\\') {
+        escaped = true;
+        if (position + 1 >= length) {
+            SHIFT(lexer, length - start);
+            add_error(lexer, "Incomplete escape sequence");
             return;
-        } 
-        // Normal character
-        else {
-            buffer[buf_index++] = NEXT(lexer, 0);
-            SHIFT(lexer, 1);
         }
+        position = scan_kernels.find_any(input, position + 2, length, '"', '\\', '\n');
     }
 
-    // Validate closing quote
-    if (lexer->position >= lexer->length || NEXT(lexer, 0) != '"') {
+    // A newline or the end of input ends the literal without a quote
+    SHIFT(lexer, position - start);
+    if (position >= length || input[position] != '"') {
         add_error(lexer, "Unclosed string literal");
-        free(buffer);
         return;
     }
 
-    // Add string token
-    buffer[buf_index] = '\0';
-    add_token(lexer, TOKEN_STRING, buffer, buf_index);
-    free(buffer);
+    if (escaped) {
+        char* decoded = scratch_alloc(lexer, position - start);
+        add_decoded_token(lexer, TOKEN_STRING, start, decoded,
+                          decode_escapes(input + start, position - start, decoded));
+    } else add_token(lexer, TOKEN_STRING, input + start, position - start);
     SHIFT(lexer, 1); // Skip closing quote
 }
 
-// Check if identifier is a valid modifier
-bool is_valid_modifier(const char* modifier) {
-    const char* valid_modifiers[] = { 
-        "const", "unsig", "signed", "extern", "static", 
-        "protected", "dynam", "regis", "local", "global"
-    };
-    int count = sizeof(valid_modifiers) / sizeof(valid_modifiers[0]);
-    for (int i = 0; i < count; i++) {
-        if (strcmp(modifier, valid_modifiers[i]) == 0) return true;
-    }
-    return false;
+// Classify an identifier span as a keyword, type, modifier or plain ID.
+// Dispatches on length and first character and confirms with memcmp, so
+// every word costs at most two comparisons and no allocation.
+static TokenType classify_word(const char* word, size_t length) {
+#define KEYWORD(text, type) if (memcmp(word, text, length) == 0) return type
+    switch (length) {
+        case 2:
+            switch (word[0]) {
+                case 'i': KEYWORD("if", TOKEN_IF); break;
+                case 'd': KEYWORD("do", TOKEN_DO); break;
+            }
+            break;
+        case 3:
+            if (word[0] == 'i') KEYWORD("int", TOKEN_TYPE);
+            break;
+        case 4:
+            switch (word[0]) {
+                case 'e': KEYWORD("elif", TOKEN_ELIF); KEYWORD("else", TOKEN_ELSE); break;
+                case 'f': KEYWORD("free", TOKEN_FREE); break;
+                case 'g': KEYWORD("goto", TOKEN_GOTO); break;
+                case 't': KEYWORD("this", TOKEN_THIS); break;
+                case 's': KEYWORD("size", TOKEN_SIZE); break;
+                case 'N': KEYWORD("NONE", TOKEN_NONE); break;
+                case 'r': KEYWORD("real", TOKEN_TYPE); break;
+                case 'c': KEYWORD("char", TOKEN_TYPE); break;
+                case 'v': KEYWORD("void", TOKEN_TYPE); break;
+            }
+            break;
+        case 5:
+            switch (word[0]) {
+                case 'a': KEYWORD("alloc", TOKEN_ALLOC); break;
+                case 'b': KEYWORD("break", TOKEN_BREAK); break;
+                case 'p': KEYWORD("parse", TOKEN_PARSE); break;
+                case 'c': KEYWORD("const", TOKEN_MODIFIER); break;
+                case 'u': KEYWORD("unsig", TOKEN_MODIFIER); break;
+                case 'd': KEYWORD("dynam", TOKEN_MODIFIER); break;
+                case 'r': KEYWORD("regis", TOKEN_MODIFIER); break;
+                case 'l': KEYWORD("local", TOKEN_MODIFIER); break;
+            }
+            break;
+        case 6:
+            switch (word[0]) {
+                case 'r': KEYWORD("return", TOKEN_RETURN); KEYWORD("ralloc", TOKEN_RALLOC); break;
+                case 'm': KEYWORD("malloc", TOKEN_MALLOC); break;
+                case 'd': KEYWORD("delete", TOKEN_DELETE); break;
+                case 'e': KEYWORD("ealloc", TOKEN_EALLOC); KEYWORD("extern", TOKEN_MODIFIER); break;
+                case 's': KEYWORD("signed", TOKEN_MODIFIER); KEYWORD("static", TOKEN_MODIFIER); break;
+                case 'g': KEYWORD("global", TOKEN_MODIFIER); break;
+            }
+            break;
+        case 7:
+            if (word[0] == 'c') KEYWORD("compile", TOKEN_COMPILE);
+            break;
+        case 8:
+            if (word[0] == 'c') KEYWORD("continue", TOKEN_CONTINUE);
+            break;
+        case 9:
+            if (word[0] == 'p') KEYWORD("protected", TOKEN_MODIFIER);
+            break;
+    }
+    return TOKEN_ID;
+}
+
+// Classify the word after '%' as a preprocessor directive
+static TokenType classify_directive(const char* word, size_t length) {
+    switch (length) {
+        case 4:
+            KEYWORD("line", TOKEN_PREPROC_LINE);
+            break;
+        case 5:
+            switch (word[0]) {
+                case 'u': KEYWORD("undef", TOKEN_PREPROC_UNDEF); break;
+                case 'i': KEYWORD("ifdef", TOKEN_PREPROC_IFDEF); break;
+                case 'e': KEYWORD("endif", TOKEN_PREPROC_ENDIF); KEYWORD("error", TOKEN_PREPROC_ERROR); break;
+                case 'm': KEYWORD("macro", TOKEN_PREPROC_MACRO); break;
+            }
+            break;
+        case 6:
+            switch (word[0]) {
+                case 'i': KEYWORD("inclib", TOKEN_PREPROC_INCLIB); KEYWORD("ifndef", TOKEN_PREPROC_IFNDEF); break;
+                case 'd': KEYWORD("define", TOKEN_PREPROC_DEFINE); break;
+                case 'a': KEYWORD("assign", TOKEN_PREPROC_ASSIGN); break;
+                case 'p': KEYWORD("pragma", TOKEN_PREPROC_PRAGMA); break;
+            }
+            break;
+        case 7:
+            KEYWORD("incfile", TOKEN_PREPROC_INCFILE);
+            break;
+    }
+    return TOKEN_PERCENT;
+#undef KEYWORD
+}
+
+// Check if identifier is a valid modifier
+bool is_valid_modifier(const char* modifier, size_t length) {
+    return classify_word(modifier, length) == TOKEN_MODIFIER;
 }
  
 // Check if identifier is a valid type
-bool is_valid_type(const char* type) {
-    const char* valid_types[] = { "int", "real", "char", "void" };
-    int count = sizeof(valid_types) / sizeof(valid_types[0]);
-    for (int i = 0; i < count; i++) {
-        if (strcmp(type, valid_types[i]) == 0) return true;
-    }
-    return false;
+bool is_valid_type(const char* type, size_t length) {
+    return classify_word(type, length) == TOKEN_TYPE;
 }
 
-// Main tokenization function
-void tokenize(Lexer* lexer) {
-    while (lexer->position < lexer->length) {
-        // Skip whitespace and comments before processing tokens
+// Parse the body of a compile(...) { ... } directive after the keyword
+void parse_compile(Lexer* lexer) {
+    skip_whitespace(lexer);
+
+    if (lexer->position >= lexer->length || NEXT(lexer, 0) != '(') add_error(lexer, "Expected '(' after 'compile'");
+    else {
+        SHIFT(lexer, 1);
         skip_whitespace(lexer);
-        skip_comments(lexer);
 
-        if (lexer->position >= lexer->length) break;
+        size_t start = lexer->position;
+        while (lexer->position < lexer->length && NEXT(lexer, 0) != ')') {
+            SHIFT(lexer, 1);
+        }
 
-        // Main token recognition switch
-        switch (NEXT(lexer, 0)) {
-            case '$': 
-                add_token(lexer, TOKEN_DOLLAR, "$", 1);
-                SHIFT(lexer, 1);
-                break;
+        if (lexer->position >= lexer->length) add_error(lexer, "Unclosed '(' in compile");
+        else {
+            size_t length = lexer->position - start;
+            add_token(lexer, TOKEN_OUTSIDE_COMPILE, lexer->input + start, length);
+            SHIFT(lexer, 1);
+        }
+    }
 
-            case '@':
-                add_token(lexer, TOKEN_AT, "@", 1);
-                SHIFT(lexer, 1);
-                break;
-            
-            case '?':
-                add_token(lexer, TOKEN_QUESTION, "?", 1);
-                SHIFT(lexer, 1);
-                break;
+    skip_whitespace(lexer);
 
-            case 'i':
-                if (strncmp(lexer->input + lexer->position, "if", 2) == 0) {
-                    add_token(lexer, TOKEN_IF, "if", 2);
-                    SHIFT(lexer, 2);
-                } else goto identifier;
-                break;
+    if (lexer->position >= lexer->length || NEXT(lexer, 0) != '{') add_error(lexer, "Expected '{' after compile directive");
+    else {
+        SHIFT(lexer, 1);
+        size_t start_brace = lexer->position;
+        int brace_depth = 1;
+        while (lexer->position < lexer->length && brace_depth > 0) {
+            if (NEXT(lexer, 0) == '{') brace_depth++;
+            else if (NEXT(lexer, 0) == '}') brace_depth--;
+            SHIFT(lexer, 1);
+        }
 
-            case 'f':
-                if (strncmp(lexer->input + lexer->position, "free", 4) == 0) {
-                    add_token(lexer, TOKEN_FREE, "free", 4);
-                    SHIFT(lexer, 4);
-                } else goto identifier;
-                break;
+        if (brace_depth != 0) add_error(lexer, "Unclosed '{' in compile");
+        else {
+            size_t length = (lexer->position - start_brace) - 1;
+            if (length > 0) add_token(lexer, TOKEN_OUTSIDE_CODE, lexer->input + start_brace, length);
+            else add_token(lexer, TOKEN_OUTSIDE_CODE, "", 0);
+        }
+    }
+}
 
-            case 'e':
-                if (strncmp(lexer->input + lexer->position, "elif", 4) == 0) {
-                    add_token(lexer, TOKEN_ELIF, "elif", 4);
-                    SHIFT(lexer, 4);
-                } else if (strncmp(lexer->input + lexer->position, "else", 4) == 0) {
-                    add_token(lexer, TOKEN_ELSE, "else", 4);
-                    SHIFT(lexer, 4);
-                } else if (strncmp(lexer->input + lexer->position, "ealloc", 6) == 0) {
-                    add_token(lexer, TOKEN_EALLOC, "ealloc", 6);
-                    SHIFT(lexer, 6);
-                } else goto identifier;
-                break;
+// Recognize the token (or compound construct such as a compile block or a
+// type annotation) at the current position. Returns false when the input
+// is malformed badly enough that tokenization has to stop.
+static bool lex_token(Lexer* lexer) {
+    char c = lexer->input[lexer->position];
+
+    // Words and numbers are the most frequent tokens: dispatch on class first
+    if (CHAR_CLASS(c) & CHAR_ALPHA) {
+        size_t start = lexer->position;
+        size_t length = scan_class(lexer->input, start, CHAR_IDENT);
+        SHIFT(lexer, length);
+        TokenType type = classify_word(lexer->input + start, length);
+        if (type == TOKEN_ID) {
+            add_identifier(lexer, start, length);
+            if (STATS(lexer)) lexer->stats->bytes[LEX_BYTES_IDENTIFIER] += length;
+        } else add_token(lexer, type, lexer->input + start, length);
+        if (type == TOKEN_COMPILE) parse_compile(lexer);
+        return true;
+    }
+    if (CHAR_CLASS(c) & CHAR_DIGIT) {
+        MEASURED(lexer, LEX_BYTES_NUMBER, LEX_TIME_NUMBER, parse_number(lexer));
+        return true;
+    }
 
-            case 't':
-                if (strncmp(lexer->input + lexer->position, "this", 4) == 0) {
-                    add_token(lexer, TOKEN_THIS, "this", 4);
-                    SHIFT(lexer, 4);
-                } else goto identifier;
-                break;
+    // Main token recognition switch
+    switch (c) {
+        case '$': 
+            add_token(lexer, TOKEN_DOLLAR, "$", 1);
+            SHIFT(lexer, 1);
+            break;
 
-            case 'm':
-                if (strncmp(lexer->input + lexer->position, "malloc", 6) == 0) {
-                    add_token(lexer, TOKEN_MALLOC, "malloc", 6);
-                    SHIFT(lexer, 6);
-                } else goto identifier;
-                break;
+        case '@':
+            add_token(lexer, TOKEN_AT, "@", 1);
+            SHIFT(lexer, 1);
+            break;
         
-            case 's':
-                if (strncmp(lexer->input + lexer->position, "size", 4) == 0) {
-                    add_token(lexer, TOKEN_SIZE, "size", 4);
-                    SHIFT(lexer, 4);
-                } else goto identifier;
-                break;
+        case '?':
+            add_token(lexer, TOKEN_QUESTION, "?", 1);
+            SHIFT(lexer, 1);
+            break;
 
-            case 'g':
-                if (strncmp(lexer->input + lexer->position, "goto", 4) == 0) {
-                    add_token(lexer, TOKEN_GOTO, "goto", 4);
-                    SHIFT(lexer, 4);
-                } else goto identifier;
-                break;
+    case '+':
+        if (NEXT(lexer, 1) == '+') {
+            add_token(lexer, TOKEN_DOUBLE_PLUS, "++", 2);
+            SHIFT(lexer, 2);
+        } else if (NEXT(lexer, 1) == '=') {
+            add_token(lexer, TOKEN_PLUS_EQ, "+=", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_PLUS, "+", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
 
+    case '-':
+        if (NEXT(lexer, 1) == '-') {
+            add_token(lexer, TOKEN_DOUBLE_MINUS, "--", 2);
+            SHIFT(lexer, 2);
+        } else if (NEXT(lexer, 1) == '=') {
+            add_token(lexer, TOKEN_MINUS_EQ, "-=", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_MINUS, "-", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
 
-            case 'd':
-                if (strncmp(lexer->input + lexer->position, "do", 2) == 0) {
-                    add_token(lexer, TOKEN_DO, "do", 2);
-                    SHIFT(lexer, 2);
-                } else if (strncmp(lexer->input + lexer->position, "delete", 6) == 0) {
-                    add_token(lexer, TOKEN_DELETE, "delete", 6);
-                    SHIFT(lexer, 6);
-                } else goto identifier;
-                break;
+    case '*':
+        if (NEXT(lexer, 1) == '*') {
+            add_token(lexer, TOKEN_DOUBLE_STAR, "**", 2);
+            SHIFT(lexer, 2);
+        } else if (NEXT(lexer, 1) == '=') {
+            add_token(lexer, TOKEN_STAR_EQ, "*=", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_STAR, "*", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
 
-            case 'c':
-                if (strncmp(lexer->input + lexer->position, "continue", 8) == 0) {
-                    add_token(lexer, TOKEN_CONTINUE, "continue", 8);
-                    SHIFT(lexer, 8);
-                } else if (strncmp(lexer->input + lexer->position, "compile", 7) == 0) {
-                    add_token(lexer, TOKEN_COMPILE, "compile", 7);
-                    SHIFT(lexer, 7);
+    case '/':
+        if (NEXT(lexer, 1) == '=') {
+            add_token(lexer, TOKEN_SLASH_EQ, "/=", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_SLASH, "/", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
 
-                    skip_whitespace(lexer);
+    case '|':
+        if (NEXT(lexer, 1) == '|') {
+            add_token(lexer, TOKEN_DOUBLE_PIPE, "||", 2);
+            SHIFT(lexer, 2);
+        } else if (NEXT(lexer, 1) == '=') {
+            add_token(lexer, TOKEN_PIPE_EQ, "|=", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_PIPE, "|", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
+
+    case '&':
+        if (NEXT(lexer, 1) == '=') {
+            add_token(lexer, TOKEN_AMPERSAND_EQ, "&=", 2);
+            SHIFT(lexer, 2);
+        } else if (NEXT(lexer, 1) == '&') {
+            add_token(lexer, TOKEN_DOUBLE_AMPERSAND, "&&", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_AMPERSAND, "&", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
+
+    case '!':
+        if (NEXT(lexer, 1) == '=') {
+            add_token(lexer, TOKEN_NE, "!=", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_BANG, "!", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
+
+    case '^':
+        if (NEXT(lexer, 1) == '=') {
+            add_token(lexer, TOKEN_CARET_EQ, "^=", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_CARET, "^", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
+
+    case '>':
+        if (MATCH(lexer, ">>>>", 4)) {
+            add_token(lexer, TOKEN_ROR, ">>>>", 4);
+            SHIFT(lexer, 4);
+        } else if (MATCH(lexer, ">>>", 3)) {
+            add_token(lexer, TOKEN_SAR, ">>>", 3);
+            SHIFT(lexer, 3);
+        } else if (NEXT(lexer, 1) == '>') {
+            add_token(lexer, TOKEN_SHR, ">>", 2);
+            SHIFT(lexer, 2);
+        } else if (NEXT(lexer, 2) == '=') {
+            add_token(lexer, TOKEN_GE, ">=", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_GT, ">", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
+
+    case '<':
+        if (MATCH(lexer, "<<<<", 4)) {
+            add_token(lexer, TOKEN_ROL, "<<<<", 4);
+            SHIFT(lexer, 4);
+        } else if (MATCH(lexer, "<<<", 3)) {
+            add_token(lexer, TOKEN_SAL, "<<<", 3);
+            SHIFT(lexer, 3);
+        } else if (NEXT(lexer, 1) == '<') {
+            add_token(lexer, TOKEN_SHL, "<<", 2);
+            SHIFT(lexer, 2);
+        } else if (NEXT(lexer, 2) == '=') {
+            add_token(lexer, TOKEN_LE, "<=", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_LT, "<", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
 
-                    if (lexer->position >= lexer->length || NEXT(lexer, 0) != '(') add_error(lexer, "Expected '(' after 'compile'");
-                    else {
-                        SHIFT(lexer, 1);
+    case '~':
+        if (NEXT(lexer, 1) == '=') {
+            add_token(lexer, TOKEN_TILDE_EQ, "~=", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_TILDE, "~", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
+
+    case ':':
+        if (NEXT(lexer, 1) == ':') {
+            add_token(lexer, TOKEN_DOUBLE_COLON, "::", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_COLON, ":", 1);
+            SHIFT(lexer, 1);
+            
+            // A type annotation follows only if a modifier list or a type
+            // name does; any other word is an operand (the colon of a ?:).
+            // Words are whole identifier runs, so `real_total` or `int2`
+            // is an operand, not a type with something glued to it
+            skip_whitespace(lexer);
+            size_t word = scan_class(lexer->input, lexer->position, CHAR_IDENT);
+            if ((word > 0 && is_valid_type(lexer->input + lexer->position, word)) ||
+                NEXT(lexer, 0) == '[') {
+                if (NEXT(lexer, 0) == '[') {
+                    add_token(lexer, TOKEN_LBRACKET, "[", 1);
+                    SHIFT(lexer, 1);
+
+                    while (lexer->position < lexer->length) {
                         skip_whitespace(lexer);
 
-                        int start = lexer->position;
-                        while (lexer->position < lexer->length && NEXT(lexer, 0) != ')') {
-                            SHIFT(lexer, 1);
+                        size_t mod_start = lexer->position;
+                        size_t run = scan_class(lexer->input, lexer->position, CHAR_IDENT);
+                        SHIFT(lexer, run);
+
+                        if (lexer->position > mod_start) {
+                            size_t length = lexer->position - mod_start;
+                            const char* modifier = lexer->input + mod_start;
+
+                            if (is_valid_modifier(modifier, length)) add_token(lexer, TOKEN_MODIFIER, modifier, length);
+                            else add_error(lexer, "Invalid modifier: %.*s", (int)length, modifier);
                         }
 
-                        if (lexer->position >= lexer->length) add_error(lexer, "Unclosed '(' in compile");
-                        else {
-                            int length = lexer->position - start;
-                            add_token(lexer, TOKEN_OUTSIDE_COMPILE, lexer->input + start, length);
+                        skip_whitespace(lexer);
+
+                        if (NEXT(lexer, 0) == ',') {
+                            add_token(lexer, TOKEN_COMMA, ",", 1);
                             SHIFT(lexer, 1);
+                            skip_whitespace(lexer);
+                        } else if (NEXT(lexer, 0) == ']') break;
+                        else {
+                            add_error(lexer, "Expected ',' or ']' in modifier list");
+                            return false;
                         }
                     }
 
+                    if (lexer->position >= lexer->length || 
+                        NEXT(lexer, 0) != ']') {
+                        add_error(lexer, "Expected ']' after modifiers");
+                        return false;
+                    }
+
+                    add_token(lexer, TOKEN_RBRACKET, "]", 1);
+                    SHIFT(lexer, 1);
                     skip_whitespace(lexer);
+                }
 
-                    if (lexer->position >= lexer->length || NEXT(lexer, 0) != '{') add_error(lexer, "Expected '{' after compile directive");
-                    else {
-                        SHIFT(lexer, 1);
-                        int start_brace = lexer->position;
-                        int brace_depth = 1;
-                        while (lexer->position < lexer->length && brace_depth > 0) {
-                            if (NEXT(lexer, 0) == '{') brace_depth++;
-                            else if (NEXT(lexer, 0) == '}') brace_depth--;
-                            SHIFT(lexer, 1);
-                        }
+                size_t token_start = lexer->position;
+                size_t run = scan_class(lexer->input, lexer->position, CHAR_IDENT);
+                SHIFT(lexer, run);
+                if (lexer->position > token_start) {
+                    size_t length = lexer->position - token_start;
+                    const char* type_str = lexer->input + token_start;
+                    if (is_valid_type(type_str, length)) add_token(lexer, TOKEN_TYPE, type_str, length);
+                    else add_error(lexer, "Invalid type: %.*s", (int)length, type_str);
+                } else {
+                    add_error(lexer, "Expected type after colon");
+                    return false;
+                }
 
-                        if (brace_depth != 0) add_error(lexer, "Unclosed '{' in compile");
-                        else {
-                            int length = (lexer->position - start_brace) - 1;
-                            if (length > 0) add_token(lexer, TOKEN_OUTSIDE_CODE, lexer->input + start_brace, length);
-                            else add_token(lexer, TOKEN_OUTSIDE_CODE, "", 0);
-                        }
+                if (lexer->position < lexer->length && NEXT(lexer, 0) == ':') {
+                    add_token(lexer, TOKEN_COLON, ":", 1);
+                    SHIFT(lexer, 1);
+                    token_start = lexer->position;
+                    size_t run = scan_class(lexer->input, lexer->position, CHAR_DIGIT);
+                    SHIFT(lexer, run);
+
+                    if (lexer->position > token_start) {
+                        size_t length = lexer->position - token_start;
+                        add_token(lexer, TOKEN_VAR_SIZE, lexer->input + token_start, length);
+                    } else {
+                        add_error(lexer, "Expected bit size after ':'");
+                        return false;
                     }
-                } else goto identifier;
-                break;
+                }
+            }
+        }
+        break;
+
+    case '.':
+        if (MATCH(lexer, "...", 3)) {
+            add_token(lexer, TOKEN_ELLIPSIS, "...", 3);
+            SHIFT(lexer, 3);
+        } else if (MATCH(lexer, "..", 2)) {
+            add_token(lexer, TOKEN_DOUBLE_DOT, "..", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_DOT, ".", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
 
-            case 'a':
-                if (strncmp(lexer->input + lexer->position, "alloc", 5) == 0) {
-                    add_token(lexer, TOKEN_ALLOC, "alloc", 5);
-                    SHIFT(lexer, 5);
-                } else goto identifier;
-                break;
-        
-            case 'p':
-                if (strncmp(lexer->input + lexer->position, "parse", 5) == 0) {
-                    add_token(lexer, TOKEN_PARSE, "parse", 5);
-                    SHIFT(lexer, 5);
-                } else goto identifier;
-                break; 
-
-        case 'b':
-            if (strncmp(lexer->input + lexer->position, "break", 5) == 0) {
-                add_token(lexer, TOKEN_BREAK, "break", 5);
-                SHIFT(lexer, 5);
-            } else goto identifier;
-            break;
+    case '%': {
+        // Directive name runs to the end of the word after '%'
+        size_t length = 1 + scan_class(lexer->input, lexer->position + 1, CHAR_ALPHA);
+        TokenType directive = classify_directive(lexer->input + lexer->position + 1, length - 1);
 
-        case '+':
-            if (NEXT(lexer, 1) == '+') {
-                add_token(lexer, TOKEN_DOUBLE_PLUS, "++", 2);
-                SHIFT(lexer, 2);
-            } else if (NEXT(lexer, 1) == '=') {
-                add_token(lexer, TOKEN_PLUS_EQ, "+=", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_PLUS, "+", 1);
-                SHIFT(lexer, 1);
-            }
-            break;
+        if (directive == TOKEN_PERCENT) length = 1;
+        add_token(lexer, directive, lexer->input + lexer->position, length);
+        SHIFT(lexer, length);
+        break;
+    }
 
-        case '-':
-            if (NEXT(lexer, 1) == '-') {
-                add_token(lexer, TOKEN_DOUBLE_MINUS, "--", 2);
-                SHIFT(lexer, 2);
-            } else if (NEXT(lexer, 1) == '=') {
-                add_token(lexer, TOKEN_MINUS_EQ, "-=", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_MINUS, "-", 1);
-                SHIFT(lexer, 1);
-            }
-            break;
+    case '{':
+        add_token(lexer, TOKEN_LCURLY, "{", 1);
+        SHIFT(lexer, 1);
+        break;
 
-        case '*':
-            if (NEXT(lexer, 1) == '*') {
-                add_token(lexer, TOKEN_DOUBLE_STAR, "**", 2);
-                SHIFT(lexer, 2);
-            } else if (NEXT(lexer, 1) == '=') {
-                add_token(lexer, TOKEN_STAR_EQ, "*=", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_STAR, "*", 1);
-                SHIFT(lexer, 1);
-            }
-            break;
+    case '}':
+        add_token(lexer, TOKEN_RCURLY, "}", 1);
+        SHIFT(lexer, 1);
+        break;
 
-        case '/':
-            if (NEXT(lexer, 1) == '=') {
-                add_token(lexer, TOKEN_SLASH_EQ, "/=", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_SLASH, "/", 1);
-                SHIFT(lexer, 1);
-            }
-            break;
+    case '[':
+        add_token(lexer, TOKEN_LBRACKET, "[", 1);
+        SHIFT(lexer, 1);
+        break;
 
-        case '|':
-            if (NEXT(lexer, 1) == '|') {
-                add_token(lexer, TOKEN_DOUBLE_PIPE, "||", 2);
-                SHIFT(lexer, 2);
-            } else if (NEXT(lexer, 1) == '=') {
-                add_token(lexer, TOKEN_PIPE_EQ, "|=", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_PIPE, "|", 1);
-                SHIFT(lexer, 1);
-            }
-            break;
+    case ']':
+        add_token(lexer, TOKEN_RBRACKET, "]", 1);
+        SHIFT(lexer, 1);
+        break;
 
-        case '&':
-            if (NEXT(lexer, 1) == '=') {
-                add_token(lexer, TOKEN_AMPERSAND_EQ, "&=", 2);
-                SHIFT(lexer, 2);
-            } else if (NEXT(lexer, 1) == '&') {
-                add_token(lexer, TOKEN_DOUBLE_AMPERSAND, "&&", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_AMPERSAND, "&", 1);
-                SHIFT(lexer, 1);
-            }
-            break;
+    case '(':
+        add_token(lexer, TOKEN_LPAREN, "(", 1);
+        SHIFT(lexer, 1);
+        break;
 
-        case '!':
-            if (NEXT(lexer, 1) == '=') {
-                add_token(lexer, TOKEN_NE, "!=", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_BANG, "!", 1);
-                SHIFT(lexer, 1);
-            }
-            break;
+    case ')':
+        add_token(lexer, TOKEN_RPAREN, ")", 1);
+        SHIFT(lexer, 1);
+        break;
 
-        case '^':
-            if (NEXT(lexer, 1) == '=') {
-                add_token(lexer, TOKEN_CARET_EQ, "^=", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_CARET, "^", 1);
-                SHIFT(lexer, 1);
-            }
-            break;
+    case '=':
+        if (NEXT(lexer, 1) == '=') {
+            add_token(lexer, TOKEN_DOUBLE_EQ, "==", 2);
+            SHIFT(lexer, 2);
+        } else {
+            add_token(lexer, TOKEN_EQUAL, "=", 1);
+            SHIFT(lexer, 1);
+        }
+        break;
 
-        case '>':
-            if (strncmp(lexer->input + lexer->position, ">>>>", 4) == 0) {
-                add_token(lexer, TOKEN_ROR, ">>>>", 4);
-                SHIFT(lexer, 4);
-            } else if (strncmp(lexer->input + lexer->position, ">>>", 3) == 0) {
-                add_token(lexer, TOKEN_SAR, ">>>", 3);
-                SHIFT(lexer, 3);
-            } else if (NEXT(lexer, 1) == '>') {
-                add_token(lexer, TOKEN_SHR, ">>", 2);
-                SHIFT(lexer, 2);
-            } else if (NEXT(lexer, 2) == '=') {
-                add_token(lexer, TOKEN_GE, ">=", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_GT, ">", 1);
-                SHIFT(lexer, 1);
-            }
-            break;
+    case ',':
+        add_token(lexer, TOKEN_COMMA, ",", 1);
+        SHIFT(lexer, 1);
+        break;
 
-        case '<':
-            if (strncmp(lexer->input + lexer->position, "<<<<", 4) == 0) {
-                add_token(lexer, TOKEN_ROL, "<<<<", 4);
-                SHIFT(lexer, 4);
-            } else if (strncmp(lexer->input + lexer->position, "<<<", 3) == 0) {
-                add_token(lexer, TOKEN_SAL, "<<<", 3);
-                SHIFT(lexer, 3);
-            } else if (NEXT(lexer, 1) == '<') {
-                add_token(lexer, TOKEN_SHL, "<<", 2);
-                SHIFT(lexer, 2);
-            } else if (NEXT(lexer, 2) == '=') {
-                add_token(lexer, TOKEN_LE, "<=", 2);
+    case ';':
+        add_token(lexer, TOKEN_SEMICOLON, ";", 1);
+        SHIFT(lexer, 1);
+        break;
+
+    case '\'':
+        MEASURED(lexer, LEX_BYTES_STRING, LEX_TIME_STRING, parse_char(lexer));
+        break;
+
+    case '"':
+        MEASURED(lexer, LEX_BYTES_STRING, LEX_TIME_STRING, parse_string(lexer));
+        break;
+
+    case '_':
+        if (NEXT(lexer, 1) == '_') {
+                add_token(lexer, TOKEN_DOUBLE_UNDERSCORE, "__", 2);
                 SHIFT(lexer, 2);
             } else {
-                add_token(lexer, TOKEN_LT, "<", 1);
+                size_t start = lexer->position;
                 SHIFT(lexer, 1);
+                if (CHAR_CLASS(NEXT(lexer, 0)) & CHAR_IDENT) {
+                    size_t run = scan_class(lexer->input, lexer->position, CHAR_IDENT);
+                    SHIFT(lexer, run);
+                    size_t length = lexer->position - start;
+                    add_identifier(lexer, start, length);
+                } else add_token(lexer, TOKEN_UNDERSCORE, "_", 1);
             }
             break;
 
-        case '~':
-            if (NEXT(lexer, 1) == '=') {
-                add_token(lexer, TOKEN_TILDE_EQ, "~=", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_TILDE, "~", 1);
-                SHIFT(lexer, 1);
-            }
+    default:
+        if (NEXT(lexer, 0) == '#' || 
+            (lexer->position + 1 < lexer->length && 
+            NEXT(lexer, 0) == '<' && 
+            NEXT(lexer, 1) == '/')) {
+            skip_comments(lexer);
             break;
+        }
 
-        case ':':
-            if (NEXT(lexer, 1) == ':') {
-                add_token(lexer, TOKEN_DOUBLE_COLON, "::", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_COLON, ":", 1);
-                SHIFT(lexer, 1);
-                
-                skip_whitespace(lexer);
-                if (isalpha(NEXT(lexer, 0)) || 
-                    NEXT(lexer, 0) == '[') {
-                    if (NEXT(lexer, 0) == '[') {
-                        add_token(lexer, TOKEN_LBRACKET, "[", 1);
-                        SHIFT(lexer, 1);
-
-                        while (lexer->position < lexer->length) {
-                            skip_whitespace(lexer);
+        add_error(lexer, "Unexpected character: '%c'", NEXT(lexer, 0));
+        SHIFT(lexer, 1);
+        break;
+    }
+    return true;
+}
 
-                            int mod_start = lexer->position;
-                            while (lexer->position < lexer->length &&
-                                isalpha(NEXT(lexer, 0))) {
-                                SHIFT(lexer, 1);
-                            }
+// State of the main loop between two tokens. What is lexed from here on
+// depends only on the position.
+typedef struct {
+    size_t position;
+    size_t token_count;
+} SyncPoint;
 
-                            if (lexer->position > mod_start) {
-                                int length = lexer->position - mod_start;
-                                char* modifier = strndup(lexer->input + mod_start, length);
+typedef struct {
+    SyncPoint* points;
+    size_t count;
+    size_t capacity;
+} SyncLog;
+
+static void log_sync_point(SyncLog* log, const Lexer* lexer) {
+    if (log->count == log->capacity) {
+        log->capacity = log->capacity ? log->capacity * 2 : 256;
+        log->points = realloc(log->points, log->capacity * sizeof(SyncPoint));
+    }
+    log->points[log->count++] = (SyncPoint){ lexer->position, lexer->tokens.count };
+}
 
-                                if (is_valid_modifier(modifier)) add_token(lexer, TOKEN_MODIFIER, modifier, length);
-                                else add_error(lexer, "Invalid modifier: %s", modifier);
-                                free(modifier);
-                            }
+// Lex the tokens that start before `end`. Returns false if lex_token
+// asked to stop. With a log, the loop state is recorded at every token
+// boundary before `log_limit`.
+static bool tokenize_until(Lexer* lexer, size_t end, SyncLog* log, size_t log_limit) {
+    while (lexer->position < end && lexer->position < lexer->length) {
+        if (log && lexer->position < log_limit) log_sync_point(log, lexer);
 
-                            skip_whitespace(lexer);
+        // Skip whitespace and comments before processing tokens
+        skip_whitespace(lexer);
+        skip_comments(lexer);
 
-                            if (NEXT(lexer, 0) == ',') {
-                                add_token(lexer, TOKEN_COMMA, ",", 1);
-                                SHIFT(lexer, 1);
-                                skip_whitespace(lexer);
-                            } else if (NEXT(lexer, 0) == ']') break;
-                            else {
-                                add_error(lexer, "Expected ',' or ']' in modifier list");
-                                return;
-                            }
-                        }
+        if (lexer->position >= lexer->length) break;
+        if (!lex_token(lexer)) return false;
+    }
+    return true;
+}
 
-                        if (lexer->position >= lexer->length || 
-                            NEXT(lexer, 0) != ']') {
-                            add_error(lexer, "Expected ']' after modifiers");
-                            return;
-                        }
+// Main tokenization function
+void tokenize(Lexer* lexer) {
+    size_t before = lexer->tokens.count;
+    uint64_t clock = STATS(lexer) ? stats_clock() : 0;
+    if (lexer->length > UINT32_MAX) {
+        add_error(lexer, "Input too large for batch tokenization, use --stream");
+    } else if (tokenize_until(lexer, lexer->length, NULL, 0)) {
+        // Add EOF token after processing all input
+        add_token(lexer, TOKEN_EOF, "EOF", 3);
+    }
 
-                        add_token(lexer, TOKEN_RBRACKET, "]", 1);
-                        SHIFT(lexer, 1);
-                        skip_whitespace(lexer);
-                    }
+    if (STATS(lexer)) {
+        lexer->stats->ticks[LEX_TIME_TOTAL] += stats_clock() - clock;
+        lexer->stats->calls[LEX_TIME_TOTAL]++;
+        count_tokens(lexer, before);
+    }
+}
 
-                    int token_start = lexer->position;
-                    while (lexer->position < lexer->length &&
-                        isalpha(NEXT(lexer, 0))) {
-                        SHIFT(lexer, 1);
-                    }
-                    if (lexer->position > token_start) {
-                        int length = lexer->position - token_start;
-                        char* type_str = strndup(lexer->input + token_start, length);
-                        if (is_valid_type(type_str)) add_token(lexer, TOKEN_TYPE, type_str, length);
-                        else add_error(lexer, "Invalid type: %s", type_str);
-                        free(type_str);
-                    } else {
-                        add_error(lexer, "Expected type after colon");
-                        return;
-                    }
+// Smallest chunk worth a thread, and how far into a chunk its start
+// state is looked for when stitching
+#ifndef PARALLEL_MIN_CHUNK
+#define PARALLEL_MIN_CHUNK (256 * 1024)
+#endif
+#define PARALLEL_SYNC_WINDOW (64 * 1024)
 
-                    if (lexer->position < lexer->length && NEXT(lexer, 0) == ':') {
-                        add_token(lexer, TOKEN_COLON, ":", 1);
-                        SHIFT(lexer, 1);
-                        token_start = lexer->position;
+// One chunk of a parallel tokenization: [start, end) lexed by its own
+// lexer from a guessed state (a line start outside of any literal or
+// comment)
+typedef struct {
+    Lexer* lexer;
+    size_t start;
+    size_t end;
+    SyncLog log;
+    bool finished;
+} LexChunk;
+
+static void* lex_chunk(void* argument) {
+    LexChunk* chunk = argument;
+    chunk->finished = tokenize_until(chunk->lexer, chunk->end, &chunk->log,
+                                     chunk->start + PARALLEL_SYNC_WINDOW);
+    return NULL;
+}
 
-                        while (lexer->position < lexer->length &&
-                            isdigit(NEXT(lexer, 0))) {
-                            SHIFT(lexer, 1);
-                        }
+// Recorded state at `position`, if the chunk's lexer stopped there
+static const SyncPoint* find_sync_point(const SyncLog* log, size_t position) {
+    size_t low = 0, high = log->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (log->points[middle].position < position) low = middle + 1;
+        else high = middle;
+    }
+    return low < log->count && log->points[low].position == position ? &log->points[low] : NULL;
+}
 
-                        if (lexer->position > token_start) {
-                            int length = lexer->position - token_start;
-                            add_token(lexer, TOKEN_VAR_SIZE, lexer->input + token_start, length);
-                        } else {
-                            add_error(lexer, "Expected bit size after ':'");
-                            return;
-                        }
-                    }
-                }
+// Move the scratch blocks of `from` into `lexer`, behind its current block
+static void adopt_scratch(Lexer* lexer, Lexer* from) {
+    struct ScratchBlock* blocks = from->scratch;
+    if (!blocks) return;
+    from->scratch = NULL;
+    if (!lexer->scratch) {
+        lexer->scratch = blocks;
+        return;
+    }
+    struct ScratchBlock* last = blocks;
+    while (last->next) last = last->next;
+    last->next = lexer->scratch->next;
+    lexer->scratch->next = blocks;
+}
+
+// Move tokens [first, count) of `from` to the end of `to`, together with
+// their payloads and numbers. Symbols are renumbered into the symbol table
+// of `to` in order of use, so the numbering is the one a single lexer
+// would produce.
+static void move_tokens(TokenBuffer* to, TokenBuffer* from, size_t first) {
+    size_t taken = from->count - first;
+    if (to->count + taken > to->capacity) grow_tokens(to, to->count + taken);
+    memcpy(to->kinds + to->count, from->kinds + first, taken * sizeof(uint8_t));
+    memcpy(to->offsets + to->count, from->offsets + first, taken * sizeof(uint32_t));
+    memcpy(to->lengths + to->count, from->lengths + first, taken * sizeof(uint32_t));
+
+    // Numbers of the moved tokens are the tail of the number table
+    size_t number = from->number_count;
+    for (size_t i = first; i < from->count; i++) {
+        if (from->kinds[i] == TOKEN_INT || from->kinds[i] == TOKEN_REAL) {
+            number = from->values[i];
+            break;
+        }
+    }
+    size_t moved = from->number_count - number;
+    if (to->number_count + moved > to->number_capacity) {
+        to->number_capacity = to->number_count + moved;
+        to->numbers = realloc(to->numbers, to->number_capacity * sizeof(NumberValue));
+    }
+    memcpy(to->numbers + to->number_count, from->numbers + number, moved * sizeof(NumberValue));
+
+    const SymbolTable* names = from->symbol_table;
+    uint32_t* renumber = malloc((names->count ? names->count : 1) * sizeof(uint32_t));
+    memset(renumber, 0xFF, names->count * sizeof(uint32_t));
+    for (size_t i = 0; i < taken; i++) {
+        uint32_t value = from->values[first + i];
+        TokenType type = (TokenType)from->kinds[first + i];
+        if (value != SYMBOL_NONE && type == TOKEN_ID) {
+            if (renumber[value] == SYMBOL_NONE) {
+                const Symbol* entry = &names->entries[value];
+                renumber[value] = intern_symbol(to->symbol_table, names->names + entry->offset, entry->length);
+            }
+            value = renumber[value];
+        } else if (value != SYMBOL_NONE) {
+            value = (uint32_t)(value - number + to->number_count);
+        }
+        to->values[to->count + i] = value;
+    }
+    free(renumber);
+    to->number_count += moved;
+
+    size_t payload = from->payload_count;
+    while (payload > 0 && from->payloads[payload - 1].token >= first) payload--;
+    moved = from->payload_count - payload;
+    if (to->payload_count + moved > to->payload_capacity) {
+        to->payload_capacity = to->payload_count + moved;
+        to->payloads = realloc(to->payloads, to->payload_capacity * sizeof(TokenPayload));
+    }
+    for (size_t i = 0; i < moved; i++) {
+        TokenPayload entry = from->payloads[payload + i];
+        entry.token = to->count + (entry.token - first);
+        to->payloads[to->payload_count++] = entry;
+    }
+
+    to->count += taken;
+    from->count = first;
+    from->payload_count = payload;
+    from->number_count = number;
+}
+
+// Tokenize with up to `threads` threads. The input is cut at line starts
+// and every chunk is lexed speculatively, as if nothing (string, comment,
+// compile block) were open at its start. The chunks are then stitched in
+// order: a chunk's tokens are kept from the token boundary where the
+// previous chunk's lexer really ended; a chunk whose lexer never stopped
+// there is lexed again from it. The result is identical to tokenize().
+void tokenize_parallel(Lexer* lexer, int threads) {
+    size_t span = lexer->length - lexer->position;
+    size_t count = threads > 1 ? (size_t)threads : 1;
+    if (count > span / PARALLEL_MIN_CHUNK) count = span / PARALLEL_MIN_CHUNK;
+    if (lexer->length > UINT32_MAX) count = 1;
+#ifndef PAXSI_HAVE_THREADS
+    count = 1;
+#endif
+    if (count < 2) {
+        tokenize(lexer);
+        return;
+    }
+    size_t before = lexer->tokens.count;
+
+    LexChunk* chunks = calloc(count, sizeof(LexChunk));
+    size_t start = lexer->position;
+    for (size_t i = 0; i < count; i++) {
+        size_t end = lexer->length;
+        if (i + 1 < count) {
+            size_t guess = lexer->position + span / count * (i + 1);
+            if (guess < start) guess = start;
+            const char* newline = memchr(lexer->input + guess, '\n', lexer->length - guess);
+            if (newline) end = newline - lexer->input + 1;
+        }
+
+        Lexer* chunk_lexer = init_lexer_n(lexer->input, lexer->length);
+        chunk_lexer->position = start;
+        chunks[i].lexer = chunk_lexer;
+        chunks[i].start = start;
+        chunks[i].end = end;
+        start = end;
+    }
+
+#ifdef PAXSI_HAVE_THREADS
+    pthread_t* workers = malloc(count * sizeof(pthread_t));
+    bool* started = calloc(count, sizeof(bool));
+    for (size_t i = 1; i < count; i++) {
+        started[i] = pthread_create(&workers[i], NULL, lex_chunk, &chunks[i]) == 0;
+    }
+    lex_chunk(&chunks[0]);
+    for (size_t i = 1; i < count; i++) {
+        if (started[i]) pthread_join(workers[i], NULL);
+        else lex_chunk(&chunks[i]);
+    }
+    free(started);
+    free(workers);
+#endif
+
+    bool running = true;
+    for (size_t i = 0; i < count && running; i++) {
+        LexChunk* chunk = &chunks[i];
+        size_t first = 0;
+        if (i > 0) {
+            const SyncPoint* point = find_sync_point(&chunk->log, lexer->position);
+            if (point) first = point->token_count;
+            else {
+                // The guessed start state was wrong: lex again from the real one
+                free_lexer(chunk->lexer);
+                chunk->lexer = init_lexer_n(lexer->input, lexer->length);
+                chunk->lexer->position = lexer->position;
+                chunk->finished = tokenize_until(chunk->lexer, chunk->end, NULL, 0);
             }
+        }
+
+        // Take over the chunk's tokens from `first` on, with their storage
+        Lexer* source = chunk->lexer;
+        move_tokens(&lexer->tokens, &source->tokens, first);
+        adopt_scratch(lexer, source);
+
+        lexer->position = source->position;
+        running = chunk->finished;
+
+        free_lexer(source);
+        chunk->lexer = NULL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (chunks[i].lexer) free_lexer(chunks[i].lexer);
+        free(chunks[i].log.points);
+    }
+    free(chunks);
+
+    if (running) add_token(lexer, TOKEN_EOF, "EOF", 3);
+    if (STATS(lexer)) count_tokens(lexer, before);
+}
+
+// Pending token `index` as a standalone record. Its line comes from the
+// line cursor, which only moves forward: tokens are handed out in order.
+static Token hand_out_token(Lexer* lexer, size_t index) {
+    TokenBuffer* tokens = &lexer->tokens;
+    uint64_t offset = lexer->base + tokens->offsets[index];
+    advance_line_cursor(lexer, offset);
+
+    Token token;
+    token.type = (TokenType)tokens->kinds[index];
+    token.value = token_value(tokens, index, &token.length);
+    token.line = lexer->line;
+    token.column = (int64_t)(offset - lexer->line_start) + 1;
+    token.symbol = token.type == TOKEN_ID ? tokens->values[index] : SYMBOL_NONE;
+    token.number = token_number(tokens, index);
+    token.owned = false;
+    return token;
+}
+
+// Hand the pending tokens to the sink and forget them
+static void sink_tokens(Lexer* lexer, TokenSink sink, void* context) {
+    for (size_t i = 0; i < lexer->tokens.count; i++) {
+        Token token = hand_out_token(lexer, i);
+        sink(context, &token);
+    }
+    drop_tokens(lexer, 0);
+}
+
+// How many tokens lex_more lexes per call: handing them out one by one
+// from the buffer is cheaper than entering the main loop for each
+#define LEX_BATCH 64
+
+// Lex a batch of tokens (at least one unless input is over). The EOF token
+// (or the error that stopped lexing) is the last one; after it returns false.
+static bool lex_more(Lexer* lexer) {
+    size_t before = lexer->tokens.count;
+    uint64_t clock = STATS(lexer) ? stats_clock() : 0;
+    while (!lexer->finished && lexer->tokens.count - before < LEX_BATCH) {
+        if (!lexer->reader && lexer->length > UINT32_MAX) {
+            add_error(lexer, "Input too large for batch tokenization, use --stream");
+            lexer->finished = true;
             break;
+        }
 
-        case '.':
-            if (strncmp(lexer->input + lexer->position, "...", 3) == 0) {
-                add_token(lexer, TOKEN_ELLIPSIS, "...", 3);
-                SHIFT(lexer, 3);
-    lexer->column++;
-            } else if (strncmp(lexer->input + lexer->position, "..", 2) == 0) {
-                add_token(lexer, TOKEN_DOUBLE_DOT, "..", 2);
-                SHIFT(lexer, 2);
-            } else if (strncmp(lexer->input + lexer->position, ".", 1) == 0) {
-                add_token(lexer, TOKEN_DOT, ".", 1);
-                SHIFT(lexer, 1);
-            } else goto identifier;
+        skip_whitespace(lexer);
+        skip_comments(lexer);
+        if (!AVAILABLE(lexer, 1)) {
+            add_token(lexer, TOKEN_EOF, "EOF", 3);
+            lexer->finished = true;
             break;
+        }
+        if (!lexer->stream_eof) lexer_fill(lexer, LEXER_LOOKAHEAD);
+
+        size_t start = lexer->position;
+        size_t first = lexer->tokens.count;
+        uint64_t bytes[LEX_BYTES_COUNT];
+        if (STATS(lexer)) memcpy(bytes, lexer->stats->bytes, sizeof(bytes));
+        for (;;) {
+            lexer->speculating = !lexer->stream_eof;
+            bool running = lex_token(lexer);
+            lexer->speculating = false;
+            lexer->finished = !running;
+
+            // A token ending near the edge of the window may be cut short:
+            // roll it back, pull more input and lex it again
+            if (lexer->stream_eof || lexer->position + LEXER_LOOKAHEAD <= lexer->length) break;
+            drop_tokens(lexer, first);
+            if (STATS(lexer)) memcpy(lexer->stats->bytes, bytes, sizeof(bytes));
+            size_t have = lexer->length - start;
+            lexer->position = start;
+            lexer_fill(lexer, have + 1);
+            start = lexer->position;
+        }
+
+        // The tokens are final now: intern the identifiers lexed
+        // speculatively, keeping symbol ids in order of appearance
+        for (size_t i = first; i < lexer->tokens.count; i++) {
+            if (lexer->tokens.kinds[i] == TOKEN_ID && lexer->tokens.values[i] == SYMBOL_NONE) {
+                size_t length;
+                const char* name = token_value(&lexer->tokens, i, &length);
+                lexer->tokens.values[i] = intern_symbol(lexer->tokens.symbol_table, name, length);
+            }
+        }
+    }
+
+    if (STATS(lexer)) {
+        lexer->stats->ticks[LEX_TIME_TOTAL] += stats_clock() - clock;
+        lexer->stats->calls[LEX_TIME_TOTAL]++;
+        count_tokens(lexer, before);
+    }
+    return lexer->tokens.count > before;
+}
+
+// Streaming tokenization: input is pulled through the lexer's window and
+// every token is handed to `sink` as soon as it is complete, so memory
+// stays bounded by the window size and the longest single token.
+void tokenize_stream(Lexer* lexer, TokenSink sink, void* context) {
+    while (lex_more(lexer)) sink_tokens(lexer, sink, context);
+}
+
+// How many handed-out tokens lexer_next lets pile up behind a lookahead
+// window before it compacts the buffer
+#define PULL_COMPACT_THRESHOLD 256
+
+// Pull the next token, lexing it on demand. Its value stays valid until
+// the next lexer_next or lexer_peek: in stream mode either may compact or
+// grow the window under it, so copy the value before looking ahead.
+// Returns false after the last token.
+bool lexer_next(Lexer* lexer, Token* token) {
+    TokenBuffer* tokens = &lexer->tokens;
+    if (lexer->next_token == tokens->count) {
+        drop_tokens(lexer, 0);
+        lexer->next_token = 0;
+    } else if (lexer->next_token >= PULL_COMPACT_THRESHOLD) {
+        discard_tokens(lexer, lexer->next_token);
+        lexer->next_token = 0;
+    }
+    if (lexer->next_token == tokens->count && !lex_more(lexer)) return false;
+
+    *token = hand_out_token(lexer, lexer->next_token++);
+    return true;
+}
 
-        case 'r':
-            if (strncmp(lexer->input + lexer->position, "return", 6) == 0) {
-                add_token(lexer, TOKEN_RETURN, "return", 6);
-                SHIFT(lexer, 6);
-            } else if (strncmp(lexer->input + lexer->position, "ralloc", 6) == 0) {
-                add_token(lexer, TOKEN_RALLOC, "ralloc", 6);
-                SHIFT(lexer, 6);
+// Type of the token `distance` places after the one lexer_next returns
+// next (0 is that token itself); TOKEN_EOF past the end of input. May lex
+// more input, which invalidates the value of the last token handed out
+TokenType lexer_peek(Lexer* lexer, size_t distance) {
+    while (lexer->tokens.count - lexer->next_token <= distance) {
+        if (!lex_more(lexer)) return TOKEN_EOF;
+    }
+    return (TokenType)lexer->tokens.kinds[lexer->next_token + distance];
+}
 
-            } else goto identifier;
-            break;
+// Little-endian field access for token files, independent of the host
+static void store_le32(uint8_t* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out[i] = (uint8_t)(value >> (8 * i));
+}
 
-        case '%':
-            if (strncmp(lexer->input + lexer->position, "\%inclib", 7) == 0) {
-                add_token(lexer, TOKEN_PREPROC_INCLIB, "inclib", 7);
-                SHIFT(lexer, 7);
-             } else if (strncmp(lexer->input + lexer->position, "\%incfile", 8) == 0) {
-                add_token(lexer, TOKEN_PREPROC_INCFILE, "incfile", 8);
-                SHIFT(lexer, 8);
-            } else if (strncmp(lexer->input + lexer->position, "\%define", 7) == 0) {
-                add_token(lexer, TOKEN_PREPROC_DEFINE, "define", 7);
-                SHIFT(lexer, 7);
-            } else if (strncmp(lexer->input + lexer->position, "\%assign", 7) == 0) {
-                add_token(lexer, TOKEN_PREPROC_ASSIGN, "assign", 7);
-                SHIFT(lexer, 7);
-            } else if (strncmp(lexer->input + lexer->position, "\%undef", 6) == 0) {
-                add_token(lexer, TOKEN_PREPROC_UNDEF, "undef", 6);
-                SHIFT(lexer, 6);
-            } else if (strncmp(lexer->input + lexer->position, "\%ifdef", 6) == 0) {
-                add_token(lexer, TOKEN_PREPROC_IFDEF, "ifdef", 6);
-                SHIFT(lexer, 6);
-            } else if (strncmp(lexer->input + lexer->position, "\%ifndef", 6) == 0) {
-                add_token(lexer, TOKEN_PREPROC_IFNDEF, "ifndef", 6);
-                SHIFT(lexer, 6);
-            } else if (strncmp(lexer->input + lexer->position, "\%endif", 6) == 0) {
-                add_token(lexer, TOKEN_PREPROC_ENDIF, "endif", 6);
-                SHIFT(lexer, 6);
-            } else if (strncmp(lexer->input + lexer->position, "\%line", 5) == 0) {
-                add_token(lexer, TOKEN_PREPROC_LINE, "line", 5);
-                SHIFT(lexer, 5);
-            } else if (strncmp(lexer->input + lexer->position, "\%error", 6) == 0) {
-                add_token(lexer, TOKEN_PREPROC_ERROR, "error", 6);
-                SHIFT(lexer, 6);
-            } else if (strncmp(lexer->input + lexer->position, "\%pragma", 7) == 0) {
-                add_token(lexer, TOKEN_PREPROC_PRAGMA, "pragma", 7);
-                SHIFT(lexer, 7);
-            } else if (strncmp(lexer->input + lexer->position, "\%macro", 6) == 0) {
-                add_token(lexer, TOKEN_PREPROC_MACRO, "macro", 6);
-                SHIFT(lexer, 6);
-            } else {
-                add_token(lexer, TOKEN_PERCENT, "%", 1);
-                SHIFT(lexer, 1);
-            }
-            break;
+static void store_le64(uint8_t* out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out[i] = (uint8_t)(value >> (8 * i));
+}
 
-        case '{':
-            add_token(lexer, TOKEN_LCURLY, "{", 1);
-            SHIFT(lexer, 1);
-            break;
+static uint32_t load_le32(const uint8_t* in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) value |= (uint32_t)in[i] << (8 * i);
+    return value;
+}
 
-        case '}':
-            add_token(lexer, TOKEN_RCURLY, "}", 1);
-            SHIFT(lexer, 1);
-            break;
+static uint64_t load_le64(const uint8_t* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) value |= (uint64_t)in[i] << (8 * i);
+    return value;
+}
 
-        case '[':
-            add_token(lexer, TOKEN_LBRACKET, "[", 1);
-            SHIFT(lexer, 1);
-            break;
+// Checksum of a token file body, `length` a multiple of 8. Mixes whole
+// words, so verifying a mapped file runs at memory speed.
+static uint64_t token_file_checksum(uint64_t hash, const uint8_t* data, size_t length) {
+    for (size_t i = 0; i < length; i += 8) {
+        hash ^= load_le64(data + i);
+        hash *= 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
 
-        case ']':
-            add_token(lexer, TOKEN_RBRACKET, "]", 1);
-            SHIFT(lexer, 1);
-            break;
+#define TOKEN_FILE_CHECKSUM_SEED 0x9E3779B97F4A7C15ull
+#define ALIGN8(size) (((size) + 7) & ~(size_t)7)
 
-        case '(':
-            add_token(lexer, TOKEN_LPAREN, "(", 1);
-            SHIFT(lexer, 1);
-            break;
+static bool write_all(FILE* file, const void* data, size_t size) {
+    return fwrite(data, 1, size, file) == size;
+}
 
-        case ')':
-            add_token(lexer, TOKEN_RPAREN, ")", 1);
-            SHIFT(lexer, 1);
-            break;
+// Write the tokens of a lexer to `filename` in token file version 2.
+// Identifiers with the same symbol share one string in the pool.
+bool write_tokens_to_file(const char* filename, const TokenBuffer* tokens) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        perror("Failed to open token file");
+        return false;
+    }
 
-        case '=':
-            if (NEXT(lexer, 1) == '=') {
-                add_token(lexer, TOKEN_DOUBLE_EQ, "==", 2);
-                SHIFT(lexer, 2);
-            } else {
-                add_token(lexer, TOKEN_EQUAL, "=", 1);
-                SHIFT(lexer, 1);
+    // Offsets of the interned names already placed in the pool
+    size_t symbol_count = tokens->symbol_table ? tokens->symbol_table->count : 0;
+    uint64_t* symbol_offsets = malloc((symbol_count ? symbol_count : 1) * sizeof(uint64_t));
+    char* pool = NULL;
+    size_t pool_length = 0;
+    size_t pool_capacity = 0;
+    bool ok = symbol_offsets != NULL;
+    for (size_t i = 0; i < symbol_count; i++) symbol_offsets[i] = UINT64_MAX;
+
+    uint8_t header[TOKEN_FILE_HEADER_SIZE] = { 0 };
+    ok = ok && write_all(file, header, sizeof(header));
+
+    // Lines are found by walking the line index along with the tokens,
+    // which come in source order
+    LineIndex* lines = tokens->line_index;
+    if (tokens->count > 0) build_line_index(tokens);
+    size_t line = 0;
+
+    uint64_t checksum = TOKEN_FILE_CHECKSUM_SEED;
+    for (size_t i = 0; ok && i < tokens->count; i++) {
+        Token token;
+        token.type = (TokenType)tokens->kinds[i];
+        token.value = token_value(tokens, i, &token.length);
+        token.symbol = token.type == TOKEN_ID ? tokens->values[i] : SYMBOL_NONE;
+        token.number = token_number(tokens, i);
+
+        uint32_t offset = tokens->offsets[i];
+        if (line > 0 && lines->starts[line - 1] > offset) line = 0;
+        while (line < lines->count && lines->starts[line] <= offset) line++;
+        token.line = (int64_t)line + 1;
+        token.column = (int64_t)(offset - (line ? lines->starts[line - 1] : 0)) + 1;
+
+        uint64_t value_offset = token.symbol < symbol_count ? symbol_offsets[token.symbol] : UINT64_MAX;
+        if (value_offset == UINT64_MAX) {
+            if (pool_length + token.length + 1 > pool_capacity) {
+                pool_capacity = (pool_length + token.length + 1) * 2;
+                char* grown = realloc(pool, pool_capacity);
+                if (!grown) {
+                    ok = false;
+                    break;
+                }
+                pool = grown;
             }
-            break;
+            value_offset = pool_length;
+            memcpy(pool + pool_length, token.value, token.length);
+            pool_length += token.length;
+            pool[pool_length++] = '\0';
+            if (token.symbol < symbol_count) symbol_offsets[token.symbol] = value_offset;
+        }
 
-        case ',':
-            add_token(lexer, TOKEN_COMMA, ",", 1);
-            SHIFT(lexer, 1);
-            break;
+        uint8_t record[TOKEN_RECORD_SIZE];
+        store_le32(record, (uint32_t)token.type);
+        store_le32(record + 4, token.symbol);
+        store_le32(record + 8, (uint32_t)token.length);
+        store_le32(record + 12, (uint32_t)token.number.kind);
+        store_le64(record + 16, value_offset);
+        store_le64(record + 24, (uint64_t)token.line);
+        store_le64(record + 32, (uint64_t)token.column);
+        store_le64(record + 40, token.number.as.uinteger);
+        checksum = token_file_checksum(checksum, record, sizeof(record));
+        ok = write_all(file, record, sizeof(record));
+    }
 
-        case ';':
-            add_token(lexer, TOKEN_SEMICOLON, ";", 1);
-            SHIFT(lexer, 1);
-            break;
+    // String pool, zero-padded to the next 8-byte boundary
+    size_t padded_length = ALIGN8(pool_length);
+    if (ok && padded_length > pool_capacity) {
+        char* grown = realloc(pool, padded_length);
+        if (grown) pool = grown;
+        else ok = false;
+    }
+    if (ok) {
+        memset(pool + pool_length, 0, padded_length - pool_length);
+        checksum = token_file_checksum(checksum, (const uint8_t*)pool, padded_length);
+        ok = write_all(file, pool, padded_length);
+    }
 
-        case '\'':
-            parse_char(lexer);
-            break;
+    if (ok) {
+        memcpy(header, "PAXT", 4);
+        header[4] = TOKEN_FILE_VERSION;
+        header[6] = TOKEN_RECORD_SIZE;
+        store_le64(header + 8, tokens->count);
+        store_le64(header + 16, TOKEN_FILE_HEADER_SIZE);
+        store_le64(header + 24, TOKEN_FILE_HEADER_SIZE + (uint64_t)tokens->count * TOKEN_RECORD_SIZE);
+        store_le64(header + 32, pool_length);
+        store_le64(header + 40, checksum);
+        ok = fseek(file, 0, SEEK_SET) == 0 && write_all(file, header, sizeof(header));
+    }
+    if (fclose(file) != 0) ok = false;
+    if (!ok) fprintf(stderr, "Failed to write token file %s\n", filename);
 
-        case '"':
-            parse_string(lexer);
-            break;
+    free(symbol_offsets);
+    free(pool);
+    return ok;
+}
 
-        case '_':
-            if (NEXT(lexer, 1) == '_') {
-                    add_token(lexer, TOKEN_DOUBLE_UNDERSCORE, "__", 2);
-                    SHIFT(lexer, 2);
-                } else {
-                    int start = lexer->position;
-                    SHIFT(lexer, 1);
-                    if (isalnum(NEXT(lexer, 0)) || 
-                        NEXT(lexer, 0) == '_') {
-                        while (lexer->position < lexer->length &&
-                              (isalnum(NEXT(lexer, 0)) ||
-                               NEXT(lexer, 0) == '_')) {
-                            SHIFT(lexer, 1);
-                        }
-                        int length = lexer->position - start;
-                        char* word = strndup(lexer->input + start, length);
-                        if (!word) {
-                            add_error(lexer, "Memory error");
-                            return;
-                        }
-                        add_token(lexer, TOKEN_ID, word, length);
-                        free(word);
-                    } else add_token(lexer, TOKEN_UNDERSCORE, "_", 1);
-                }
-                break;
+// Check the header of a version 2 token file held in memory and point
+// the view at its sections. With `verify` the checksum is checked too.
+static bool open_token_file(TokenFile* file, bool verify) {
+    const uint8_t* data = file->data;
+    size_t size = file->data_length;
+    if (size < TOKEN_FILE_HEADER_SIZE || memcmp(data, "PAXT", 4) != 0) {
+        fprintf(stderr, "Invalid file format\n");
+        return false;
+    }
+    if (load_le32(data + 4) != (TOKEN_FILE_VERSION | (uint32_t)TOKEN_RECORD_SIZE << 16)) {
+        fprintf(stderr, "Unsupported token file version\n");
+        return false;
+    }
 
-        case 'N':
-            if (strncmp(lexer->input + lexer->position, "NONE", 4) == 0) {
-                if (lexer->position + 4 < lexer->length) {
-                    if (isalnum(NEXT(lexer, 4)) || 
-                        NEXT(lexer, 4) == '_') {
-                        goto identifier;
-                    }
-                }
-                add_token(lexer, TOKEN_NONE, "NONE", 4);
-                SHIFT(lexer, 4);
-            } else goto identifier;
-            break;
+    uint64_t count = load_le64(data + 8);
+    uint64_t records_offset = load_le64(data + 16);
+    uint64_t strings_offset = load_le64(data + 24);
+    uint64_t strings_length = load_le64(data + 32);
+    if (records_offset != TOKEN_FILE_HEADER_SIZE ||
+        count > (size - TOKEN_FILE_HEADER_SIZE) / TOKEN_RECORD_SIZE ||
+        strings_offset != records_offset + count * TOKEN_RECORD_SIZE ||
+        strings_length > size - strings_offset ||
+        strings_offset + ALIGN8(strings_length) != size) {
+        fprintf(stderr, "Corrupted token file\n");
+        return false;
+    }
+    if (verify && token_file_checksum(TOKEN_FILE_CHECKSUM_SEED, data + records_offset,
+                                      size - records_offset) != load_le64(data + 40)) {
+        fprintf(stderr, "Token file checksum mismatch\n");
+        return false;
+    }
 
-        default:
-            if (NEXT(lexer, 0) == '#' || 
-                (lexer->position < lexer->length - 1 && 
-                NEXT(lexer, 0) == '<' && 
-                NEXT(lexer, 1) == '/')) {
-                skip_comments(lexer);
-                break;
-            }
+    file->records = data + records_offset;
+    file->strings = (const char*)data + strings_offset;
+    file->count = count;
+    file->strings_length = strings_length;
+    return true;
+}
 
-            if (isalpha(NEXT(lexer, 0)) || 
-                NEXT(lexer, 0) == '_') {
-            identifier:
-                int start = lexer->position;
-                while (lexer->position < lexer->length &&
-                      (isalnum(NEXT(lexer, 0)) ||
-                       NEXT(lexer, 0) == '_')) {
-                    SHIFT(lexer, 1);
-                }
-                int length = lexer->position - start;
-                char* word = strndup(lexer->input + start, length);
-                if (!word) {
-                    add_error(lexer, "Memory error");
-                    return;
-                }
+// Open a version 2 token file as a read-only view: the file is mapped
+// (or read in one piece where mmap is unavailable) and tokens are decoded
+// from it on access, so loading does not depend on the token count
+// unless `verify` asks for the checksum to be checked.
+bool map_token_file(const char* filename, TokenFile* file, bool verify) {
+    memset(file, 0, sizeof(*file));
+#ifdef PAXSI_HAVE_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open token file");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            close(fd);
+            file->data = data;
+            file->data_length = st.st_size;
+            file->mapped = true;
+            if (open_token_file(file, verify)) return true;
+            unmap_token_file(file);
+            return false;
+        }
+    }
+    close(fd);
+#endif
 
-                if (is_valid_type(word)) add_token(lexer, TOKEN_TYPE, word, length);
-                else if (is_valid_modifier(word)) add_token(lexer, TOKEN_MODIFIER, word, length);
-                else add_token(lexer, TOKEN_ID, word, length);
-                free(word);
-            } else if (isdigit(NEXT(lexer, 0)) || 
-                        NEXT(lexer, 0) == '-' || 
-                        NEXT(lexer, 0) == '+') 
-                parse_number(lexer);
-            else {
-                add_error(lexer, "Unexpected character: '%c'", NEXT(lexer, 0));
-                SHIFT(lexer, 1);
-            }
-            break;
+    FILE* stream = fopen(filename, "rb");
+    if (!stream) {
+        perror("Failed to open token file");
+        return false;
+    }
+    size_t capacity = 4096;
+    char* buffer = malloc(capacity);
+    size_t bytes_read;
+    while (buffer && (bytes_read = fread(buffer + file->data_length, 1, capacity - file->data_length, stream)) > 0) {
+        file->data_length += bytes_read;
+        if (file->data_length == capacity) {
+            capacity *= 2;
+            char* grown = realloc(buffer, capacity);
+            if (!grown) free(buffer);
+            buffer = grown;
         }
     }
+    bool ok = buffer != NULL && !ferror(stream);
+    fclose(stream);
+    file->data = buffer;
+    if (ok && open_token_file(file, verify)) return true;
+    if (!ok) perror("Failed to read token file");
+    unmap_token_file(file);
+    return false;
+}
+
+// Token `index` of a token file view; its value points into the view.
+// A value outside the string pool (a damaged file read without verify)
+// comes back empty.
+Token token_file_at(const TokenFile* file, size_t index) {
+    const uint8_t* record = file->records + index * TOKEN_RECORD_SIZE;
+    Token token;
+    uint32_t type = load_le32(record);
+    token.type = type <= TOKEN_ERROR ? (TokenType)type : TOKEN_ERROR;
+    token.symbol = load_le32(record + 4);
+    token.length = load_le32(record + 8);
+    uint32_t kind = load_le32(record + 12);
+    token.number.kind = kind <= NUMBER_REAL ? (NumberKind)kind : NUMBER_NONE;
+    token.number.as.uinteger = load_le64(record + 40);
+    uint64_t offset = load_le64(record + 16);
+    if (offset > file->strings_length || token.length > file->strings_length - offset) {
+        offset = 0;
+        token.length = 0;
+    }
+    token.value = file->strings + offset;
+    token.line = (int64_t)load_le64(record + 24);
+    token.column = (int64_t)load_le64(record + 32);
+    token.owned = false;
+    return token;
+}
+
+// Release a view opened by map_token_file
+void unmap_token_file(TokenFile* file) {
+#ifdef PAXSI_HAVE_MMAP
+    if (file->mapped) munmap(file->data, file->data_length);
+    else free(file->data);
+#else
+    free(file->data);
+#endif
+    memset(file, 0, sizeof(*file));
+}
 
-    // Add EOF token after processing all input
-    add_token(lexer, TOKEN_EOF, "EOF", 3);
+// Read the tokens of a version 1 file (after its header): fields are in
+// host byte order and every value is allocated separately
+static Token* read_tokens_v1(FILE* file, const TokenFileHeader* header) {
+    Token* tokens = malloc((header->token_count ? header->token_count : 1) * sizeof(Token));
+    if (!tokens) return NULL;
+
+    for (uint32_t i = 0; i < header->token_count; i++) {
+        uint32_t type, value_len, line, column, length;
+        char* value = NULL;
+        bool ok = fread(&type, sizeof(uint32_t), 1, file) == 1 &&
+                  fread(&value_len, sizeof(uint32_t), 1, file) == 1 &&
+                  (value = malloc((size_t)value_len + 1)) != NULL &&
+                  fread(value, 1, value_len, file) == value_len &&
+                  fread(&line, sizeof(uint32_t), 1, file) == 1 &&
+                  fread(&column, sizeof(uint32_t), 1, file) == 1 &&
+                  fread(&length, sizeof(uint32_t), 1, file) == 1;
+        if (!ok) {
+            fprintf(stderr, "Truncated token file\n");
+            free(value);
+            free_tokens(tokens, i);
+            return NULL;
+        }
+        value[value_len] = '\0';
+        tokens[i].value = value;
+        tokens[i].owned = true;
+        tokens[i].type = type <= TOKEN_ERROR ? (TokenType)type : TOKEN_ERROR;
+        tokens[i].symbol = SYMBOL_NONE;
+        tokens[i].number = (NumberValue){ .kind = NUMBER_NONE };
+        tokens[i].line = line;
+        tokens[i].column = column;
+        tokens[i].length = length;
+    }
+    return tokens;
 }
 
-// Read tokens from binary token file
-Token* read_tokens_from_file(const char* filename, int* token_count) {
+// Read tokens from binary token file into an array of owned tokens.
+// Both versions are accepted; map_token_file is the cheaper way to read
+// version 2.
+Token* read_tokens_from_file(const char* filename, size_t* token_count) {
     FILE* file = fopen(filename, "rb");
     if (!file) {
         perror("Failed to open token file");
@@ -1045,6 +2776,7 @@ Token* read_tokens_from_file(const char* filename, int* token_count) {
     // Read file header
     TokenFileHeader header;
     if (fread(&header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "Invalid file format\n");
         fclose(file);
         return NULL;
     }
@@ -1056,92 +2788,866 @@ Token* read_tokens_from_file(const char* filename, int* token_count) {
         return NULL;
     }
 
-    // Allocate memory for tokens
-    Token* tokens = malloc(header.token_count * sizeof(Token));
-    if (!tokens) {
+    if (header.version == 1) {
+        Token* tokens = read_tokens_v1(file, &header);
         fclose(file);
-        return NULL;
+        if (tokens) *token_count = header.token_count;
+        return tokens;
     }
+    fclose(file);
 
-    // Read each token from file
-    for (int i = 0; i < header.token_count; i++) {
-        uint32_t type, value_len, line, column, length;
-        
-        fread(&type, sizeof(uint32_t), 1, file);
-        fread(&value_len, sizeof(uint32_t), 1, file);
-        
-        tokens[i].value = malloc(value_len + 1);
-        fread(tokens[i].value, 1, value_len, file);
-        tokens[i].value[value_len] = '\0';
-        
-        fread(&line, sizeof(uint32_t), 1, file);
-        fread(&column, sizeof(uint32_t), 1, file);
-        fread(&length, sizeof(uint32_t), 1, file);
-        
-        tokens[i].type = (TokenType)type;
-        tokens[i].line = line;
-        tokens[i].column = column;
-        tokens[i].length = length;
+    TokenFile view;
+    if (!map_token_file(filename, &view, true)) return NULL;
+    Token* tokens = malloc((view.count ? view.count : 1) * sizeof(Token));
+    for (size_t i = 0; tokens && i < view.count; i++) {
+        tokens[i] = token_file_at(&view, i);
+        // Decoded literals may hold NUL bytes: copy all `length` of them
+        char* value = malloc(tokens[i].length + 1);
+        if (!value) {
+            free_tokens(tokens, i);
+            tokens = NULL;
+            break;
+        }
+        memcpy(value, tokens[i].value, tokens[i].length);
+        value[tokens[i].length] = '\0';
+        tokens[i].value = value;
+        tokens[i].owned = true;
     }
-    
-    fclose(file);
-    *token_count = header.token_count;
+    if (tokens) *token_count = view.count;
+    unmap_token_file(&view);
     return tokens;
 }
 
 // Free token array
-void free_tokens(Token* tokens, int token_count) {
-    for (int i = 0; i < token_count; i++) {
-        free(tokens[i].value);
+void free_tokens(Token* tokens, size_t token_count) {
+    for (size_t i = 0; i < token_count; i++) {
+        if (tokens[i].owned) free((char*)tokens[i].value);
     }
     free(tokens);
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <source_file>\n", argv[0]);
-        return 1;
+#ifndef PAXSI_NO_MAIN
+// Source file contents, either mapped read-only or copied to the heap;
+// both are followed by LEXER_PADDING zero bytes
+typedef struct {
+    const char* data;
+    size_t length;
+    size_t mapped_length;
+    bool mapped;
+} SourceBuffer;
+
+// perror() to a chosen stream: the batch driver collects every file's
+// diagnostics separately
+static void report_error(FILE* err, const char* message) {
+    fprintf(err, "%s: %s\n", message, strerror(errno));
+}
+
+// Read the whole file into a NUL-terminated heap buffer
+static bool read_source(FILE* file, SourceBuffer* source, FILE* err) {
+    size_t capacity = 4096;
+    size_t length = 0;
+    char* buffer = malloc(capacity);
+    if (buffer == NULL) {
+        report_error(err, "Insufficient memory error");
+        return false;
+    }
+
+    size_t bytes_read;
+    while ((bytes_read = fread(buffer + length, 1, capacity - length - 1, file)) > 0) {
+        length += bytes_read;
+        if (length + 1 == capacity) {
+            capacity *= 2;
+            char* grown = realloc(buffer, capacity);
+            if (grown == NULL) {
+                report_error(err, "Insufficient memory error");
+                free(buffer);
+                return false;
+            }
+            buffer = grown;
+        }
+    }
+    if (ferror(file)) {
+        report_error(err, "Failed to read file");
+        free(buffer);
+        return false;
+    }
+
+    buffer[length] = '\0';
+    source->data = buffer;
+    source->length = length;
+    source->mapped = false;
+    return true;
+}
+
+// Load a source file: map regular files read-only, fall back to reading
+static bool load_source(const char* path, bool use_mmap, SourceBuffer* source, FILE* err) {
+#ifdef PAXSI_HAVE_MMAP
+    if (use_mmap) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            report_error(err, "Couldn't open the file");
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            // Reserve at least one zero page-tail past the end of the file
+            // for the sentinel, then map the file over the reservation
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t reserved = ((size_t)st.st_size + LEXER_PADDING + page - 1) / page * page;
+            void* area = mmap(NULL, reserved, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            void* data = area == MAP_FAILED ? MAP_FAILED :
+                mmap(area, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, st.st_size, MADV_SEQUENTIAL);
+                close(fd);
+                source->data = data;
+                source->length = st.st_size;
+                source->mapped_length = reserved;
+                source->mapped = true;
+                return true;
+            }
+            if (area != MAP_FAILED) munmap(area, reserved);
+        }
+        close(fd);
     }
+#else
+    (void)use_mmap;
+#endif
 
-    FILE* file = fopen(argv[1], "r");
+    FILE* file = fopen(path, "rb");
     if (file == NULL) {
-        perror("Couldn't open the file");
-        return 1;
+        report_error(err, "Couldn't open the file");
+        return false;
+    }
+    bool ok = read_source(file, source, err);
+    fclose(file);
+    return ok;
+}
+
+// Release a buffer obtained from load_source
+static void release_source(SourceBuffer* source) {
+#ifdef PAXSI_HAVE_MMAP
+    if (source->mapped) {
+        munmap((void*)source->data, source->mapped_length);
+        return;
     }
+#endif
+    free((char*)source->data);
+}
 
-    // Determine file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    rewind(file);
+// Stream reader over a stdio file
+static int64_t read_file_stream(void* context, char* buffer, size_t size) {
+    FILE* file = context;
+    size_t bytes_read = fread(buffer, 1, size, file);
+    if (bytes_read == 0 && ferror(file)) return -1;
+    return bytes_read;
+}
 
-    // Allocate buffer and read file
-    char* buffer_file = (char*)malloc(file_size + 1);
-    if (buffer_file == NULL) {
-        perror("Insufficient memory error");
-        fclose(file);
+// Token sink for --stream: print one token per line to the FILE* context
+static void print_token(void* context, const Token* token) {
+    fprintf(context, "line %" PRId64 ": %s:%.*s\n", token->line, token_names[token->type],
+            (int)token->length, token->value);
+}
+
+// Tokenize a file of any size through a bounded window and print tokens.
+// The number of input bytes lexed goes to *consumed.
+static int stream_file(const char* path, FILE* out, FILE* err, LexerStats* stats, uint64_t* consumed) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        report_error(err, "Couldn't open the file");
         return 1;
     }
 
-    size_t bytes_read = fread(buffer_file, 1, file_size, file);
-    if (bytes_read != (size_t)file_size) {
-        perror("Failed to read file");
-        free(buffer_file);
+    Lexer* lexer = init_stream_lexer(read_file_stream, file, LEXER_WINDOW_SIZE);
+    if (lexer == NULL) {
+        report_error(err, "Insufficient memory error");
         fclose(file);
         return 1;
     }
-    buffer_file[file_size] = '\0';
+    lexer->stats = stats;
+    tokenize_stream(lexer, print_token, out);
+    *consumed = lexer->base + lexer->length;
+
+    int status = ferror(file) ? 1 : 0;
+    if (status) report_error(err, "Failed to read file");
+    free_lexer(lexer);
+    fclose(file);
+    return status;
+}
+
+static double now_nanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static const char* lex_bytes_names[LEX_BYTES_COUNT] = {
+    "whitespace", "comments", "strings", "numbers", "identifiers"
+};
+
+static const char* lex_time_names[LEX_TIME_COUNT] = {
+    "total", "numbers", "strings", "comments"
+};
+
+// Print --stats to stderr. `input_bytes` is the size of the input lexed;
+// bytes not in a counted class are reported as "other". Ticks are turned
+// into nanoseconds with `ns_per_tick`, measured over the whole run.
+static void print_lexer_stats(const LexerStats* stats, uint64_t input_bytes, double ns_per_tick, bool json) {
+    uint64_t token_count = 0, counted_bytes = 0;
+    for (int type = 0; type < TOKEN_TYPE_COUNT; type++) token_count += stats->tokens[type];
+    for (int kind = 0; kind < LEX_BYTES_COUNT; kind++) counted_bytes += stats->bytes[kind];
+    uint64_t other_bytes = input_bytes > counted_bytes ? input_bytes - counted_bytes : 0;
+
+    // Token types by count, most frequent first
+    int order[TOKEN_TYPE_COUNT];
+    for (int type = 0; type < TOKEN_TYPE_COUNT; type++) {
+        int i = type;
+        for (; i > 0 && stats->tokens[order[i - 1]] < stats->tokens[type]; i--) order[i] = order[i - 1];
+        order[i] = type;
+    }
+
+    if (json) {
+        fprintf(stderr, "{\"input_bytes\": %" PRIu64 ", \"tokens\": %" PRIu64
+                ", \"token_reallocations\": %" PRIu64 ", \"bytes\": {",
+                input_bytes, token_count, stats->token_reallocations);
+        for (int kind = 0; kind < LEX_BYTES_COUNT; kind++) {
+            fprintf(stderr, "\"%s\": %" PRIu64 ", ", lex_bytes_names[kind], stats->bytes[kind]);
+        }
+        fprintf(stderr, "\"other\": %" PRIu64 "}, \"time_ns\": {", other_bytes);
+        for (int timer = 0; timer < LEX_TIME_COUNT; timer++) {
+            fprintf(stderr, "%s\"%s\": %.0f", timer ? ", " : "", lex_time_names[timer],
+                    stats->ticks[timer] * ns_per_tick);
+        }
+        fprintf(stderr, "}, \"calls\": {");
+        for (int timer = 0; timer < LEX_TIME_COUNT; timer++) {
+            fprintf(stderr, "%s\"%s\": %" PRIu64, timer ? ", " : "", lex_time_names[timer], stats->calls[timer]);
+        }
+        fprintf(stderr, "}, \"token_types\": {");
+        for (int i = 0; i < TOKEN_TYPE_COUNT && stats->tokens[order[i]]; i++) {
+            fprintf(stderr, "%s\"%s\": %" PRIu64, i ? ", " : "", token_names[order[i]], stats->tokens[order[i]]);
+        }
+        fprintf(stderr, "}}\n");
+        return;
+    }
+
+    double bytes_total = input_bytes ? (double)input_bytes : 1;
+    double lexing_time = stats->ticks[LEX_TIME_TOTAL] ? (double)stats->ticks[LEX_TIME_TOTAL] : 1;
+    fprintf(stderr, "lexer: %" PRIu64 " bytes, %" PRIu64 " tokens, %" PRIu64 " token array reallocations\n",
+            input_bytes, token_count, stats->token_reallocations);
+    fprintf(stderr, "bytes:\n");
+    for (int kind = 0; kind < LEX_BYTES_COUNT; kind++) {
+        fprintf(stderr, "  %-12s %12" PRIu64 " %6.1f%%\n", lex_bytes_names[kind], stats->bytes[kind],
+                100.0 * stats->bytes[kind] / bytes_total);
+    }
+    fprintf(stderr, "  %-12s %12" PRIu64 " %6.1f%%\n", "other", other_bytes, 100.0 * other_bytes / bytes_total);
+    fprintf(stderr, "time:\n");
+    for (int timer = 0; timer < LEX_TIME_COUNT; timer++) {
+        fprintf(stderr, "  %-12s %12.3f ms %6.1f%% %12" PRIu64 " calls\n", lex_time_names[timer],
+                stats->ticks[timer] * ns_per_tick / 1e6, 100.0 * stats->ticks[timer] / lexing_time,
+                stats->calls[timer]);
+    }
+    fprintf(stderr, "tokens:\n");
+    for (int i = 0; i < TOKEN_TYPE_COUNT && stats->tokens[order[i]]; i++) {
+        fprintf(stderr, "  %-20s %12" PRIu64 " %6.1f%%\n", token_names[order[i]], stats->tokens[order[i]],
+                100.0 * stats->tokens[order[i]] / (token_count ? token_count : 1));
+    }
+}
+
+// Parse cache: a directory of entries named after a hash of the source
+// and the frontend version, each holding the serialized AST. Entries are
+// written to a temporary file and renamed into place, so concurrent runs
+// only ever see complete entries; the least recently used ones are
+// removed once the directory grows past its size cap.
+typedef struct {
+    const char* dir;
+    uint64_t capacity;
+} ParseCache;
+
+// Cache entry header, little-endian:
+//   0   "PAXC", u16 entry version, u16 zero
+//   8   u32 PAXSI_FRONTEND_VERSION, u32 zero
+//   16  u64 source hash, u64 source length
+//   32  u64 payload length, u64 checksum of the zero-padded payload
+// then the payload (serialize_ast: the flat AST image, printed in place on
+// a hit) padded to 8 bytes
+#define CACHE_ENTRY_VERSION 2
+#define CACHE_HEADER_SIZE 64
+#define CACHE_DEFAULT_CAPACITY (256ull << 20)
+
+// 64-bit hash of the source for cache keys: four independent lanes over
+// 32-byte blocks, the tail byte by byte, then a final avalanche
+static uint64_t hash_source(const char* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t lanes[4] = { 1, 2, 3, 4 };
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            lanes[lane] = (lanes[lane] ^ load_le64(bytes + i + 8 * lane)) * 0xFF51AFD7ED558CCDull;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    uint64_t hash = (uint64_t)length * 0x9E3779B97F4A7C15ull;
+    for (int lane = 0; lane < 4; lane++) {
+        hash = (hash ^ lanes[lane]) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 32;
+    }
+    for (; i < length; i++) hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static void cache_entry_path(const ParseCache* cache, uint64_t key, char* path, size_t size) {
+    snprintf(path, size, "%s/%016" PRIx64 "-%u.pxc", cache->dir, key, PAXSI_FRONTEND_VERSION);
+}
+
+// Look up the AST stored for `key`; a miss or a damaged entry returns
+// false. On a hit the entry stays loaded in *entry (mapped where
+// possible), *flat views the flat AST inside it in place, and the caller
+// releases the entry once done with the view. A hit refreshes the entry's
+// modification time, which eviction goes by.
+static bool cache_load(const ParseCache* cache, uint64_t key, size_t source_length,
+                       SourceBuffer* entry, FlatAST* flat, FILE* err) {
+    char path[4096];
+    cache_entry_path(cache, key, path, sizeof(path));
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
     fclose(file);
+    if (!load_source(path, true, entry, err)) return false;
+
+    const uint8_t* data = (const uint8_t*)entry->data;
+    bool hit = false;
+    if (entry->length >= CACHE_HEADER_SIZE && memcmp(data, "PAXC", 4) == 0 &&
+        load_le32(data + 4) == CACHE_ENTRY_VERSION &&
+        load_le32(data + 8) == PAXSI_FRONTEND_VERSION &&
+        load_le64(data + 16) == key && load_le64(data + 24) == source_length) {
+        uint64_t payload_length = load_le64(data + 32);
+        if (payload_length <= entry->length - CACHE_HEADER_SIZE &&
+            CACHE_HEADER_SIZE + ALIGN8(payload_length) == entry->length &&
+            token_file_checksum(TOKEN_FILE_CHECKSUM_SEED, data + CACHE_HEADER_SIZE,
+                                entry->length - CACHE_HEADER_SIZE) == load_le64(data + 40)) {
+            hit = view_flat_ast(data + CACHE_HEADER_SIZE, payload_length, flat);
+        }
+    }
+    if (!hit) {
+        release_source(entry);
+        return false;
+    }
+#ifdef PAXSI_HAVE_DIRENT
+    utimensat(AT_FDCWD, path, NULL, 0);
+#endif
+    return true;
+}
+
+#ifdef PAXSI_HAVE_DIRENT
+typedef struct {
+    char name[256];
+    uint64_t size;
+    struct timespec used;
+} CacheEntry;
+
+static int compare_cache_entries(const void* a, const void* b) {
+    const struct timespec* x = &((const CacheEntry*)a)->used;
+    const struct timespec* y = &((const CacheEntry*)b)->used;
+    if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+// Remove the least recently used entries until the cache fits its cap.
+// Entries another run removes first are simply skipped.
+static void cache_evict(const ParseCache* cache) {
+    DIR* dir = opendir(cache->dir);
+    if (!dir) return;
+    CacheEntry* entries = NULL;
+    size_t count = 0, capacity = 0;
+    uint64_t total = 0;
+    struct dirent* item;
+    char path[4096];
+    while ((item = readdir(dir)) != NULL) {
+        size_t length = strlen(item->d_name);
+        if (length < 4 || length >= sizeof(entries->name) ||
+            strcmp(item->d_name + length - 4, ".pxc") != 0) continue;
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, item->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            CacheEntry* grown = realloc(entries, capacity * sizeof(CacheEntry));
+            if (!grown) break;
+            entries = grown;
+        }
+        memcpy(entries[count].name, item->d_name, length + 1);
+        entries[count].size = st.st_size;
+        entries[count].used = st.st_mtim;
+        total += st.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    if (total > cache->capacity) {
+        qsort(entries, count, sizeof(CacheEntry), compare_cache_entries);
+        for (size_t i = 0; i < count && total > cache->capacity; i++) {
+            snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+            if (unlink(path) == 0) total -= entries[i].size;
+        }
+    }
+    free(entries);
+}
+#endif
+
+// Store the AST for `key`. Failures only cost the next run a miss.
+static void cache_store(const ParseCache* cache, uint64_t key, size_t source_length, const AST* ast) {
+    size_t payload_length;
+    uint8_t* payload = serialize_ast(ast, &payload_length);
+    if (!payload) return;
+    size_t padded_length = ALIGN8(payload_length);
+    uint8_t* grown = realloc(payload, padded_length ? padded_length : 1);
+    if (!grown) {
+        free(payload);
+        return;
+    }
+    payload = grown;
+    memset(payload + payload_length, 0, padded_length - payload_length);
+
+    uint8_t header[CACHE_HEADER_SIZE] = { 0 };
+    memcpy(header, "PAXC", 4);
+    store_le32(header + 4, CACHE_ENTRY_VERSION);
+    store_le32(header + 8, PAXSI_FRONTEND_VERSION);
+    store_le64(header + 16, key);
+    store_le64(header + 24, source_length);
+    store_le64(header + 32, payload_length);
+    store_le64(header + 40, token_file_checksum(TOKEN_FILE_CHECKSUM_SEED, payload, padded_length));
+
+    // The temporary name is unique per process and per store, so batch
+    // workers storing the same source don't write into each other's file
+    static unsigned stores = 0;
+    unsigned store = __atomic_fetch_add(&stores, 1, __ATOMIC_RELAXED);
+    char path[4096], temporary[4096 + 48];
+    cache_entry_path(cache, key, path, sizeof(path));
+#ifdef PAXSI_HAVE_DIRENT
+    mkdir(cache->dir, 0777);
+    snprintf(temporary, sizeof(temporary), "%s.%ld.%u.tmp", path, (long)getpid(), store);
+#else
+    snprintf(temporary, sizeof(temporary), "%s.%u.tmp", path, store);
+#endif
+    FILE* file = fopen(temporary, "wb");
+    bool ok = file != NULL && write_all(file, header, sizeof(header)) &&
+              write_all(file, payload, padded_length);
+    if (file && fclose(file) != 0) ok = false;
+    if (ok) ok = rename(temporary, path) == 0;
+    if (!ok && file) remove(temporary);
+    free(payload);
+
+#ifdef PAXSI_HAVE_DIRENT
+    if (ok) cache_evict(cache);
+#endif
+}
 
-    // Initialize lexer and tokenize
-    Lexer* lexer = init_lexer(buffer_file);
-    tokenize(lexer);
+// Add the counters of one run to a running total
+static void merge_lexer_stats(LexerStats* total, const LexerStats* part) {
+    for (int i = 0; i < TOKEN_TYPE_COUNT; i++) total->tokens[i] += part->tokens[i];
+    for (int i = 0; i < LEX_BYTES_COUNT; i++) total->bytes[i] += part->bytes[i];
+    for (int i = 0; i < LEX_TIME_COUNT; i++) {
+        total->ticks[i] += part->ticks[i];
+        total->calls[i] += part->calls[i];
+    }
+    total->token_reallocations += part->token_reallocations;
+}
+
+// Settings shared by every file of a run
+typedef struct {
+    bool use_mmap;
+    bool stream;
+    const char* tokens_path;
+    const ParseCache* cache;
+    size_t max_depth;       // parser nesting limit, 0 for the default
+    int parse_jobs;         // threads for lexing and function bodies, 0 to parse lazily
+} DriverOptions;
+
+// Lex and parse one file: the AST (or the tokens with --stream) goes to
+// `out`, diagnostics to `err`. A syntax error fails this file only.
+// The number of input bytes lexed goes to *input_bytes.
+static int run_file(const char* path, const DriverOptions* options, FILE* out, FILE* err,
+                    LexerStats* stats, uint64_t* input_bytes) {
+    *input_bytes = 0;
+    if (options->stream) return stream_file(path, out, err, stats, input_bytes);
+
+    SourceBuffer source;
+    if (!load_source(path, options->use_mmap, &source, err)) return 1;
+    *input_bytes = source.length;
+
+    if (options->tokens_path) {
+        Lexer* lexer = init_lexer_n(source.data, source.length);
+        lexer->stats = stats;
+        tokenize(lexer);
+        bool written = write_tokens_to_file(options->tokens_path, &lexer->tokens);
+        free_lexer(lexer);
+        release_source(&source);
+        return written ? 0 : 1;
+    }
 
-    // Передача токенов в парсер
-    AST* ast = parse(lexer->tokens, lexer->token_count);
-    print_ast(ast);
+    // A cache hit skips the lexer and the parser; with stats on the cache
+    // is only filled
+    const ParseCache* cache = options->cache;
+    uint64_t key = 0;
+    if (cache->dir) key = hash_source(source.data, source.length);
+    if (cache->dir && !stats) {
+        SourceBuffer entry;
+        FlatAST cached;
+        if (cache_load(cache, key, source.length, &entry, &cached, err)) {
+            fprint_flat_ast(out, &cached);
+            release_source(&entry);
+            release_source(&source);
+            return 0;
+        }
+    }
 
-    free_ast(ast);
+    // The parser pulls tokens from the lexer as it goes; with --parse-jobs
+    // the whole file is lexed first and function bodies parsed in parallel
+    Lexer* lexer = init_lexer_n(source.data, source.length);
+    lexer->stats = stats;
+    AST* ast;
+    if (options->parse_jobs) {
+        tokenize_parallel(lexer, options->parse_jobs);
+        ast = parse_parallel(&lexer->tokens, options->parse_jobs, err, options->max_depth);
+    } else {
+        ast = parse_lexer_checked(lexer, err, options->max_depth);
+    }
+    int status = 1;
+    if (ast) {
+        fprint_ast(out, ast);
+        if (cache->dir) cache_store(cache, key, source.length, ast);
+        free_ast(ast);
+        status = 0;
+    }
     free_lexer(lexer);
-    free(buffer_file);
-    return 0;
+    release_source(&source);
+    return status;
+}
+
+// Append a copy of `path` to the path array
+static bool push_path(char*** paths, size_t* count, size_t* capacity, const char* path) {
+    if (*count == *capacity) {
+        size_t grown_capacity = *capacity ? *capacity * 2 : 16;
+        char** grown = realloc(*paths, grown_capacity * sizeof(char*));
+        if (!grown) return false;
+        *paths = grown;
+        *capacity = grown_capacity;
+    }
+    char* copy = strdup(path);
+    if (!copy) return false;
+    (*paths)[(*count)++] = copy;
+    return true;
+}
+
+// Append the paths listed in `list`, one per line, to the path array.
+// Empty lines are skipped.
+static bool read_file_list(const char* list, char*** paths, size_t* count, size_t* capacity) {
+    FILE* file = fopen(list, "r");
+    if (file == NULL) {
+        report_error(stderr, "Couldn't open the file list");
+        return false;
+    }
+    char line[4096];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        size_t length = strlen(line);
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n' && !feof(file)) {
+            fprintf(stderr, "%s: path too long\n", list);
+            ok = false;
+            break;
+        }
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+        if (length == 0) continue;
+        if (!push_path(paths, count, capacity, line)) {
+            fprintf(stderr, "Insufficient memory error\n");
+            ok = false;
+        }
+    }
+    if (ok && ferror(file)) {
+        report_error(stderr, "Failed to read file list");
+        ok = false;
+    }
+    fclose(file);
+    return ok;
+}
+
+#ifdef PAXSI_HAVE_THREADS
+// Files a worker may run ahead of the printed ones, per worker: bounds
+// the output buffered for files that are done but not yet printed
+#define BATCH_WINDOW_PER_JOB 4
+
+// One file of a batch. The worker that claims it fills in the captured
+// output, diagnostics and status; the main thread prints them in input
+// order and frees them.
+typedef struct {
+    const char* path;
+    char* output;
+    size_t output_length;
+    char* diagnostics;
+    size_t diagnostics_length;
+    LexerStats* stats;
+    uint64_t input_bytes;
+    int status;
+    bool done;
+} BatchFile;
+
+typedef struct {
+    BatchFile* files;
+    size_t count;
+    const DriverOptions* options;
+    bool collect_stats;
+
+    pthread_mutex_t lock;
+    pthread_cond_t claimable;   // the window moved on
+    pthread_cond_t finished;    // a worker finished a file
+    size_t next;                // first file not claimed yet
+    size_t printed;             // files already printed
+    size_t window;
+} Batch;
+
+static void run_batch_file(Batch* batch, BatchFile* file) {
+    FILE* out = open_memstream(&file->output, &file->output_length);
+    FILE* err = open_memstream(&file->diagnostics, &file->diagnostics_length);
+    if (batch->collect_stats) file->stats = calloc(1, sizeof(LexerStats));
+    if (!out || !err || (batch->collect_stats && !file->stats)) {
+        if (out) fclose(out);
+        if (err) fclose(err);
+        free(file->output);
+        free(file->diagnostics);
+        free(file->stats);
+        file->output = file->diagnostics = NULL;
+        file->output_length = file->diagnostics_length = 0;
+        file->stats = NULL;
+        file->status = -1;
+        return;
+    }
+    file->status = run_file(file->path, batch->options, out, err, file->stats, &file->input_bytes);
+    fclose(out);
+    fclose(err);
+}
+
+static void* batch_worker(void* argument) {
+    Batch* batch = argument;
+    pthread_mutex_lock(&batch->lock);
+    for (;;) {
+        while (batch->next < batch->count && batch->next >= batch->printed + batch->window) {
+            pthread_cond_wait(&batch->claimable, &batch->lock);
+        }
+        if (batch->next >= batch->count) break;
+        BatchFile* file = &batch->files[batch->next++];
+        pthread_mutex_unlock(&batch->lock);
+
+        run_batch_file(batch, file);
+
+        pthread_mutex_lock(&batch->lock);
+        file->done = true;
+        pthread_cond_signal(&batch->finished);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+// Print a finished file: its output on stdout under a "File:" line, its
+// diagnostics on stderr with every line prefixed by the path
+static void print_batch_file(const BatchFile* file) {
+    printf("File: %s\n", file->path);
+    if (file->output_length) fwrite(file->output, 1, file->output_length, stdout);
+    fflush(stdout);
+    if (file->status < 0) fprintf(stderr, "%s: Insufficient memory error\n", file->path);
+
+    const char* line = file->diagnostics;
+    const char* end = line + file->diagnostics_length;
+    while (line < end) {
+        const char* newline = memchr(line, '\n', end - line);
+        size_t length = newline ? (size_t)(newline - line) + 1 : (size_t)(end - line);
+        fprintf(stderr, "%s: %.*s%s", file->path, (int)length, line, newline ? "" : "\n");
+        line += length;
+    }
+    fflush(stderr);
+}
+
+// Run every file on `jobs` workers. Returns 1 if any file failed.
+static int run_batch(char** paths, size_t count, const DriverOptions* options, size_t jobs,
+                     LexerStats* stats, uint64_t* input_bytes) {
+    Batch batch = { 0 };
+    batch.files = calloc(count, sizeof(BatchFile));
+    pthread_t* workers = malloc(jobs * sizeof(pthread_t));
+    if (!batch.files || !workers) {
+        free(batch.files);
+        free(workers);
+        fprintf(stderr, "Insufficient memory error\n");
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) batch.files[i].path = paths[i];
+    batch.count = count;
+    batch.options = options;
+    batch.collect_stats = stats != NULL;
+    batch.window = jobs * BATCH_WINDOW_PER_JOB;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.claimable, NULL);
+    pthread_cond_init(&batch.finished, NULL);
+
+    size_t started = 0;
+    while (started < jobs && pthread_create(&workers[started], NULL, batch_worker, &batch) == 0) {
+        started++;
+    }
+    // Without any worker the files run here, all before printing
+    if (started == 0) {
+        batch.window = count;
+        batch_worker(&batch);
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < count; i++) {
+        BatchFile* file = &batch.files[i];
+        pthread_mutex_lock(&batch.lock);
+        while (!file->done) pthread_cond_wait(&batch.finished, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+
+        print_batch_file(file);
+        if (file->status != 0) status = 1;
+        if (file->stats) merge_lexer_stats(stats, file->stats);
+        *input_bytes += file->input_bytes;
+        free(file->output);
+        free(file->diagnostics);
+        free(file->stats);
+
+        pthread_mutex_lock(&batch.lock);
+        batch.printed = i + 1;
+        pthread_cond_broadcast(&batch.claimable);
+        pthread_mutex_unlock(&batch.lock);
+    }
+
+    for (size_t i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    pthread_cond_destroy(&batch.finished);
+    pthread_cond_destroy(&batch.claimable);
+    pthread_mutex_destroy(&batch.lock);
+    free(workers);
+    free(batch.files);
+    return status;
+}
+#else
+// Without threads a batch runs file by file, printing as it goes
+static int run_batch(char** paths, size_t count, const DriverOptions* options, size_t jobs,
+                     LexerStats* stats, uint64_t* input_bytes) {
+    (void)jobs;
+    int status = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t bytes = 0;
+        printf("File: %s\n", paths[i]);
+        if (run_file(paths[i], options, stdout, stderr, stats, &bytes) != 0) status = 1;
+        fflush(stdout);
+        *input_bytes += bytes;
+    }
+    return status;
+}
+#endif
+
+// Number of workers for --jobs 0 and for a batch without --jobs
+static size_t default_jobs(void) {
+#ifdef PAXSI_HAVE_THREADS
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors > 0) return (size_t)processors;
+#endif
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    bool stats_json = false;
+    LexerStats stats = { 0 };
+    LexerStats* lexer_stats = NULL;
+    DriverOptions options = { true, false, NULL, NULL, 0, 0 };
+    long jobs = -1;
+    bool batch = false;
+    bool usage = false;
+    char** paths = NULL;
+    size_t paths_count = 0, paths_capacity = 0;
+
+    // Кэш разбора: каталог и предельный размер в МБ задаются флагами или
+    // переменными окружения PAXSI_CACHE_DIR и PAXSI_CACHE_SIZE
+    ParseCache cache = { getenv("PAXSI_CACHE_DIR"), CACHE_DEFAULT_CAPACITY };
+    const char* cache_size = getenv("PAXSI_CACHE_SIZE");
+
+    // Пути из аргументов и из @списков копируются в один массив
+    for (int i = 1; i < argc && !usage; i++) {
+        if (strcmp(argv[i], "--no-mmap") == 0) options.use_mmap = false;
+        else if (strcmp(argv[i], "--stream") == 0) options.stream = true;
+        else if (strcmp(argv[i], "--stats") == 0) lexer_stats = &stats;
+        else if (strcmp(argv[i], "--stats-json") == 0) {
+            lexer_stats = &stats;
+            stats_json = true;
+        }
+        else if (strcmp(argv[i], "--write-tokens") == 0 && i + 1 < argc) options.tokens_path = argv[++i];
+        else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) cache.dir = argv[++i];
+        else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) cache_size = argv[++i];
+        else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+            char* end;
+            long long depth = strtoll(argv[++i], &end, 10);
+            if (*end || depth <= 0) usage = true;
+            else options.max_depth = (size_t)depth;
+        }
+        else if (strcmp(argv[i], "--parse-jobs") == 0 && i + 1 < argc) {
+            char* end;
+            long parse_jobs = strtol(argv[++i], &end, 10);
+            if (*end || parse_jobs < 0 || parse_jobs > INT_MAX) usage = true;
+            else options.parse_jobs = parse_jobs ? (int)parse_jobs : (int)default_jobs();
+        }
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            char* end;
+            jobs = strtol(argv[++i], &end, 10);
+            if (*end || jobs < 0) usage = true;
+            batch = true;
+        }
+        else if (argv[i][0] == '@' && argv[i][1]) {
+            if (!read_file_list(argv[i] + 1, &paths, &paths_count, &paths_capacity)) {
+                usage = true;
+            }
+            batch = true;
+        }
+        else if (!push_path(&paths, &paths_count, &paths_capacity, argv[i])) {
+            fprintf(stderr, "Insufficient memory error\n");
+            return 1;
+        }
+    }
+    // Пакетный режим: несколько файлов, --jobs или @список; токены
+    // записываются только для одного файла
+    if (paths_count > 1) batch = true;
+    if (paths_count == 0 || (batch && options.tokens_path)) usage = true;
+    if (usage) {
+        printf("Usage: %s [--no-mmap] [--stream] [--stats | --stats-json] [--write-tokens <token_file>] "
+               "[--cache-dir <dir>] [--cache-size <MB>] [--max-depth <N>] [--parse-jobs <N>] [--jobs <N>] "
+               "<source_file | @file_list>...\n", argv[0]);
+        for (size_t i = 0; i < paths_count; i++) free(paths[i]);
+        free(paths);
+        return 1;
+    }
+    if (cache.dir && !*cache.dir) cache.dir = NULL;
+    if (cache_size) cache.capacity = strtoull(cache_size, NULL, 10) << 20;
+    options.cache = &cache;
+
+    // Статистика лексера (--stats) печатается в stderr после работы;
+    // тики переводятся в наносекунды по замеру всего запуска
+    double start_time = now_nanoseconds();
+    uint64_t start_clock = stats_clock();
+    uint64_t input_bytes = 0;
+    int status;
+    if (batch) {
+        size_t workers = jobs > 0 ? (size_t)jobs : default_jobs();
+        if (workers > paths_count) workers = paths_count;
+        status = run_batch(paths, paths_count, &options, workers, lexer_stats, &input_bytes);
+    } else {
+        status = run_file(paths[0], &options, stdout, stderr, lexer_stats, &input_bytes);
+    }
+    if (lexer_stats) {
+        uint64_t ticks = stats_clock() - start_clock;
+        double ns_per_tick = ticks ? (now_nanoseconds() - start_time) / ticks : 1;
+        print_lexer_stats(lexer_stats, input_bytes, ns_per_tick, stats_json);
+    }
+    for (size_t i = 0; i < paths_count; i++) free(paths[i]);
+    free(paths);
+    return status;
 }
+#endif
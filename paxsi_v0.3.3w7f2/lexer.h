@@ -12,11 +12,15 @@
 // Макросы для работы с лексером
 #define SHIFT(lexer, num) { \
     lexer->position += (num); \
-    lexer->column += (num); \
 }
 
 #define NEXT(lexer, num) ((lexer)->position + (num) < (lexer)->length ? (lexer)->input[(lexer)->position + (num)] : '\0')
 
+// Сравнение с префиксом без выхода за границу входа (вход может не
+// завершаться нулём, например при отображении файла через mmap)
+#define MATCH(lexer, str, num) ((lexer)->position + (num) <= (lexer)->length && \
+    memcmp((lexer)->input + (lexer)->position, (str), (num)) == 0)
+
 // Перечисление типов токенов
 typedef enum {
     // Data types and literals
@@ -133,34 +137,256 @@ typedef enum {
     TOKEN_ERROR
 } TokenType;
 
-// Структура токена
+#define TOKEN_TYPE_COUNT (TOKEN_ERROR + 1)
+
+// Значение числового литерала, вычисленное лексером. Целое, не влезающее
+// в int64_t, хранится как NUMBER_UINT; вещественное округлено правильно
+typedef enum {
+    NUMBER_NONE,
+    NUMBER_INT,
+    NUMBER_UINT,
+    NUMBER_REAL
+} NumberKind;
+
+typedef struct {
+    NumberKind kind;
+    union {
+        int64_t integer;
+        uint64_t uinteger;
+        double real;
+    } as;
+} NumberValue;
+
+// Структура токена - отдельный токен, как его видят получатель потокового
+// режима и read_tokens_from_file (лексер хранит токены в TokenBuffer).
+// line и column - позиция первого байта токена, column считается в байтах.
+// value указывает прямо во вход (или на статическую строку) и не
+// завершается нулём: длина хранится в length. owned == true, если value
+// выделен отдельно и освобождается free_tokens. symbol - номер имени
+// TOKEN_ID в таблице имён лексера, у остальных токенов SYMBOL_NONE.
+// number - значение TOKEN_INT/TOKEN_REAL (NUMBER_NONE у прочих токенов).
 typedef struct {
     TokenType type;
-    char* value;
-    int line;
-    int column;
-    int length;
+    const char* value;
+    int64_t line;
+    int64_t column;
+    size_t length;
+    uint32_t symbol;
+    NumberValue number;
+    bool owned;
 } Token;
 
 extern const char* token_names[];
 
+// Текст токена, которого нет во входе как есть: декодированный литерал,
+// сообщение об ошибке, "EOF". Таблица упорядочена по номеру токена
+typedef struct {
+    size_t token;
+    const char* value;
+    size_t length;
+    bool owned;
+} TokenPayload;
+
+// Значение lengths[i] у токена, текст которого лежит в таблице payloads
+#define TOKEN_PAYLOAD UINT32_MAX
+
+// Начала строк входа: starts[i] - смещение первого байта строки i + 2
+// (строка 1 начинается с 0). Строится один раз, при первом запросе
+// позиции токена, под блокировкой: потоки, читающие один буфер, могут
+// запрашивать позиции одновременно
+typedef struct {
+    uint32_t* starts;
+    size_t count;
+    bool built;
+} LineIndex;
+
+// Номер символа у токенов, не являющихся идентификаторами
+#define SYMBOL_NONE UINT32_MAX
+
+// Имя в таблице символов: names + offset, length байт и завершающий нуль
+typedef struct {
+    size_t offset;
+    uint32_t length;
+    uint32_t hash;
+} Symbol;
+
+// Таблица имён: каждый различный идентификатор хранится один раз и
+// получает плотный номер в порядке первого появления, так что дальше
+// имена сравниваются как числа. slots - открытая адресация по хешу,
+// в ячейке номер символа + 1 (0 - пусто)
+typedef struct {
+    Symbol* entries;
+    size_t count;
+    size_t capacity;
+    char* names;
+    size_t names_length;
+    size_t names_capacity;
+    uint32_t* slots;
+    size_t slot_count;
+} SymbolTable;
+
+// Токены лексера, хранимые по столбцам: проход только по типам (lookahead
+// парсера, поиск парных скобок) читает один байт на токен. Текст токена -
+// участок source[offsets[i], offsets[i] + lengths[i]). values[i] - номер
+// символа идентификатора в symbol_table или индекс значения числового
+// литерала в numbers (SYMBOL_NONE у прочих токенов). Строка и столбец не
+// хранятся: token_position вычисляет их по смещению. Смещения 32-битные,
+// поэтому пакетный режим принимает вход меньше 4 ГБ; большие файлы
+// читаются потоково.
+// Готовый буфер (tokenize вернул управление) только читается:
+// token_value, token_position, token_number и token_at можно вызывать
+// из нескольких потоков сразу. Пока лексер дописывает буфер (tokenize,
+// lexer_next, lexer_peek), читать его может только поток лексера.
+typedef struct {
+    const char* source;
+    size_t source_length;
+    LineIndex* line_index;
+    SymbolTable* symbol_table;
+    uint8_t* kinds;
+    uint32_t* offsets;
+    uint32_t* lengths;
+    uint32_t* values;
+    size_t count;
+    size_t capacity;
+    TokenPayload* payloads;
+    size_t payload_count;
+    size_t payload_capacity;
+    NumberValue* numbers;
+    size_t number_count;
+    size_t number_capacity;
+} TokenBuffer;
+
+// Тип токена; за концом буфера - TOKEN_EOF
+static inline TokenType token_type(const TokenBuffer* tokens, size_t index) {
+    return index < tokens->count ? (TokenType)tokens->kinds[index] : TOKEN_EOF;
+}
+
+// Источник данных для потокового режима в стиле read():
+// возвращает число прочитанных байт, 0 в конце входа, < 0 при ошибке
+typedef int64_t (*LexerReader)(void* context, char* buffer, size_t size);
+
+// Получатель токенов потокового режима. value указывает в окно лексера
+// и действителен только во время вызова
+typedef void (*TokenSink)(void* context, const Token* token);
+
+// Число нулевых байт, которые должны следовать за входом init_lexer_n:
+// внутренние циклы сканера останавливаются на этом стоп-символе без
+// проверки границ
+#define LEXER_PADDING 1
+
+// Размер окна потокового режима по умолчанию
+#define LEXER_WINDOW_SIZE (64 * 1024)
+
+// Сколько байт за концом токена может просматривать лексер; токен,
+// закончившийся ближе к краю окна, перечитывается после подкачки
+#define LEXER_LOOKAHEAD 8
+
+// Классы байтов входа, которые считает статистика лексера
+typedef enum {
+    LEX_BYTES_WHITESPACE,
+    LEX_BYTES_COMMENT,
+    LEX_BYTES_STRING,       // строковые и символьные литералы
+    LEX_BYTES_NUMBER,
+    LEX_BYTES_IDENTIFIER,
+    LEX_BYTES_COUNT
+} LexBytes;
+
+// Замеряемые участки лексера; LEX_TIME_TOTAL - весь лексинг, остальные
+// входят в него
+typedef enum {
+    LEX_TIME_TOTAL,
+    LEX_TIME_NUMBER,        // parse_number
+    LEX_TIME_STRING,        // parse_string и parse_char
+    LEX_TIME_COMMENT,       // комментарии в skip_comments
+    LEX_TIME_COUNT
+} LexTime;
+
+// Статистика лексера (--stats). Собирается, только если lexer->stats не
+// NULL; выключенная стоит одного предсказуемого ветвления на участок.
+// Время - в тиках stats_clock (TSC на x86), calls - число замеров.
+// tokenize_parallel считает только токены.
+typedef struct {
+    uint64_t tokens[TOKEN_TYPE_COUNT];
+    uint64_t bytes[LEX_BYTES_COUNT];
+    uint64_t ticks[LEX_TIME_COUNT];
+    uint64_t calls[LEX_TIME_COUNT];
+    uint64_t token_reallocations;   // рост массивов токенов и значений
+} LexerStats;
+
 // Структура лексера
 typedef struct {
     const char* input;
-    int length;
-    int position;
-    int line;
-    int column;
-    Token* tokens;
-    int token_count;
-    int token_capacity;
+    size_t length;
+    size_t position;
+    TokenBuffer tokens;
+
+    // Потоковый режим: input указывает на окно фиксированного размера,
+    // base - смещение начала окна во входном потоке
+    LexerReader reader;
+    void* reader_context;
+    char* window;
+    size_t window_capacity;
+    uint64_t base;
+    bool stream_eof;
+    bool speculating;
+
+    // Номер строки и абсолютное смещение её начала для абсолютной позиции
+    // line_cursor - для токенов, выдаваемых по одному (потоковый режим,
+    // lexer_next). Курсор сдвигается вперёд при выдаче токенов и перед тем,
+    // как начало окна отбрасывается
+    uint64_t line_cursor;
+    int64_t line;
+    uint64_t line_start;
+
+    // Выдача по запросу (lexer_next): номер следующего выдаваемого токена
+    // в буфере; finished - выдан последний токен (EOF или фатальная ошибка)
+    size_t next_token;
+    bool finished;
+
+    // Память для декодированных литералов со escape-последовательностями;
+    // токены указывают в неё, пока жив лексер (в потоковом режиме - до
+    // передачи токена получателю)
+    struct ScratchBlock* scratch;
+
+    // Статистика или NULL, если она не собирается
+    LexerStats* stats;
 } Lexer;
 
+// Файл токенов версии 2, открытый map_token_file: файл отображён в
+// память (или прочитан целиком), token_file_at декодирует запись на месте,
+// так что загрузка не выделяет память на каждый токен
+typedef struct {
+    const uint8_t* records;
+    const char* strings;
+    size_t count;
+    size_t strings_length;
+    void* data;
+    size_t data_length;
+    bool mapped;
+} TokenFile;
+
 // Прототипы функций
 Lexer* init_lexer(const char* input);
+Lexer* init_lexer_n(const char* input, size_t length);
+Lexer* init_stream_lexer(LexerReader reader, void* context, size_t window_size);
 void free_lexer(Lexer* lexer);
 void tokenize(Lexer* lexer);
-Token* read_tokens_from_file(const char* filename, int* token_count);
-void free_tokens(Token* tokens, int token_count);
+void tokenize_stream(Lexer* lexer, TokenSink sink, void* context);
+void tokenize_parallel(Lexer* lexer, int threads);
+bool lexer_next(Lexer* lexer, Token* token);
+TokenType lexer_peek(Lexer* lexer, size_t distance);
+const char* token_value(const TokenBuffer* tokens, size_t index, size_t* length);
+void token_position(const TokenBuffer* tokens, size_t index, int64_t* line, int64_t* column);
+NumberValue token_number(const TokenBuffer* tokens, size_t index);
+Token token_at(const TokenBuffer* tokens, size_t index);
+uint32_t intern_symbol(SymbolTable* table, const char* name, size_t length);
+const char* symbol_name(const SymbolTable* table, uint32_t symbol);
+void free_symbol_table(SymbolTable* table);
+Token* read_tokens_from_file(const char* filename, size_t* token_count);
+bool write_tokens_to_file(const char* filename, const TokenBuffer* tokens);
+bool map_token_file(const char* filename, TokenFile* file, bool verify);
+Token token_file_at(const TokenFile* file, size_t index);
+void unmap_token_file(TokenFile* file);
+void free_tokens(Token* tokens, size_t token_count);
 
 #endif
@@ -1,597 +1,1249 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include "parser.h"
 #include "lexer.h"
 
-static int current_token_index = 0;
-static Token *tokens = NULL;
-static int token_count = 0;
-static int start_function_declared = 0;  // Флаг объявления стартовой функции
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define PAXSI_HAVE_THREADS 1
+#endif
 
-static TokenType current_token_type();
-static void advance();
-static void expect(TokenType expected_type);
-static Token *current_token();
-static void error(const char *message);
-static ASTNode *parse_statement();
+#if defined(__linux__)
+#include <sys/mman.h>
+#if defined(MADV_HUGEPAGE)
+#define AST_HUGE_PAGES 1
+#endif
+#endif
+
+// Арена AST: узлы, вложенные блоки, их массивы операторов и строки
+// значений берутся из блоков, принадлежащих корневому AST. Блоки растут
+// вдвое до AST_CHUNK_MAX и не перемещаются; free_ast освобождает их
+// целиком, не обходя дерево
+struct ASTChunk {
+    struct ASTChunk *next;
+    size_t used;
+    size_t capacity;
+    size_t reserved;  // Выравнивает data на 8 байт
+    char data[];
+};
+
+#define AST_CHUNK_MIN (16 * 1024)
+#define AST_CHUNK_MAX (2 * 1024 * 1024)
+#define AST_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// Память блока; блоки размером в большую страницу выравниваются по ней и
+// помечаются для прозрачных больших страниц
+static struct ASTChunk *allocate_chunk(size_t capacity) {
+    size_t size = sizeof(struct ASTChunk) + capacity;
+    struct ASTChunk *chunk = NULL;
+#ifdef AST_HUGE_PAGES
+    if (size >= AST_CHUNK_MAX) {
+        size = (size + AST_CHUNK_MAX - 1) & ~(size_t)(AST_CHUNK_MAX - 1);
+        void *memory = NULL;
+        if (posix_memalign(&memory, AST_CHUNK_MAX, size) == 0) {
+            madvise(memory, size, MADV_HUGEPAGE);
+            chunk = memory;
+            capacity = size - sizeof(struct ASTChunk);
+        }
+    }
+#endif
+    if (!chunk) chunk = malloc(size);
+    if (!chunk) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    chunk->used = 0;
+    chunk->capacity = capacity;
+    return chunk;
+}
+
+// `size` байт из арены AST `owner`, выровненных на 8
+static void *ast_alloc(AST *owner, size_t size) {
+    size = AST_ALIGN(size);
+    struct ASTChunk *chunk = owner->arena;
+    if (!chunk || chunk->capacity - chunk->used < size) {
+        size_t capacity = chunk ? chunk->capacity * 2 : AST_CHUNK_MIN;
+        if (capacity > AST_CHUNK_MAX - sizeof(struct ASTChunk)) capacity = AST_CHUNK_MAX - sizeof(struct ASTChunk);
+        if (capacity < size) capacity = size;
+        chunk = allocate_chunk(capacity);
+        chunk->next = owner->arena;
+        owner->arena = chunk;
+    }
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+    return memory;
+}
+
+// Копия length байт text со завершающим нулём в арене
+static char *ast_strndup(AST *owner, const char *text, size_t length) {
+    char *copy = ast_alloc(owner, length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Пустое корневое AST; владеет ареной
+static AST *create_program(const SymbolTable *symbols) {
+    AST *ast = malloc(sizeof(AST));
+    if (!ast) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    ast->nodes = NULL;
+    ast->count = 0;
+    ast->capacity = 0;
+    ast->symbols = symbols;
+    ast->owned_symbols = NULL;
+    ast->arena = NULL;
+    return ast;
+}
+
+// Пустой вложенный блок операторов в арене корневого AST
+static AST *create_block(AST *owner) {
+    AST *block = ast_alloc(owner, sizeof(AST));
+    block->nodes = NULL;
+    block->count = 0;
+    block->capacity = 0;
+    block->symbols = owner->symbols;
+    block->owned_symbols = NULL;
+    block->arena = NULL;
+    return block;
+}
+
+// Растущий стек в куче для разбора и обходов AST без рекурсии: глубина
+// вложенности ограничена памятью, а не стеком потока
+typedef struct {
+    void *items;
+    size_t count;
+    size_t capacity;
+} WorkStack;
+
+#define WORK_TOP(stack, type) (&((type*)(stack)->items)[(stack)->count - 1])
+
+static void work_grow(WorkStack *stack, size_t item_size) {
+    size_t capacity = stack->capacity ? stack->capacity * 2 : 64;
+    void *items = realloc(stack->items, capacity * item_size);
+    if (!items) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    stack->items = items;
+    stack->capacity = capacity;
+}
+
+// Место под новый элемент размером item_size на вершине стека. Указатели
+// на элементы после вызова недействительны: стек может переехать
+static inline void *work_push(WorkStack *stack, size_t item_size) {
+    if (stack->count == stack->capacity) work_grow(stack, item_size);
+    return (char*)stack->items + stack->count++ * item_size;
+}
+
+// Состояние одного разбора. Передаётся во все функции parse_*, так что
+// разборы независимы и могут идти в разных потоках одновременно
+typedef struct {
+    const TokenBuffer *tokens;
+    size_t current_token_index;
+    size_t token_end;             // Конец разбираемых токенов: весь буфер или один блок
+    int start_function_declared;  // Флаг объявления стартовой функции
+
+    // Разбор по запросу (parse_lexer): токены берутся у лексера по одному,
+    // current - текущий токен, at_end - лексер больше ничего не выдаст
+    Lexer *source;
+    Token current;
+    bool at_end;
+    char *current_text;  // Копия текста текущего токена, если уже снята
+    const SymbolTable *symbols;
+
+    // Первая ошибка печатается в diagnostics (если он не NULL) и поднимает
+    // failed; дальше разбор видит конец входа и сворачивается, достраивая
+    // узлы, так что всё созданное остаётся в AST и освобождается вместе с ним
+    FILE *diagnostics;
+    bool failed;
+
+    AST *program;  // Строящееся AST: в его арене все узлы и строки
+
+    WorkStack frames;  // Незаконченные конструкции (ParseFrame)
+    size_t max_depth;  // Предел frames.count
+
+    struct BlockPlan *plan;  // Скелет parse_parallel: блоки откладываются в задачи
+} Parser;
 
 // parser2.c
-static TokenType current_token_type() {
-    Token *t = current_token();
-    return t ? t->type : TOKEN_EOF;
+// Просмотр вперёд читает только столбец типов буфера токенов
+static TokenType current_token_type(Parser *p) {
+    if (p->failed) return TOKEN_EOF;
+    if (p->source) return p->at_end ? TOKEN_EOF : p->current.type;
+    if (p->current_token_index >= p->token_end) return TOKEN_EOF;
+    return (TokenType)p->tokens->kinds[p->current_token_index];
 }
 
-static void advance() {
-    if (current_token_index < token_count) current_token_index++;
+// Тип токена после текущего
+static TokenType next_token_type(Parser *p) {
+    if (p->failed) return TOKEN_EOF;
+    if (p->source) return p->at_end ? TOKEN_EOF : lexer_peek(p->source, 0);
+    if (p->current_token_index + 1 >= p->token_end) return TOKEN_EOF;
+    return (TokenType)p->tokens->kinds[p->current_token_index + 1];
 }
 
-static Token *current_token() {
-    if (current_token_index < token_count) return &tokens[current_token_index];
-    return NULL;
+// Токены кончились (после EOF, ошибки лексера или ошибки разбора)
+static bool input_exhausted(Parser *p) {
+    if (p->failed) return true;
+    return p->source ? p->at_end : p->current_token_index >= p->token_end;
+}
+
+static void advance(Parser *p) {
+    if (p->failed) return;
+    p->current_text = NULL;
+    if (p->source) {
+        if (!p->at_end) p->at_end = !lexer_next(p->source, &p->current);
+        return;
+    }
+    if (p->current_token_index < p->token_end) p->current_token_index++;
+}
+
+// Копия текста текущего токена в арене AST; за концом входа - пустая
+// строка. Копия снимается один раз на токен: в потоковом режиме
+// next_token_type может сдвинуть окно лексера под current.value, поэтому
+// текст нужного токена копируется до просмотра вперёд
+static char *current_token_text(Parser *p) {
+    if (input_exhausted(p)) return ast_strndup(p->program, "", 0);
+    if (!p->current_text) {
+        if (p->source) {
+            p->current_text = ast_strndup(p->program, p->current.value, p->current.length);
+        } else {
+            size_t length;
+            const char *value = token_value(p->tokens, p->current_token_index, &length);
+            p->current_text = ast_strndup(p->program, value, length);
+        }
+    }
+    return p->current_text;
 }
 
-static void error(const char *message) {
-    if (current_token_index < token_count) {
-        Token *t = &tokens[current_token_index];
-        fprintf(stderr, "Parser error at line %d, column %d: %s\n", t->line, t->column, message);
+// Номер имени текущего идентификатора в таблице символов
+static uint32_t current_token_symbol(Parser *p) {
+    if (current_token_type(p) != TOKEN_ID) return SYMBOL_NONE;
+    if (p->source) return p->current.symbol;
+    return p->tokens->values[p->current_token_index];
+}
+
+// Строка и столбец вычисляются только при выводе ошибки. Сообщается
+// только первая ошибка разбора
+static void error(Parser *p, const char *message) {
+    if (p->failed) return;
+    // Тихий разбор (parse_parallel) не печатает и не зовёт token_at: тот
+    // строит индекс строк в общем для потоков буфере токенов
+    if (!p->diagnostics) {
+        p->failed = true;
+        return;
+    }
+    if (!input_exhausted(p)) {
+        Token t = p->source ? p->current : token_at(p->tokens, p->current_token_index);
+        fprintf(p->diagnostics, "Parser error at line %" PRId64 ", column %" PRId64 ": %s\n",
+                t.line, t.column, message);
     } else {
-        fprintf(stderr, "Parser error at end of input: %s\n", message);
+        fprintf(p->diagnostics, "Parser error at end of input: %s\n", message);
     }
-    exit(EXIT_FAILURE);
+    p->failed = true;
 }
 
-static void expect(TokenType expected_type) {
-    TokenType actual = current_token_type();
-    if (actual != expected_type) {
-        fprintf(stderr, "Expected %s but got %s\n", 
+static void expect(Parser *p, TokenType expected_type) {
+    TokenType actual = current_token_type(p);
+    if (actual != expected_type && !p->failed) {
+        if (p->diagnostics) fprintf(p->diagnostics, "Expected %s but got %s\n", 
                 token_names[expected_type],
                 actual == TOKEN_EOF ? "EOF" : token_names[actual]);
-        error("Unexpected token");
+        error(p, "Unexpected token");
     }
-    advance();
+    advance(p);
 }
 
-// Создание узла AST с дополнительным полем
-static ASTNode *create_ast_node(ASTNodeType type, TokenType op_type, 
+// Создание узла AST с дополнительным полем. value уже лежит в арене
+// owner и не копируется
+static ASTNode *create_ast_node(AST *owner, ASTNodeType type, TokenType op_type, 
                                 char *value, ASTNode *left, ASTNode *right, ASTNode *extra) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    if (!node) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
-    }
+    ASTNode *node = ast_alloc(owner, sizeof(ASTNode));
     node->type = type;
     node->op_type = op_type;
-    node->value = value ? strdup(value) : NULL;
+    node->value = value;
+    node->symbol = SYMBOL_NONE;
     node->left = left;
     node->right = right;
     node->extra = extra;  // Дополнительное поле для условий/блоков
     return node;
 }
 
-static void add_ast_node(AST *ast, ASTNode *node) {
+// Узел, имя которого задано номером символа (идентификатор, вызов, функция)
+static ASTNode *create_named_node(AST *owner, ASTNodeType type, TokenType op_type, uint32_t symbol,
+                                  ASTNode *left, ASTNode *right) {
+    ASTNode *node = create_ast_node(owner, type, op_type, NULL, left, right, NULL);
+    node->symbol = symbol;
+    return node;
+}
+
+// Массив операторов тоже в арене: при росте он копируется в новый,
+// вдвое больший, старый остаётся в арене до free_ast
+static void add_ast_node(AST *owner, AST *ast, ASTNode *node) {
     if (ast->count >= ast->capacity) {
-        ast->capacity = ast->capacity == 0 ? 4 : ast->capacity * 2;
-        ast->nodes = realloc(ast->nodes, ast->capacity * sizeof(ASTNode*));
-        if (!ast->nodes) {
-            perror("realloc");
-            exit(EXIT_FAILURE);
-        }
+        int capacity = ast->capacity == 0 ? 4 : ast->capacity * 2;
+        ASTNode **nodes = ast_alloc(owner, capacity * sizeof(ASTNode*));
+        if (ast->count) memcpy(nodes, ast->nodes, ast->count * sizeof(ASTNode*));
+        ast->nodes = nodes;
+        ast->capacity = capacity;
     }
     ast->nodes[ast->count++] = node;
 }
 
-// Парсинг выражений с приоритетами
-static ASTNode *parse_expression();
-static ASTNode *parse_assignment();
-static ASTNode *parse_bitwise_or();
-static ASTNode *parse_bitwise_xor();
-static ASTNode *parse_bitwise_and();
-static ASTNode *parse_equality();
-static ASTNode *parse_relational();
-static ASTNode *parse_shift();
-static ASTNode *parse_additive();
-static ASTNode *parse_multiplicative();
-static ASTNode *parse_unary();
-static ASTNode *parse_primary();
-
-// Парсинг блока кода (однострочный или многострочный)
-static ASTNode *parse_block() {
-    if (current_token_type() == TOKEN_LCURLY) {
-        advance();  // Пропускаем {
-        ASTNode *block_node = create_ast_node(AST_BLOCK, 0, NULL, NULL, NULL, NULL);
-        AST *block_ast = malloc(sizeof(AST));
-        block_ast->nodes = NULL;
-        block_ast->count = 0;
-        block_ast->capacity = 0;
-        
-        while (current_token_type() != TOKEN_RCURLY && current_token_type() != TOKEN_EOF) {
-            ASTNode *stmt = parse_statement();
-            add_ast_node(block_ast, stmt);
+#define ALL_SLOTS (FLAT_LEFT | FLAT_RIGHT | FLAT_EXTRA)
+
+// Следующий непустой потомок node с позиции *next: операторы
+// многострочного блока или слоты из slots по порядку left, right, extra.
+// NULL, когда потомки кончились
+static ASTNode *next_child(const ASTNode *node, int slots, int *next) {
+    if (node->type == AST_BLOCK && node->extra) {
+        const AST *block = (const AST*)node->extra;
+        while (*next < block->count) {
+            ASTNode *child = block->nodes[(*next)++];
+            if (child) return child;
         }
-        expect(TOKEN_RCURLY);
-        
-        block_node->extra = (ASTNode*)block_ast;  // Храним блок как под-AST
-        return block_node;
-    } else {
-        // Однострочный блок
-        ASTNode *single_stmt = parse_statement();
-        return create_ast_node(AST_BLOCK, 0, NULL, single_stmt, NULL, NULL);
+        return NULL;
     }
-}
-
-void print_ast_node(ASTNode *node, int indent) {
-    if (!node) return;
-    
-    for (int i = 0; i < indent; i++) printf("  ");
-    
-    switch (node->type) {
-        case AST_VARIABLE_DECL:
-            printf("VariableDecl: %s\n", node->value);
-            break;
-            
-        case AST_BINARY_OP:
-            printf("BinaryOp: %s\n", token_names[node->op_type]);
-            print_ast_node(node->left, indent + 1);
-            print_ast_node(node->right, indent + 1);
-            break;
-            
-        case AST_UNARY_OP:
-            printf("UnaryOp: %s\n", token_names[node->op_type]);
-            print_ast_node(node->right, indent + 1);  // Unary ops only have right child
-            break;
-            
-        case AST_LITERAL:
-            printf("Literal(%s): %s\n", token_names[node->op_type], node->value);
-            break;
-            
-        case AST_IDENTIFIER:
-            printf("Identifier: %s\n", node->value);
-            break;
-        
-        case AST_ASSIGNMENT:
-            printf("Assignment: %s\n", token_names[node->op_type]);
-            print_ast_node(node->left, indent + 1);
-            print_ast_node(node->right, indent + 1);
-            break;
-            
-        case AST_COMPOUND_ASSIGN:
-            printf("Compound Assignment: %s\n", token_names[node->op_type]);
-            print_ast_node(node->left, indent + 1);
-            print_ast_node(node->right, indent + 1);
-            break;
-            
-        case AST_IF:
-            printf("If\n");
-            print_ast_node(node->left, indent + 1);  // Условие
-            print_ast_node(node->right, indent + 1); // Блок if
-            print_ast_node(node->extra, indent + 1); // Else/Elif
-            break;
-            
-        case AST_ELIF:
-            printf("Elif\n");
-            print_ast_node(node->left, indent + 1);  // Условие
-            print_ast_node(node->right, indent + 1); // Блок elif
-            print_ast_node(node->extra, indent + 1); // Следующий elif
-            break;
-            
-        case AST_ELSE:
-            printf("Else\n");
-            print_ast_node(node->left, indent + 1);  // Блок else
-            break;
-            
-        case AST_BLOCK:
-            printf("Block\n");
-            if (node->extra) {
-                // Многострочный блок
-                AST *block_ast = (AST*)node->extra;
-                for (int i = 0; i < block_ast->count; i++) {
-                    print_ast_node(block_ast->nodes[i], indent + 1);
-                }
-            } else {
-                // Однострочный блок
-                print_ast_node(node->left, indent + 1);
-            }
-            break;
-            
-        case AST_FUNCTION:
-            printf("Function: %s\n", node->value);
-            print_ast_node(node->left, indent + 1);  // Аргументы
-            print_ast_node(node->right, indent + 1); // Тело
-            break;
-            
-        case AST_START_FUNCTION:
-            printf("Start Function: %s\n", node->value);
-            print_ast_node(node->left, indent + 1);  // Аргументы
-            print_ast_node(node->right, indent + 1); // Тело
-            break;
-            
-        case AST_FUNCTION_CALL:
-            printf("Call: %s\n", node->value);
-            print_ast_node(node->left, indent + 1);  // Аргументы
-            break;
+    while (*next < 3) {
+        int slot = (*next)++;
+        if (!(slots & 1 << slot)) continue;
+        ASTNode *child = slot == 0 ? node->left : slot == 1 ? node->right : node->extra;
+        if (child) return child;
     }
+    return NULL;
 }
 
-// Парсинг условных выражений (if/elif/else)
-static ASTNode *parse_if_statement() {
-    advance();  // Пропускаем if
-    ASTNode *cond = parse_expression();  // Условие
-    ASTNode *if_block = parse_block();   // Блок if
-    
-    ASTNode *elif_node = NULL;
-    ASTNode *else_node = NULL;
-    
-    // Обработка elif
-    while (current_token_type() == TOKEN_ELIF) {
-        advance();  // Пропускаем elif
-        ASTNode *elif_cond = parse_expression();
-        ASTNode *elif_block = parse_block();
-        elif_node = create_ast_node(AST_ELIF, 0, NULL, elif_cond, elif_block, elif_node);
-    }
-    
-    // Обработка else
-    if (current_token_type() == TOKEN_ELSE) {
-        advance();  // Пропускаем else
-        else_node = parse_block();
-    }
-    
-    return create_ast_node(AST_IF, 0, NULL, cond, if_block, 
-                          create_ast_node(AST_ELSE, 0, NULL, else_node, elif_node, NULL));
-}
+// Выражения разбираются по Пратту: таблица задаёт для каждого
+// инфиксного и постфиксного оператора силу связывания слева,
+// ассоциативность и вид узла. Операнд после оператора разбирается с
+// порогом его силы (на единицу меньше для правоассоциативных), и цикл
+// забирает только операторы сильнее порога
+typedef enum {
+    OPERATOR_NONE,
+    OPERATOR_BINARY,
+    OPERATOR_ASSIGN,
+    OPERATOR_COMPOUND_ASSIGN,
+    OPERATOR_CONDITIONAL,
+    OPERATOR_POSTFIX
+} OperatorKind;
 
-// Парсинг функций
-static ASTNode *parse_function() {
-    bool is_start_function = false;
-    if (current_token_type() == TOKEN_DOUBLE_UNDERSCORE) {
-        is_start_function = true;
-        advance();
-    }
-    
-    if (current_token_type() != TOKEN_ID) {
-        error("Expected function name");
-    }
+// Силы связывания от слабых к сильным. Префиксные операторы слабее **
+// и постфиксных: -a ** b - это -(a ** b), -a++ - это -(a++)
+enum {
+    POWER_NONE,
+    POWER_ASSIGN,
+    POWER_CONDITIONAL,
+    POWER_LOGICAL_OR,
+    POWER_LOGICAL_AND,
+    POWER_BITWISE_OR,
+    POWER_BITWISE_XOR,
+    POWER_BITWISE_AND,
+    POWER_EQUALITY,
+    POWER_RELATIONAL,
+    POWER_SHIFT,
+    POWER_ADDITIVE,
+    POWER_MULTIPLICATIVE,
+    POWER_PREFIX,
+    POWER_EXPONENT,
+    POWER_POSTFIX
+};
 
-    Token *t = current_token();
-    char *func_name = strdup(t->value);
-    advance();  // Пропускаем имя функции
-    
-    // Обработка аргументов
-    ASTNode *args = NULL;
-    if (current_token_type() == TOKEN_LPAREN) {
-        advance();  // Пропускаем (
-        if (current_token_type() != TOKEN_RPAREN) {
-            args = parse_expression();  // Парсим список аргументов
-        }
-        expect(TOKEN_RPAREN);
-    }
-    
-    ASTNode *body = parse_block();
-    
-    // Проверка стартовой функции
-    if (is_start_function) {
-        if (start_function_declared) {
-            error("Only one start function allowed");
-        }
-        start_function_declared = 1;
-        return create_ast_node(AST_START_FUNCTION, 0, func_name, args, body, NULL);
-    }
-    
-    return create_ast_node(AST_FUNCTION, 0, func_name, args, body, NULL);
+typedef struct {
+    uint8_t power;       // POWER_NONE - токен не продолжает выражение
+    bool right;          // Правоассоциативный
+    uint8_t kind;        // OperatorKind
+} Operator;
+
+static const Operator operators[TOKEN_TYPE_COUNT] = {
+    [TOKEN_EQUAL]            = { POWER_ASSIGN, true, OPERATOR_ASSIGN },
+    [TOKEN_PLUS_EQ]          = { POWER_ASSIGN, true, OPERATOR_COMPOUND_ASSIGN },
+    [TOKEN_MINUS_EQ]         = { POWER_ASSIGN, true, OPERATOR_COMPOUND_ASSIGN },
+    [TOKEN_STAR_EQ]          = { POWER_ASSIGN, true, OPERATOR_COMPOUND_ASSIGN },
+    [TOKEN_SLASH_EQ]         = { POWER_ASSIGN, true, OPERATOR_COMPOUND_ASSIGN },
+    [TOKEN_PIPE_EQ]          = { POWER_ASSIGN, true, OPERATOR_COMPOUND_ASSIGN },
+    [TOKEN_AMPERSAND_EQ]     = { POWER_ASSIGN, true, OPERATOR_COMPOUND_ASSIGN },
+    [TOKEN_CARET_EQ]         = { POWER_ASSIGN, true, OPERATOR_COMPOUND_ASSIGN },
+    [TOKEN_TILDE_EQ]         = { POWER_ASSIGN, true, OPERATOR_COMPOUND_ASSIGN },
+    [TOKEN_QUESTION]         = { POWER_CONDITIONAL, true, OPERATOR_CONDITIONAL },
+    [TOKEN_DOUBLE_PIPE]      = { POWER_LOGICAL_OR, false, OPERATOR_BINARY },
+    [TOKEN_DOUBLE_AMPERSAND] = { POWER_LOGICAL_AND, false, OPERATOR_BINARY },
+    [TOKEN_PIPE]             = { POWER_BITWISE_OR, false, OPERATOR_BINARY },
+    [TOKEN_CARET]            = { POWER_BITWISE_XOR, false, OPERATOR_BINARY },
+    [TOKEN_AMPERSAND]        = { POWER_BITWISE_AND, false, OPERATOR_BINARY },
+    [TOKEN_DOUBLE_EQ]        = { POWER_EQUALITY, false, OPERATOR_BINARY },
+    [TOKEN_NE]               = { POWER_EQUALITY, false, OPERATOR_BINARY },
+    [TOKEN_LT]               = { POWER_RELATIONAL, false, OPERATOR_BINARY },
+    [TOKEN_GT]               = { POWER_RELATIONAL, false, OPERATOR_BINARY },
+    [TOKEN_LE]               = { POWER_RELATIONAL, false, OPERATOR_BINARY },
+    [TOKEN_GE]               = { POWER_RELATIONAL, false, OPERATOR_BINARY },
+    [TOKEN_SHL]              = { POWER_SHIFT, false, OPERATOR_BINARY },
+    [TOKEN_SHR]              = { POWER_SHIFT, false, OPERATOR_BINARY },
+    [TOKEN_SAL]              = { POWER_SHIFT, false, OPERATOR_BINARY },
+    [TOKEN_SAR]              = { POWER_SHIFT, false, OPERATOR_BINARY },
+    [TOKEN_ROL]              = { POWER_SHIFT, false, OPERATOR_BINARY },
+    [TOKEN_ROR]              = { POWER_SHIFT, false, OPERATOR_BINARY },
+    [TOKEN_PLUS]             = { POWER_ADDITIVE, false, OPERATOR_BINARY },
+    [TOKEN_MINUS]            = { POWER_ADDITIVE, false, OPERATOR_BINARY },
+    [TOKEN_STAR]             = { POWER_MULTIPLICATIVE, false, OPERATOR_BINARY },
+    [TOKEN_SLASH]            = { POWER_MULTIPLICATIVE, false, OPERATOR_BINARY },
+    [TOKEN_DOUBLE_STAR]      = { POWER_EXPONENT, true, OPERATOR_BINARY },
+    [TOKEN_DOUBLE_PLUS]      = { POWER_POSTFIX, false, OPERATOR_POSTFIX },
+    [TOKEN_DOUBLE_MINUS]     = { POWER_POSTFIX, false, OPERATOR_POSTFIX },
+};
+
+static int operand_power(const Operator *info) {
+    return info->right ? info->power - 1 : info->power;
 }
 
-// Парсинг выражений с приоритетами
-static ASTNode *parse_expression() {
-    return parse_assignment();
+static ASTNode *create_infix_node(Parser *p, TokenType op, ASTNode *left, ASTNode *right) {
+    OperatorKind kind = (OperatorKind)operators[op].kind;
+    ASTNodeType type = kind == OPERATOR_ASSIGN ? AST_ASSIGNMENT :
+                       kind == OPERATOR_COMPOUND_ASSIGN ? AST_COMPOUND_ASSIGN :
+                       AST_BINARY_OP;
+    return create_ast_node(p->program, type, op, NULL, left, right, NULL);
 }
 
-static ASTNode *parse_assignment() {
-    ASTNode *left = parse_bitwise_or();
-    
-    TokenType t = current_token_type();
-    if (t == TOKEN_EQUAL || 
-        t == TOKEN_PLUS_EQ || t == TOKEN_MINUS_EQ ||
-        t == TOKEN_STAR_EQ || t == TOKEN_SLASH_EQ ||
-        t == TOKEN_PIPE_EQ || t == TOKEN_AMPERSAND_EQ ||
-        t == TOKEN_CARET_EQ || t == TOKEN_TILDE_EQ) {
-        
-        advance();
-        ASTNode *right = parse_assignment();
-        
-        if (t == TOKEN_EQUAL) {
-            return create_ast_node(AST_ASSIGNMENT, t, NULL, left, right, NULL);
-        } else {
-            return create_ast_node(AST_COMPOUND_ASSIGN, t, NULL, left, right, NULL);
-        }
+// Операнд из одного литерала или имени, за которым нет оператора сильнее
+// min_power, - самый частый случай; он разбирается сразу, без кадра.
+// NULL, если операнд сложнее
+static ASTNode *parse_simple_operand(Parser *p, int min_power) {
+    TokenType type = current_token_type(p);
+    bool literal = type == TOKEN_INT || type == TOKEN_REAL || type == TOKEN_CHAR || type == TOKEN_STRING;
+    if (literal) current_token_text(p);  // До просмотра вперёд
+    TokenType next = next_token_type(p);
+    if (operators[next].power > min_power) return NULL;
+    if (type == TOKEN_ID && next != TOKEN_LPAREN) {
+        uint32_t name = current_token_symbol(p);
+        advance(p);
+        return create_named_node(p->program, AST_IDENTIFIER, TOKEN_ID, name, NULL, NULL);
+    }
+    if (literal) {
+        char *value = current_token_text(p);
+        advance(p);
+        return create_ast_node(p->program, AST_LITERAL, type, value, NULL, NULL, NULL);
     }
-    return left;
+    return NULL;
 }
 
-// Побитовое ИЛИ
-static ASTNode *parse_bitwise_or() {
-    ASTNode *node = parse_bitwise_xor();
-    while (current_token_type() == TOKEN_PIPE) {
-        TokenType op = current_token_type();
-        advance();
-        ASTNode *right = parse_bitwise_xor();
-        node = create_ast_node(AST_BINARY_OP, op, NULL, node, right, NULL);
-    }
-    return node;
+// Разбор без рекурсии: каждая незаконченная конструкция (оператор, блок,
+// выражение) - кадр на стеке Parser.frames в куче, а не вызов функции.
+// Кадр помнит шаг, на котором он ждёт узел вложенной конструкции, и уже
+// собранные части. Стек глубже max_depth кадров - ошибка разбора, а не
+// переполнение стека потока
+typedef enum {
+    FRAME_STATEMENT,
+    FRAME_BLOCK,
+    FRAME_EXPRESSION
+} FrameKind;
+
+typedef enum {
+    STEP_START,
+
+    // Операторы
+    STEP_VARIABLE_INIT,
+    STEP_IF_CONDITION,
+    STEP_IF_BLOCK,
+    STEP_ELIF_CONDITION,
+    STEP_ELIF_BLOCK,
+    STEP_ELSE_BLOCK,
+    STEP_FUNCTION_ARGUMENTS,
+    STEP_FUNCTION_BODY,
+
+    // Блоки
+    STEP_BLOCK_STATEMENT,     // Очередной оператор блока в { }
+    STEP_SINGLE_STATEMENT,    // Однострочный блок
+
+    // Выражения
+    STEP_PREFIX_OPERAND,
+    STEP_INFIX_OPERAND,
+    STEP_CONDITIONAL_THEN,
+    STEP_CONDITIONAL_ELSE,
+    STEP_PARENTHESES,
+    STEP_CALL_ARGUMENTS
+} FrameStep;
+
+typedef struct {
+    uint8_t kind;               // FrameKind
+    uint8_t step;               // FrameStep
+    uint8_t min_power;          // Выражение забирает только операторы сильнее
+    bool start_function;
+    bool expression_statement;  // Выражение-оператор: в конце ;
+    TokenType op;               // Оператор, ждущий операнда
+    uint32_t symbol;            // Имя переменной, функции или вызова
+    char *type;                 // Тип объявляемой переменной
+    ASTNode *left;              // Левый операнд, условие if или узел блока
+    ASTNode *middle;            // Блок if, ветвь после ? или аргументы функции
+    ASTNode *condition;         // Условие текущего elif
+    ASTNode *elif_chain;
+} ParseFrame;
+
+// Новый кадр на вершине стека. Указатели на кадры после вызова
+// недействительны. Сверх max_depth кадр всё равно кладётся: после ошибки
+// разбор видит конец входа и сворачивается за несколько шагов
+static inline void push_frame(Parser *p, FrameKind kind, int min_power) {
+    if (p->frames.count >= p->max_depth) error(p, "Nesting too deep");
+    ParseFrame *frame = work_push(&p->frames, sizeof(ParseFrame));
+    frame->kind = kind;
+    frame->step = STEP_START;
+    frame->min_power = (uint8_t)min_power;
+    frame->start_function = false;
+    frame->expression_statement = false;
+    // Остальные поля пишутся раньше, чем читаются
+    frame->left = NULL;
+    frame->middle = NULL;
+    frame->elif_chain = NULL;
 }
 
-// Побитовое XOR
-static ASTNode *parse_bitwise_xor() {
-    ASTNode *node = parse_bitwise_and();
-    while (current_token_type() == TOKEN_CARET) {
-        TokenType op = current_token_type();
-        advance();
-        ASTNode *right = parse_bitwise_and();
-        node = create_ast_node(AST_BINARY_OP, op, NULL, node, right, NULL);
-    }
+// Снимает кадр с вершины; node - узел его конструкции
+static ASTNode *finish_frame(Parser *p, ASTNode *node) {
+    p->frames.count--;
     return node;
 }
 
-// Побитовое И
-static ASTNode *parse_bitwise_and() {
-    ASTNode *node = parse_equality();
-    while (current_token_type() == TOKEN_AMPERSAND) {
-        TokenType op = current_token_type();
-        advance();
-        ASTNode *right = parse_equality();
-        node = create_ast_node(AST_BINARY_OP, op, NULL, node, right, NULL);
-    }
-    return node;
+static ASTNode *finish_variable_decl(Parser *p, ParseFrame *frame, ASTNode *init) {
+    expect(p, TOKEN_SEMICOLON);
+    ASTNode *decl = create_named_node(p->program, AST_VARIABLE_DECL, 0, frame->symbol, init, NULL);
+    decl->value = frame->type;
+    return finish_frame(p, decl);
 }
 
-// Операции сравнения (==, !=)
-static ASTNode *parse_equality() {
-    ASTNode *node = parse_relational();
-    while (current_token_type() == TOKEN_DOUBLE_EQ || 
-           current_token_type() == TOKEN_NE) {
-        TokenType op = current_token_type();
-        advance();
-        ASTNode *right = parse_relational();
-        node = create_ast_node(AST_BINARY_OP, op, NULL, node, right, NULL);
-    }
-    return node;
+static ASTNode *finish_if(Parser *p, ParseFrame *frame, ASTNode *else_node) {
+    ASTNode *branches = create_ast_node(p->program, AST_ELSE, 0, NULL, else_node, frame->elif_chain, NULL);
+    return finish_frame(p, create_ast_node(p->program, AST_IF, 0, NULL, frame->left, frame->middle, branches));
 }
 
-// Операции сравнения (<, >, <=, >=)
-static ASTNode *parse_relational() {
-    ASTNode *node = parse_shift();
-    while (current_token_type() == TOKEN_LT || 
-           current_token_type() == TOKEN_GT ||
-           current_token_type() == TOKEN_LE ||
-           current_token_type() == TOKEN_GE) {
-        TokenType op = current_token_type();
-        advance();
-        ASTNode *right = parse_shift();
-        node = create_ast_node(AST_BINARY_OP, op, NULL, node, right, NULL);
+// Отложенные блоки (parse_parallel). Предпроход находит пары { }; скелет
+// разбирает вход, но блок в паре размером от PARSE_MIN_BLOCK_TOKENS до
+// grain токенов перескакивает: в дерево встаёт пустой узел блока, а сам
+// блок становится задачей. Блок крупнее grain скелет разбирает сам, чтобы
+// отложить его вложенные блоки. Потоки разбирают задачи, операторы
+// разобранного блока переходят в узел скелета
+typedef struct {
+    size_t open;   // Индекс {
+    size_t close;  // Индекс парной }; SIZE_MAX - пары нет
+} BracePair;
+
+typedef struct {
+    size_t open;
+    size_t close;
+    size_t depth;   // Кадры скелета под кадром блока
+    ASTNode *node;   // Узел блока в скелете
+    ASTNode *block;  // Узел, разобранный потоком
+} DeferredBlock;
+
+struct BlockPlan {
+    WorkStack braces;   // BracePair по возрастанию open
+    size_t next_brace;  // Первая пара, которую скелет ещё не прошёл
+    size_t grain;       // Наибольший откладываемый блок, токенов
+    WorkStack blocks;   // DeferredBlock в порядке исходника
+};
+
+// Блоки короче не стоят отдельной задачи и разбираются в скелете. grain
+// делит вход примерно на PARSE_BLOCKS_PER_JOB задач на поток
+#ifndef PARSE_MIN_BLOCK_TOKENS
+#define PARSE_MIN_BLOCK_TOKENS 512
+#endif
+#ifndef PARSE_BLOCKS_PER_JOB
+#define PARSE_BLOCKS_PER_JOB 8
+#endif
+
+// Блок в { } на текущем токене (кадр блока на вершине стека) откладывается
+// в задачу; NULL, если его надо разобрать здесь
+static ASTNode *defer_block(Parser *p) {
+    struct BlockPlan *plan = p->plan;
+    if (p->failed) return NULL;
+    const BracePair *braces = plan->braces.items;
+    size_t index = p->current_token_index;
+    while (plan->next_brace < plan->braces.count && braces[plan->next_brace].open < index) {
+        plan->next_brace++;
+    }
+    if (plan->next_brace == plan->braces.count || braces[plan->next_brace].open != index) return NULL;
+    BracePair pair = braces[plan->next_brace];
+    if (pair.close == SIZE_MAX || pair.close - pair.open < PARSE_MIN_BLOCK_TOKENS ||
+        pair.close - pair.open > plan->grain) {
+        return NULL;
     }
+
+    ASTNode *node = create_ast_node(p->program, AST_BLOCK, 0, NULL, NULL, NULL, NULL);
+    DeferredBlock *block = work_push(&plan->blocks, sizeof(DeferredBlock));
+    block->open = pair.open;
+    block->close = pair.close;
+    block->depth = p->frames.count - 1;
+    block->node = node;
+    block->block = NULL;
+    p->current_token_index = pair.close + 1;
+    p->current_text = NULL;
     return node;
 }
 
-// Побитовые сдвиги
-static ASTNode *parse_shift() {
-    ASTNode *node = parse_additive();
-    while (current_token_type() == TOKEN_SHL || 
-           current_token_type() == TOKEN_SHR ||
-           current_token_type() == TOKEN_SAL || 
-           current_token_type() == TOKEN_SAR ||
-           current_token_type() == TOKEN_ROL || 
-           current_token_type() == TOKEN_ROR) {
-        TokenType op = current_token_type();
-        advance();
-        ASTNode *right = parse_additive();
-        node = create_ast_node(AST_BINARY_OP, op, NULL, node, right, NULL);
+// Шаг оператора: объявление, if/elif/else, функция или выражение с ;
+static ASTNode *statement_step(Parser *p, ParseFrame *frame, ASTNode *result) {
+    switch ((FrameStep)frame->step) {
+        case STEP_START:
+            if (input_exhausted(p)) error(p, "Unexpected end of input");
+
+            switch (current_token_type(p)) {
+                case TOKEN_DOLLAR:
+                    // Имя переменной хранится номером символа, тип - текстом
+                    advance(p);  // Пропускаем $
+                    frame->symbol = current_token_symbol(p);
+                    expect(p, TOKEN_ID);
+                    expect(p, TOKEN_COLON);
+                    frame->type = current_token_text(p);
+                    expect(p, TOKEN_TYPE);
+                    if (current_token_type(p) != TOKEN_EQUAL) return finish_variable_decl(p, frame, NULL);
+                    advance(p);
+                    frame->step = STEP_VARIABLE_INIT;
+                    push_frame(p, FRAME_EXPRESSION, POWER_NONE);
+                    return NULL;
+
+                case TOKEN_IF:
+                    advance(p);  // Пропускаем if
+                    frame->step = STEP_IF_CONDITION;
+                    push_frame(p, FRAME_EXPRESSION, POWER_NONE);
+                    return NULL;
+
+                case TOKEN_DOUBLE_UNDERSCORE:
+                case TOKEN_UNDERSCORE:
+                    if (current_token_type(p) == TOKEN_DOUBLE_UNDERSCORE) {
+                        frame->start_function = true;
+                        advance(p);
+                    }
+                    if (current_token_type(p) != TOKEN_ID) {
+                        error(p, "Expected function name");
+                    }
+                    frame->symbol = current_token_symbol(p);
+                    advance(p);  // Пропускаем имя функции
+
+                    if (current_token_type(p) == TOKEN_LPAREN) {
+                        advance(p);  // Пропускаем (
+                        if (current_token_type(p) != TOKEN_RPAREN) {
+                            frame->step = STEP_FUNCTION_ARGUMENTS;
+                            push_frame(p, FRAME_EXPRESSION, POWER_NONE);
+                            return NULL;
+                        }
+                        expect(p, TOKEN_RPAREN);
+                    }
+                    frame->step = STEP_FUNCTION_BODY;
+                    push_frame(p, FRAME_BLOCK, POWER_NONE);
+                    return NULL;
+
+                default:
+                    // Выражение-оператор разбирается в этом же кадре
+                    frame->kind = FRAME_EXPRESSION;
+                    frame->expression_statement = true;
+                    return NULL;
+            }
+
+        case STEP_VARIABLE_INIT:
+            return finish_variable_decl(p, frame, result);
+
+        case STEP_IF_CONDITION:
+            frame->left = result;
+            frame->step = STEP_IF_BLOCK;
+            push_frame(p, FRAME_BLOCK, POWER_NONE);
+            return NULL;
+
+        case STEP_ELIF_CONDITION:
+            frame->condition = result;
+            frame->step = STEP_ELIF_BLOCK;
+            push_frame(p, FRAME_BLOCK, POWER_NONE);
+            return NULL;
+
+        case STEP_IF_BLOCK:
+        case STEP_ELIF_BLOCK:
+            if (frame->step == STEP_IF_BLOCK) {
+                frame->middle = result;
+            } else {
+                frame->elif_chain = create_ast_node(p->program, AST_ELIF, 0, NULL, frame->condition, result,
+                                                    frame->elif_chain);
+            }
+            if (current_token_type(p) == TOKEN_ELIF) {
+                advance(p);  // Пропускаем elif
+                frame->step = STEP_ELIF_CONDITION;
+                push_frame(p, FRAME_EXPRESSION, POWER_NONE);
+                return NULL;
+            }
+            if (current_token_type(p) == TOKEN_ELSE) {
+                advance(p);  // Пропускаем else
+                frame->step = STEP_ELSE_BLOCK;
+                push_frame(p, FRAME_BLOCK, POWER_NONE);
+                return NULL;
+            }
+            return finish_if(p, frame, NULL);
+
+        case STEP_ELSE_BLOCK:
+            return finish_if(p, frame, result);
+
+        case STEP_FUNCTION_ARGUMENTS:
+            frame->middle = result;
+            expect(p, TOKEN_RPAREN);
+            frame->step = STEP_FUNCTION_BODY;
+            push_frame(p, FRAME_BLOCK, POWER_NONE);
+            return NULL;
+
+        case STEP_FUNCTION_BODY:
+            // Стартовая функция может быть только одна
+            if (frame->start_function) {
+                if (p->start_function_declared) {
+                    error(p, "Only one start function allowed");
+                }
+                p->start_function_declared = 1;
+            }
+            return finish_frame(p, create_named_node(p->program,
+                                                     frame->start_function ? AST_START_FUNCTION : AST_FUNCTION,
+                                                     0, frame->symbol, frame->middle, result));
+
+        default:
+            return NULL;
     }
-    return node;
 }
 
-// Сложение/вычитание
-static ASTNode *parse_additive() {
-    ASTNode *node = parse_multiplicative();
-    while (current_token_type() == TOKEN_PLUS || 
-           current_token_type() == TOKEN_MINUS) {
-        TokenType op = current_token_type();
-        advance();
-        ASTNode *right = parse_multiplicative();
-        node = create_ast_node(AST_BINARY_OP, op, NULL, node, right, NULL);
+// Шаг блока: { операторы } или один оператор
+static ASTNode *block_step(Parser *p, ParseFrame *frame, ASTNode *result) {
+    switch ((FrameStep)frame->step) {
+        case STEP_START:
+            if (current_token_type(p) != TOKEN_LCURLY) {
+                frame->step = STEP_SINGLE_STATEMENT;
+                push_frame(p, FRAME_STATEMENT, POWER_NONE);
+                return NULL;
+            }
+            if (p->plan) {
+                ASTNode *deferred = defer_block(p);
+                if (deferred) return finish_frame(p, deferred);
+            }
+            advance(p);  // Пропускаем {
+            frame->left = create_ast_node(p->program, AST_BLOCK, 0, NULL, NULL, NULL, NULL);
+            frame->left->extra = (ASTNode*)create_block(p->program);  // Храним блок как под-AST
+            break;
+
+        case STEP_BLOCK_STATEMENT:
+            add_ast_node(p->program, (AST*)frame->left->extra, result);
+            break;
+
+        case STEP_SINGLE_STATEMENT:
+            return finish_frame(p, create_ast_node(p->program, AST_BLOCK, 0, NULL, result, NULL, NULL));
+
+        default:
+            return NULL;
     }
-    return node;
-}
 
-// Умножение/деление
-static ASTNode *parse_multiplicative() {
-    ASTNode *node = parse_unary();
-    while (current_token_type() == TOKEN_STAR || 
-           current_token_type() == TOKEN_SLASH) {
-        TokenType op = current_token_type();
-        advance();
-        ASTNode *right = parse_unary();
-        node = create_ast_node(AST_BINARY_OP, op, NULL, node, right, NULL);
+    if (current_token_type(p) != TOKEN_RCURLY && current_token_type(p) != TOKEN_EOF) {
+        frame->step = STEP_BLOCK_STATEMENT;
+        push_frame(p, FRAME_STATEMENT, POWER_NONE);
+        return NULL;
     }
-    return node;
+    expect(p, TOKEN_RCURLY);
+    return finish_frame(p, frame->left);
 }
 
-// Унарные операции
-static ASTNode *parse_unary() {
-    TokenType t = current_token_type();
-    if (t == TOKEN_PLUS || t == TOKEN_MINUS || 
-        t == TOKEN_BANG || t == TOKEN_TILDE) {
-        advance();
-        ASTNode *operand = parse_unary();
-        return create_ast_node(AST_UNARY_OP, t, NULL, NULL, operand, NULL);
-    }
-    return parse_primary();
-}
-
-// Первичные выражения
-static ASTNode *parse_primary() {
-    Token *t = current_token();
-    switch (t->type) {
-        case TOKEN_INT:
-        case TOKEN_REAL:
-        case TOKEN_CHAR:
-        case TOKEN_STRING: {
-            char *value = strdup(t->value);
-            advance();
-            return create_ast_node(AST_LITERAL, t->type, value, NULL, NULL, NULL);
-        }
-        case TOKEN_ID: {
-            char *value = strdup(t->value);
-            advance();
-            
-            // Проверка на вызов функции
-            if (current_token_type() == TOKEN_LPAREN) {
-                advance();  // Пропускаем (
-                ASTNode *args = NULL;
-                if (current_token_type() != TOKEN_RPAREN) {
-                    args = parse_expression();  // Аргументы
+// Шаг выражения: первичное выражение или префиксная операция, затем цикл
+// Пратта по операторам сильнее min_power кадра
+static ASTNode *expression_step(Parser *p, ParseFrame *frame, ASTNode *result) {
+    switch ((FrameStep)frame->step) {
+        case STEP_START: {
+            // Операнд из одного литерала или имени берётся без своего кадра
+            TokenType type = current_token_type(p);
+            ASTNode *operand = NULL;
+            switch (type) {
+                case TOKEN_PLUS:
+                case TOKEN_MINUS:
+                case TOKEN_BANG:
+                case TOKEN_TILDE:
+                case TOKEN_DOUBLE_PLUS:
+                case TOKEN_DOUBLE_MINUS:
+                    advance(p);
+                    operand = parse_simple_operand(p, POWER_PREFIX);
+                    if (operand) {
+                        frame->left = create_ast_node(p->program, AST_UNARY_OP, type, NULL, NULL, operand, NULL);
+                        break;
+                    }
+                    frame->op = type;
+                    frame->step = STEP_PREFIX_OPERAND;
+                    push_frame(p, FRAME_EXPRESSION, POWER_PREFIX);
+                    return NULL;
+
+                case TOKEN_INT:
+                case TOKEN_REAL:
+                case TOKEN_CHAR:
+                case TOKEN_STRING: {
+                    char *value = current_token_text(p);
+                    advance(p);
+                    frame->left = create_ast_node(p->program, AST_LITERAL, type, value, NULL, NULL, NULL);
+                    break;
                 }
-                expect(TOKEN_RPAREN);
-                return create_ast_node(AST_FUNCTION_CALL, 0, value, args, NULL, NULL);
+
+                case TOKEN_ID:
+                    frame->symbol = current_token_symbol(p);
+                    advance(p);
+                    if (current_token_type(p) != TOKEN_LPAREN) {
+                        frame->left = create_named_node(p->program, AST_IDENTIFIER, TOKEN_ID, frame->symbol, NULL, NULL);
+                        break;
+                    }
+                    // Вызов функции
+                    advance(p);  // Пропускаем (
+                    if (current_token_type(p) != TOKEN_RPAREN) {
+                        operand = parse_simple_operand(p, POWER_NONE);
+                        if (!operand) {
+                            frame->step = STEP_CALL_ARGUMENTS;
+                            push_frame(p, FRAME_EXPRESSION, POWER_NONE);
+                            return NULL;
+                        }
+                    }
+                    expect(p, TOKEN_RPAREN);
+                    frame->left = create_named_node(p->program, AST_FUNCTION_CALL, 0, frame->symbol, operand, NULL);
+                    break;
+
+                case TOKEN_LPAREN:
+                    advance(p);
+                    operand = parse_simple_operand(p, POWER_NONE);
+                    if (operand) {
+                        expect(p, TOKEN_RPAREN);
+                        frame->left = operand;
+                        break;
+                    }
+                    frame->step = STEP_PARENTHESES;
+                    push_frame(p, FRAME_EXPRESSION, POWER_NONE);
+                    return NULL;
+
+                default:
+                    error(p, "Unexpected token in expression");
+                    break;
             }
-            return create_ast_node(AST_IDENTIFIER, TOKEN_ID, value, NULL, NULL, NULL);
-        }
-        case TOKEN_LPAREN: {
-            advance();
-            ASTNode *expr = parse_expression();
-            expect(TOKEN_RPAREN);
-            return expr;
+            break;
         }
+
+        case STEP_PREFIX_OPERAND:
+            frame->left = create_ast_node(p->program, AST_UNARY_OP, frame->op, NULL, NULL, result, NULL);
+            break;
+
+        case STEP_CALL_ARGUMENTS:
+            expect(p, TOKEN_RPAREN);
+            frame->left = create_named_node(p->program, AST_FUNCTION_CALL, 0, frame->symbol, result, NULL);
+            break;
+
+        case STEP_PARENTHESES:
+            expect(p, TOKEN_RPAREN);
+            frame->left = result;
+            break;
+
+        case STEP_INFIX_OPERAND:
+            frame->left = create_infix_node(p, frame->op, frame->left, result);
+            break;
+
+        case STEP_CONDITIONAL_THEN:
+            frame->middle = result;
+            expect(p, TOKEN_COLON);
+            frame->step = STEP_CONDITIONAL_ELSE;
+            push_frame(p, FRAME_EXPRESSION, operand_power(&operators[TOKEN_QUESTION]));
+            return NULL;
+
+        case STEP_CONDITIONAL_ELSE:
+            frame->left = create_ast_node(p->program, AST_CONDITIONAL, 0, NULL, frame->left, frame->middle, result);
+            break;
+
         default:
-            error("Unexpected token in expression");
             return NULL;
     }
+
+    for (;;) {
+        TokenType op = current_token_type(p);
+        const Operator *info = &operators[op];
+        if (info->power <= frame->min_power) {
+            if (frame->expression_statement) expect(p, TOKEN_SEMICOLON);
+            return finish_frame(p, frame->left);
+        }
+        advance(p);
+
+        if (info->kind == OPERATOR_POSTFIX) {
+            frame->left = create_ast_node(p->program, AST_POSTFIX_OP, op, NULL, frame->left, NULL, NULL);
+            continue;
+        }
+        frame->op = op;
+        if (info->kind == OPERATOR_CONDITIONAL) {
+            // Между ? и : - любое выражение
+            frame->step = STEP_CONDITIONAL_THEN;
+            push_frame(p, FRAME_EXPRESSION, POWER_NONE);
+            return NULL;
+        }
+        ASTNode *right = parse_simple_operand(p, operand_power(info));
+        if (right) {
+            frame->left = create_infix_node(p, op, frame->left, right);
+            continue;
+        }
+        frame->step = STEP_INFIX_OPERAND;
+        push_frame(p, FRAME_EXPRESSION, operand_power(info));
+        return NULL;
+    }
 }
 
-// Парсинг объявления переменной
-static ASTNode *parse_variable_decl() {
-    advance();  // Пропускаем $
-    Token *id_token = current_token();
-    expect(TOKEN_ID);
-    
-    expect(TOKEN_COLON);
-    
-    Token *type_token = current_token();
-    expect(TOKEN_TYPE);
+// Разбор до опустошения стека кадров. Шаг вершины стека получает узел
+// последнего снятого кадра; пустой стек - конструкция нижнего кадра
+// разобрана
+static ASTNode *run_frames(Parser *p) {
+    ASTNode *result = NULL;
+    while (p->frames.count) {
+        ParseFrame *frame = WORK_TOP(&p->frames, ParseFrame);
+        switch ((FrameKind)frame->kind) {
+            case FRAME_STATEMENT:
+                result = statement_step(p, frame, result);
+                break;
+            case FRAME_BLOCK:
+                result = block_step(p, frame, result);
+                break;
+            case FRAME_EXPRESSION:
+                result = expression_step(p, frame, result);
+                break;
+        }
+    }
+    return result;
+}
+
+// Оператор верхнего уровня
+static ASTNode *parse_statement(Parser *p) {
+    push_frame(p, FRAME_STATEMENT, POWER_NONE);
+    return run_frames(p);
+}
+
+// Основная функция парсинга (дополненная инициализация AST). При ошибке
+// разбора недостроенное AST освобождается, результат - NULL
+static AST *parse_program(Parser *p) {
+    AST *ast = create_program(p->symbols);
+    p->program = ast;
+    if (!p->max_depth) p->max_depth = PARSE_DEFAULT_MAX_DEPTH;
     
-    // Сохраняем имя и тип
-    char *decl = malloc(strlen(id_token->value) + strlen(type_token->value) + 4);
-    sprintf(decl, "%s:%s", id_token->value, type_token->value);
+    while (current_token_type(p) != TOKEN_EOF) {
+        ASTNode *node = parse_statement(p);
+        add_ast_node(ast, ast, node);
+    }
+    free(p->frames.items);
     
-    // Проверка инициализации
-    ASTNode *init = NULL;
-    if (current_token_type() == TOKEN_EQUAL) {
-        advance();
-        init = parse_expression();
+    // Отложенные блоки ещё могут объявить стартовую функцию
+    if (!p->start_function_declared && !p->plan) {
+        error(p, "Start function not declared");
     }
     
-    expect(TOKEN_SEMICOLON);
-    return create_ast_node(AST_VARIABLE_DECL, 0, decl, init, NULL, NULL);
+    if (p->failed) {
+        free_ast(ast);
+        return NULL;
+    }
+    return ast;
 }
 
-// Парсинг операторов
-static ASTNode *parse_statement() {
-    Token *t = current_token();
-    if (!t) error("Unexpected end of input");
-    
-    switch (t->type) {
-        case TOKEN_DOLLAR:
-            return parse_variable_decl();
-            
-        case TOKEN_IF:
-            return parse_if_statement();
-            
-        case TOKEN_DOUBLE_UNDERSCORE:
-        case TOKEN_UNDERSCORE:
-            return parse_function();
-            
-        default: {
-            ASTNode *expr = parse_expression();
-            expect(TOKEN_SEMICOLON);
-            return expr;
+static void init_buffer_parser(Parser *p, const TokenBuffer *tokens, FILE *errors, size_t max_depth) {
+    p->tokens = tokens;
+    p->token_end = tokens->count;
+    p->symbols = tokens->symbol_table;
+    p->diagnostics = errors;
+    p->max_depth = max_depth;
+}
+
+// Разбор готового буфера токенов
+AST *parse(const TokenBuffer *tokens) {
+    Parser parser = { 0 };
+    init_buffer_parser(&parser, tokens, stderr, 0);
+    return parse_program(&parser);
+}
+
+// Разбор с лексированием по ходу: в памяти только окно просмотра вперёд
+// лексера, а не весь поток токенов
+AST *parse_lexer(Lexer *lexer) {
+    return parse_lexer_checked(lexer, stderr, 0);
+}
+
+// То же, но сообщение об ошибке разбора пишется в errors, а вложенность
+// ограничена max_depth кадрами (0 - PARSE_DEFAULT_MAX_DEPTH)
+AST *parse_lexer_checked(Lexer *lexer, FILE *errors, size_t max_depth) {
+    Parser parser = { 0 };
+    parser.source = lexer;
+    parser.symbols = lexer->tokens.symbol_table;
+    parser.diagnostics = errors;
+    parser.max_depth = max_depth;
+    parser.at_end = !lexer_next(lexer, &parser.current);
+    return parse_program(&parser);
+}
+
+#ifdef PAXSI_HAVE_THREADS
+// Пары { } стеком открытых скобок. Пара записывается при {, поэтому пары
+// идут по возрастанию open. Лишняя } пропускается, у незакрытой { пары нет.
+// Пара - только догадка: блок принимается, если его разбор кончился ровно
+// на её }
+static void match_braces(const TokenBuffer *tokens, WorkStack *braces) {
+    WorkStack open = { 0 };  // Номера пар незакрытых {
+    for (size_t i = 0; i < tokens->count; i++) {
+        TokenType type = (TokenType)tokens->kinds[i];
+        if (type == TOKEN_LCURLY) {
+            *(size_t*)work_push(&open, sizeof(size_t)) = braces->count;
+            BracePair *pair = work_push(braces, sizeof(BracePair));
+            pair->open = i;
+            pair->close = SIZE_MAX;
+        } else if (type == TOKEN_RCURLY && open.count) {
+            ((BracePair*)braces->items)[*WORK_TOP(&open, size_t)].close = i;
+            open.count--;
         }
     }
+    free(open.items);
 }
 
-// Основная функция парсинга (дополненная инициализация AST)
-AST *parse(Token *input_tokens, int input_token_count) {
-    tokens = input_tokens;
-    token_count = input_token_count;
-    current_token_index = 0;
-    start_function_declared = 0;
+// Общая очередь задач: потоки берут блоки по одному в порядке исходника
+typedef struct {
+    const TokenBuffer *tokens;
+    DeferredBlock *blocks;
+    size_t count;
+    size_t next;       // Первый невзятый блок
+    bool failed;       // Блок не разобрался: остальные уже не нужны
+    size_t max_depth;
+    pthread_mutex_t lock;
+} BlockQueue;
 
-    AST *ast = malloc(sizeof(AST));
-    if (!ast) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+typedef struct {
+    BlockQueue *queue;
+    AST *owner;           // Арена узлов, созданных этим потоком
+    int start_functions;  // Стартовые функции внутри разобранных блоков
+} BlockWorker;
+
+static DeferredBlock *take_block(BlockQueue *queue) {
+    DeferredBlock *block = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->failed && queue->next < queue->count) block = &queue->blocks[queue->next++];
+    pthread_mutex_unlock(&queue->lock);
+    return block;
+}
+
+// Разбор блоков из очереди тихим парсером, ограниченным токенами блока.
+// Вложенность считается вместе с кадрами скелета под блоком
+static void *parse_blocks(void *argument) {
+    BlockWorker *worker = argument;
+    BlockQueue *queue = worker->queue;
+    Parser parser = { 0 };
+    init_buffer_parser(&parser, queue->tokens, NULL, 0);
+    parser.program = worker->owner;
+
+    DeferredBlock *block;
+    while ((block = take_block(queue))) {
+        parser.current_token_index = block->open;
+        parser.current_text = NULL;
+        parser.token_end = block->close + 1;
+        parser.max_depth = queue->max_depth - block->depth;
+        parser.start_function_declared = 0;
+        push_frame(&parser, FRAME_BLOCK, POWER_NONE);
+        block->block = run_frames(&parser);
+        worker->start_functions += parser.start_function_declared;
+        if (parser.failed || parser.current_token_index != parser.token_end) {
+            pthread_mutex_lock(&queue->lock);
+            queue->failed = true;
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
     }
-    ast->nodes = NULL;
-    ast->count = 0;
-    ast->capacity = 0;
-    
-    while (current_token_type() != TOKEN_EOF) {
-        ASTNode *node = parse_statement();
-        add_ast_node(ast, node);
+    free(parser.frames.items);
+    return NULL;
+}
+
+// Скелет и отложенные блоки на `jobs` потоках; NULL, если разбор не
+// удался или стартовых функций не ровно одна
+static AST *parse_skeleton_and_blocks(const TokenBuffer *tokens, size_t jobs, size_t max_depth) {
+    struct BlockPlan plan = { 0 };
+    match_braces(tokens, &plan.braces);
+    plan.grain = tokens->count / (jobs * PARSE_BLOCKS_PER_JOB);
+
+    Parser skeleton = { 0 };
+    init_buffer_parser(&skeleton, tokens, NULL, max_depth);
+    skeleton.plan = &plan;
+    AST *ast = parse_program(&skeleton);
+    free(plan.braces.items);
+
+    DeferredBlock *blocks = plan.blocks.items;
+    size_t count = plan.blocks.count;
+    int start_functions = skeleton.start_function_declared;
+    bool parsed = ast != NULL;
+    if (parsed && count) {
+        BlockQueue queue = { 0 };
+        queue.tokens = tokens;
+        queue.blocks = blocks;
+        queue.count = count;
+        queue.max_depth = max_depth;
+        pthread_mutex_init(&queue.lock, NULL);
+
+        if (jobs > count) jobs = count;
+        BlockWorker *workers = calloc(jobs, sizeof(BlockWorker));
+        pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+        bool *started = calloc(jobs, sizeof(bool));
+        if (!workers || !threads || !started) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < jobs; i++) {
+            workers[i].queue = &queue;
+            workers[i].owner = create_program(tokens->symbol_table);
+        }
+        for (size_t i = 1; i < jobs; i++) {
+            started[i] = pthread_create(&threads[i], NULL, parse_blocks, &workers[i]) == 0;
+        }
+        parse_blocks(&workers[0]);
+
+        // Арены потоков переходят к AST, даже если разбор не удался: их
+        // освободит free_ast
+        for (size_t i = 0; i < jobs; i++) {
+            if (started[i]) pthread_join(threads[i], NULL);
+            AST *owner = workers[i].owner;
+            if (owner->arena) {
+                struct ASTChunk *last = owner->arena;
+                while (last->next) last = last->next;
+                last->next = ast->arena;
+                ast->arena = owner->arena;
+                owner->arena = NULL;
+            }
+            free_ast(owner);
+            start_functions += workers[i].start_functions;
+        }
+        pthread_mutex_destroy(&queue.lock);
+        free(started);
+        free(threads);
+        free(workers);
+
+        parsed = !queue.failed;
+        if (parsed) {
+            for (size_t i = 0; i < count; i++) blocks[i].node->extra = blocks[i].block->extra;
+        }
     }
-    
-    if (!start_function_declared) {
-        error("Start function not declared");
+    free(blocks);
+
+    if (parsed && start_functions == 1) return ast;
+    free_ast(ast);
+    return NULL;
+}
+#endif
+
+// Разбор буфера токенов на `jobs` потоках: скелет разбирает вход, крупные
+// блоки в { } разбираются отдельными задачами. AST то же, что у parse. При
+// ошибке или не одной стартовой функции буфер разбирается заново
+// последовательно: диагностика (в errors) и проверка стартовой функции те
+// же, что без потоков
+AST *parse_parallel(const TokenBuffer *tokens, int jobs, FILE *errors, size_t max_depth) {
+    if (!max_depth) max_depth = PARSE_DEFAULT_MAX_DEPTH;
+#ifdef PAXSI_HAVE_THREADS
+    if (jobs > 1) {
+        AST *ast = parse_skeleton_and_blocks(tokens, (size_t)jobs, max_depth);
+        if (ast) return ast;
     }
-    
-    return ast;
+#else
+    (void)jobs;
+#endif
+    Parser parser = { 0 };
+    init_buffer_parser(&parser, tokens, errors, max_depth);
+    return parse_program(&parser);
 }
 
-// Освобождение памяти AST-узла (с учетом новых типов)
-void free_ast_node(ASTNode *node) {
-    if (!node) return;
+// Слоты, которые печатает узел каждого типа; многострочный блок печатает
+// свои операторы. Инициализатор объявления не печатается
+static const uint8_t printed_slots[AST_NODE_TYPE_COUNT] = {
+    [AST_VARIABLE_DECL]   = 0,
+    [AST_ASSIGNMENT]      = FLAT_LEFT | FLAT_RIGHT,
+    [AST_COMPOUND_ASSIGN] = FLAT_LEFT | FLAT_RIGHT,
+    [AST_BINARY_OP]       = FLAT_LEFT | FLAT_RIGHT,
+    [AST_UNARY_OP]        = FLAT_RIGHT,
+    [AST_LITERAL]         = 0,
+    [AST_IDENTIFIER]      = 0,
+    [AST_IF]              = ALL_SLOTS,   // Условие, блок if, else/elif
+    [AST_ELIF]            = ALL_SLOTS,   // Условие, блок elif, следующий elif
+    [AST_ELSE]            = FLAT_LEFT,   // Блок else
+    [AST_BLOCK]           = FLAT_LEFT,   // Однострочный блок
+    [AST_FUNCTION]        = FLAT_LEFT | FLAT_RIGHT,  // Аргументы, тело
+    [AST_FUNCTION_CALL]   = FLAT_LEFT,   // Аргументы
+    [AST_START_FUNCTION]  = FLAT_LEFT | FLAT_RIGHT,
+    [AST_CONDITIONAL]     = ALL_SLOTS,   // Условие, если истинно, если ложно
+    [AST_POSTFIX_OP]      = FLAT_LEFT,
+};
+
+// Строка одного узла с отступом, без потомков
+static void print_node_line(FILE *out, const SymbolTable *symbols, const ASTNode *node, int indent) {
+    for (int i = 0; i < indent; i++) fputs("  ", out);
     
     switch (node->type) {
-        case AST_BLOCK:
-            if (node->extra) {
-                AST *block_ast = (AST*)node->extra;
-                for (int i = 0; i < block_ast->count; i++) {
-                    free_ast_node(block_ast->nodes[i]);
-                }
-                free(block_ast->nodes);
-                free(block_ast);
-            } else {
-                free_ast_node(node->left);
-            }
+        case AST_VARIABLE_DECL:
+            fprintf(out, "VariableDecl: %s:%s\n", symbol_name(symbols, node->symbol), node->value);
+            break;
+        case AST_BINARY_OP:
+            fprintf(out, "BinaryOp: %s\n", token_names[node->op_type]);
+            break;
+        case AST_UNARY_OP:
+            fprintf(out, "UnaryOp: %s\n", token_names[node->op_type]);
+            break;
+        case AST_LITERAL:
+            fprintf(out, "Literal(%s): %s\n", token_names[node->op_type], node->value);
+            break;
+        case AST_IDENTIFIER:
+            fprintf(out, "Identifier: %s\n", symbol_name(symbols, node->symbol));
+            break;
+        case AST_ASSIGNMENT:
+            fprintf(out, "Assignment: %s\n", token_names[node->op_type]);
+            break;
+        case AST_COMPOUND_ASSIGN:
+            fprintf(out, "Compound Assignment: %s\n", token_names[node->op_type]);
             break;
-            
         case AST_IF:
+            fprintf(out, "If\n");
+            break;
         case AST_ELIF:
-            free_ast_node(node->left);
-            free_ast_node(node->right);
-            free_ast_node(node->extra);
+            fprintf(out, "Elif\n");
             break;
-            
         case AST_ELSE:
-            free_ast_node(node->left);
+            fprintf(out, "Else\n");
+            break;
+        case AST_BLOCK:
+            fprintf(out, "Block\n");
             break;
-            
         case AST_FUNCTION:
+            fprintf(out, "Function: %s\n", symbol_name(symbols, node->symbol));
+            break;
         case AST_START_FUNCTION:
-            free_ast_node(node->left); // Аргументы
-            free_ast_node(node->right); // Тело функции
+            fprintf(out, "Start Function: %s\n", symbol_name(symbols, node->symbol));
             break;
-            
         case AST_FUNCTION_CALL:
-            free_ast_node(node->left); // Аргументы
+            fprintf(out, "Call: %s\n", symbol_name(symbols, node->symbol));
             break;
-            
-        default:
-            free_ast_node(node->left);
-            free_ast_node(node->right);
+        case AST_CONDITIONAL:
+            fprintf(out, "Conditional\n");
+            break;
+        case AST_POSTFIX_OP:
+            fprintf(out, "PostfixOp: %s\n", token_names[node->op_type]);
             break;
     }
-    
-    if (node->value) free(node->value);
-    free(node);
+}
+
+typedef struct {
+    ASTNode *node;
+    int indent;
+    int next;     // Позиция next_child
+} PrintFrame;
+
+// Печать поддерева в прямом порядке; путь от node до печатаемого узла
+// хранится в стеке в куче
+void print_ast_node(FILE *out, const SymbolTable *symbols, ASTNode *node, int indent) {
+    if (!node) return;
+
+    WorkStack stack = { 0 };
+    print_node_line(out, symbols, node, indent);
+    *(PrintFrame*)work_push(&stack, sizeof(PrintFrame)) = (PrintFrame){ node, indent, 0 };
+    while (stack.count) {
+        PrintFrame *top = WORK_TOP(&stack, PrintFrame);
+        ASTNode *child = next_child(top->node, printed_slots[top->node->type], &top->next);
+        if (!child) {
+            stack.count--;
+            continue;
+        }
+        int child_indent = top->indent + 1;
+        print_node_line(out, symbols, child, child_indent);
+        *(PrintFrame*)work_push(&stack, sizeof(PrintFrame)) = (PrintFrame){ child, child_indent, 0 };
+    }
+    free(stack.items);
 }
 
 // Печать AST-узла (полная реализация для всех типов)
@@ -693,19 +1345,487 @@ void free_ast_node(ASTNode *node) {
 
 // Печать всего AST
 void print_ast(AST *ast) {
+    fprint_ast(stdout, ast);
+}
+
+void fprint_ast(FILE *out, AST *ast) {
     for (int i = 0; i < ast->count; i++) {
-        printf("Statement %d:\n", i + 1);
-        print_ast_node(ast->nodes[i], 1);
+        fprintf(out, "Statement %d:\n", i + 1);
+        print_ast_node(out, ast->symbols, ast->nodes[i], 1);
     }
 }
 
-// Освобождение всего AST
+// Освобождение всего AST: арена освобождается блоками, без обхода дерева
 void free_ast(AST *ast) {
     if (!ast) return;
     
-    for (int i = 0; i < ast->count; i++) {
-        free_ast_node(ast->nodes[i]);
+    struct ASTChunk *chunk = ast->arena;
+    while (chunk) {
+        struct ASTChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
-    free(ast->nodes);
+    free_symbol_table(ast->owned_symbols);
     free(ast);
 }
+
+// Образ плоского AST (flatten_ast, serialize_ast, кэш разбора): заголовок
+// из пяти u32 (FLAT_MAGIC, число узлов, число символов, длины strings и
+// names), затем массив FlatNode, смещения имён (u32 на символ), strings и
+// names. Числа в порядке байтов машины: FLAT_MAGIC, записанный на машине с
+// другим порядком, не совпадёт, и образ будет отвергнут
+#define FLAT_MAGIC 0x46415850u  // "PXAF" в little-endian
+#define FLAT_HEADER_SIZE 20
+
+typedef struct {
+    FlatNode *nodes;
+    uint32_t count;
+    char *strings;
+    uint32_t strings_length;
+} FlatWriter;
+
+typedef struct {
+    const ASTNode *node;
+    int next;         // Позиция next_child
+    uint32_t index;   // Индекс узла в плоском AST
+} FlattenFrame;
+
+// Число узлов и длина их строк; false, если не помещается в u32
+static bool measure_flat(const AST *ast, size_t *count, size_t *strings_length) {
+    WorkStack stack = { 0 };
+    bool fits = true;
+    for (int i = 0; fits && i < ast->count; i++) {
+        const ASTNode *node = ast->nodes[i];
+        while (fits && node) {
+            if (++*count >= UINT32_MAX) fits = false;
+            if (node->value) *strings_length += strlen(node->value) + 1;
+            if (*strings_length >= UINT32_MAX) fits = false;
+            *(FlattenFrame*)work_push(&stack, sizeof(FlattenFrame)) = (FlattenFrame){ node, 0, 0 };
+
+            // Следующий узел - первый ещё не пройденный потомок на пути
+            node = NULL;
+            while (!node && stack.count) {
+                FlattenFrame *top = WORK_TOP(&stack, FlattenFrame);
+                node = next_child(top->node, ALL_SLOTS, &top->next);
+                if (!node) stack.count--;
+            }
+        }
+    }
+    free(stack.items);
+    return fits;
+}
+
+// Узел без потомков в конец плоского AST; end записывает put_flat_tree
+static uint32_t put_flat_node(FlatWriter *out, const ASTNode *node) {
+    uint32_t index = out->count++;
+    FlatNode *flat = &out->nodes[index];
+    flat->type = (uint8_t)node->type;
+    flat->op_type = (uint8_t)node->op_type;
+    flat->reserved = 0;
+    flat->symbol = node->symbol;
+    flat->value = 0;
+    if (node->value) {
+        size_t length = strlen(node->value) + 1;
+        memcpy(out->strings + out->strings_length, node->value, length);
+        flat->value = out->strings_length + 1;
+        out->strings_length += length;
+    }
+
+    if (node->type == AST_BLOCK && node->extra) {
+        // Многострочный блок: операторы под-AST идут подряд
+        flat->children = FLAT_BLOCK;
+    } else {
+        flat->children = (node->left ? FLAT_LEFT : 0) | (node->right ? FLAT_RIGHT : 0) |
+                         (node->extra ? FLAT_EXTRA : 0);
+    }
+    return index;
+}
+
+// Поддерево node в прямом порядке; конец поддерева узла известен, когда
+// снимается его кадр
+static void put_flat_tree(FlatWriter *out, const ASTNode *node, WorkStack *stack) {
+    while (node) {
+        uint32_t index = put_flat_node(out, node);
+        *(FlattenFrame*)work_push(stack, sizeof(FlattenFrame)) = (FlattenFrame){ node, 0, index };
+
+        node = NULL;
+        while (!node && stack->count) {
+            FlattenFrame *top = WORK_TOP(stack, FlattenFrame);
+            node = next_child(top->node, ALL_SLOTS, &top->next);
+            if (!node) {
+                out->nodes[top->index].end = out->count;
+                stack->count--;
+            }
+        }
+    }
+}
+
+// Плоская копия AST в одном выделенном образе (освобождается
+// free_flat_ast). false, если AST не помещается в 32-битные индексы
+bool flatten_ast(const AST *ast, FlatAST *flat) {
+    memset(flat, 0, sizeof(*flat));
+    size_t count = 0, strings_length = 0;
+    if (!measure_flat(ast, &count, &strings_length)) return false;
+    const SymbolTable *symbols = ast->symbols;
+    size_t symbol_count = symbols ? symbols->count : 0;
+    size_t names_length = symbols ? symbols->names_length : 0;
+    if (symbol_count >= UINT32_MAX || names_length >= UINT32_MAX) return false;
+
+    size_t length = FLAT_HEADER_SIZE + count * sizeof(FlatNode) + symbol_count * sizeof(uint32_t) +
+                    strings_length + names_length;
+    uint8_t *image = malloc(length ? length : 1);
+    if (!image) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t header[5] = { FLAT_MAGIC, (uint32_t)count, (uint32_t)symbol_count,
+                           (uint32_t)strings_length, (uint32_t)names_length };
+    memcpy(image, header, sizeof(header));
+
+    FlatWriter out = { (FlatNode*)(image + FLAT_HEADER_SIZE), 0, NULL, 0 };
+    uint32_t *name_offsets = (uint32_t*)(out.nodes + count);
+    out.strings = (char*)(name_offsets + symbol_count);
+    char *names = out.strings + strings_length;
+    WorkStack stack = { 0 };
+    for (int i = 0; i < ast->count; i++) put_flat_tree(&out, ast->nodes[i], &stack);
+    free(stack.items);
+    for (size_t i = 0; i < symbol_count; i++) name_offsets[i] = symbols->entries[i].offset;
+    if (names_length) memcpy(names, symbols->names, names_length);
+
+    flat->nodes = out.nodes;
+    flat->count = (uint32_t)count;
+    flat->name_offsets = name_offsets;
+    flat->symbol_count = (uint32_t)symbol_count;
+    flat->strings = out.strings;
+    flat->names = names;
+    flat->image = image;
+    flat->image_length = length;
+    return true;
+}
+
+// Имя и значение, без которых парсер узел не строит. print_node_line
+// печатает их без проверок, поэтому образ без них отвергается
+static bool flat_node_complete(const FlatNode *node) {
+    switch ((ASTNodeType)node->type) {
+        case AST_VARIABLE_DECL:
+            return node->symbol != SYMBOL_NONE && node->value;
+        case AST_IDENTIFIER:
+        case AST_FUNCTION:
+        case AST_START_FUNCTION:
+        case AST_FUNCTION_CALL:
+            return node->symbol != SYMBOL_NONE;
+        case AST_LITERAL:
+            return node->value;
+        default:
+            return true;
+    }
+}
+
+// Поддеревья подряд в [first, end) должны точно заполнять отрезок;
+// возвращает их число или -1
+static int64_t count_flat_subtrees(const FlatNode *nodes, uint32_t first, uint32_t end) {
+    int64_t subtrees = 0;
+    while (first < end) {
+        if (nodes[first].end <= first || nodes[first].end > end) return -1;
+        first = nodes[first].end;
+        subtrees++;
+    }
+    return subtrees;
+}
+
+// Плоское AST поверх готового образа, без копирования: flat указывает в
+// data, пока data жив. Проверяет весь образ за один проход, так что
+// повреждённые данные дают false, а не выход за границы
+bool view_flat_ast(const void *data, size_t length, FlatAST *flat) {
+    memset(flat, 0, sizeof(*flat));
+    if (length < FLAT_HEADER_SIZE || ((uintptr_t)data & (sizeof(uint32_t) - 1))) return false;
+    uint32_t header[5];
+    memcpy(header, data, sizeof(header));
+    size_t count = header[1], symbol_count = header[2];
+    size_t strings_length = header[3], names_length = header[4];
+    if (header[0] != FLAT_MAGIC || count >= UINT32_MAX ||
+        (length - FLAT_HEADER_SIZE) / sizeof(FlatNode) < count) return false;
+    size_t rest = length - FLAT_HEADER_SIZE - count * sizeof(FlatNode);
+    if (rest / sizeof(uint32_t) < symbol_count) return false;
+    rest -= symbol_count * sizeof(uint32_t);
+    if (rest < strings_length || rest - strings_length != names_length) return false;
+
+    const uint8_t *bytes = data;
+    const FlatNode *nodes = (const FlatNode*)(bytes + FLAT_HEADER_SIZE);
+    const uint32_t *name_offsets = (const uint32_t*)(nodes + count);
+    const char *strings = (const char*)(name_offsets + symbol_count);
+    const char *names = strings + strings_length;
+
+    // Строки и имена кончаются нулём, поэтому любое смещение внутри них
+    // даёт строку, не выходящую за образ
+    if ((strings_length && strings[strings_length - 1]) ||
+        (names_length && names[names_length - 1]) ||
+        (symbol_count && !names_length)) return false;
+    for (size_t i = 0; i < symbol_count; i++) {
+        if (name_offsets[i] >= names_length) return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        const FlatNode *node = &nodes[i];
+        if (node->type >= AST_NODE_TYPE_COUNT || node->op_type > TOKEN_ERROR ||
+            (node->symbol != SYMBOL_NONE && node->symbol >= symbol_count) ||
+            (node->value && node->value - 1 >= strings_length) ||
+            !flat_node_complete(node) || node->end <= i || node->end > count) return false;
+        int64_t subtrees = count_flat_subtrees(nodes, i + 1, node->end);
+        if (subtrees < 0) return false;
+        if (node->children == FLAT_BLOCK) {
+            if (node->type != AST_BLOCK) return false;
+        } else if (node->children & ~(FLAT_LEFT | FLAT_RIGHT | FLAT_EXTRA) ||
+                   subtrees != (node->children & FLAT_LEFT) + (node->children >> 1 & 1) +
+                               (node->children >> 2 & 1)) {
+            return false;
+        }
+    }
+    if (count_flat_subtrees(nodes, 0, (uint32_t)count) < 0) return false;
+
+    flat->nodes = nodes;
+    flat->count = (uint32_t)count;
+    flat->name_offsets = name_offsets;
+    flat->symbol_count = (uint32_t)symbol_count;
+    flat->strings = strings;
+    flat->names = names;
+    return true;
+}
+
+// Индекс потомка узла в слоте FLAT_LEFT, FLAT_RIGHT или FLAT_EXTRA;
+// FLAT_NONE, если слот пуст
+uint32_t flat_child(const FlatAST *flat, uint32_t index, int slot) {
+    uint8_t children = flat->nodes[index].children;
+    if (children == FLAT_BLOCK || !(children & slot)) return FLAT_NONE;
+    uint32_t child = index + 1;
+    for (int before = FLAT_LEFT; before < slot; before <<= 1) {
+        if (children & before) child = flat->nodes[child].end;
+    }
+    return child;
+}
+
+void free_flat_ast(FlatAST *flat) {
+    free(flat->image);
+    memset(flat, 0, sizeof(*flat));
+}
+
+static const char *flat_name(const FlatAST *flat, uint32_t symbol) {
+    return symbol == SYMBOL_NONE ? "" : flat->names + flat->name_offsets[symbol];
+}
+
+static const char *flat_value(const FlatAST *flat, uint32_t value) {
+    return value ? flat->strings + value - 1 : "";
+}
+
+// Следующий потомок узла index с позиции *next (0 - с начала):
+// операторы блока или слоты из slots по порядку left, right, extra.
+// FLAT_NONE, когда потомки кончились
+static uint32_t next_flat_child(const FlatAST *flat, uint32_t index, int slots, uint32_t *next) {
+    const FlatNode *node = &flat->nodes[index];
+    if (node->children == FLAT_BLOCK) {
+        uint32_t child = *next ? *next : index + 1;
+        if (child >= node->end) return FLAT_NONE;
+        *next = flat->nodes[child].end;
+        return child;
+    }
+    while (*next < 3) {
+        int slot = 1 << (*next)++;
+        if (!(slots & slot)) continue;
+        uint32_t child = flat_child(flat, index, slot);
+        if (child != FLAT_NONE) return child;
+    }
+    return FLAT_NONE;
+}
+
+// Строка узла плоского AST; совпадает с print_node_line
+static void print_flat_line(FILE *out, const FlatAST *flat, const FlatNode *node, int indent) {
+    for (int i = 0; i < indent; i++) fputs("  ", out);
+
+    switch ((ASTNodeType)node->type) {
+        case AST_VARIABLE_DECL:
+            fprintf(out, "VariableDecl: %s:%s\n", flat_name(flat, node->symbol), flat_value(flat, node->value));
+            break;
+
+        case AST_BINARY_OP:
+        case AST_ASSIGNMENT:
+        case AST_COMPOUND_ASSIGN:
+            fprintf(out, "%s: %s\n",
+                    node->type == AST_BINARY_OP ? "BinaryOp" :
+                    node->type == AST_ASSIGNMENT ? "Assignment" : "Compound Assignment",
+                    token_names[node->op_type]);
+            break;
+
+        case AST_UNARY_OP:
+            fprintf(out, "UnaryOp: %s\n", token_names[node->op_type]);
+            break;
+
+        case AST_LITERAL:
+            fprintf(out, "Literal(%s): %s\n", token_names[node->op_type], flat_value(flat, node->value));
+            break;
+
+        case AST_IDENTIFIER:
+            fprintf(out, "Identifier: %s\n", flat_name(flat, node->symbol));
+            break;
+
+        case AST_IF:
+        case AST_ELIF:
+            fprintf(out, node->type == AST_IF ? "If\n" : "Elif\n");
+            break;
+
+        case AST_ELSE:
+            fprintf(out, "Else\n");
+            break;
+
+        case AST_BLOCK:
+            fprintf(out, "Block\n");
+            break;
+
+        case AST_FUNCTION:
+        case AST_START_FUNCTION:
+            fprintf(out, "%s: %s\n", node->type == AST_FUNCTION ? "Function" : "Start Function",
+                    flat_name(flat, node->symbol));
+            break;
+
+        case AST_FUNCTION_CALL:
+            fprintf(out, "Call: %s\n", flat_name(flat, node->symbol));
+            break;
+
+        case AST_CONDITIONAL:
+            fprintf(out, "Conditional\n");
+            break;
+
+        case AST_POSTFIX_OP:
+            fprintf(out, "PostfixOp: %s\n", token_names[node->op_type]);
+            break;
+    }
+}
+
+typedef struct {
+    uint32_t index;
+    int indent;
+    uint32_t next;   // Позиция next_flat_child
+} FlatPrintFrame;
+
+// Печать плоского AST; вывод совпадает с fprint_ast
+void fprint_flat_ast(FILE *out, const FlatAST *flat) {
+    WorkStack stack = { 0 };
+    int statement = 1;
+    for (uint32_t i = 0; i < flat->count; i = flat->nodes[i].end) {
+        fprintf(out, "Statement %d:\n", statement++);
+        print_flat_line(out, flat, &flat->nodes[i], 1);
+        *(FlatPrintFrame*)work_push(&stack, sizeof(FlatPrintFrame)) = (FlatPrintFrame){ i, 1, 0 };
+        while (stack.count) {
+            FlatPrintFrame *top = WORK_TOP(&stack, FlatPrintFrame);
+            uint32_t child = next_flat_child(flat, top->index, printed_slots[flat->nodes[top->index].type],
+                                             &top->next);
+            if (child == FLAT_NONE) {
+                stack.count--;
+                continue;
+            }
+            int indent = top->indent + 1;
+            print_flat_line(out, flat, &flat->nodes[child], indent);
+            *(FlatPrintFrame*)work_push(&stack, sizeof(FlatPrintFrame)) = (FlatPrintFrame){ child, indent, 0 };
+        }
+    }
+    free(stack.items);
+}
+
+// AST в виде байтов: образ плоского AST (буфер выделяется malloc, длина -
+// в *length). NULL, если AST не помещается в 32-битные индексы
+uint8_t *serialize_ast(const AST *ast, size_t *length) {
+    FlatAST flat;
+    if (!flatten_ast(ast, &flat)) return NULL;
+    *length = flat.image_length;
+    return flat.image;
+}
+
+// Узел AST в арене owner из узла index плоского AST, без потомков
+static ASTNode *unflatten_node(AST *owner, const FlatAST *flat, uint32_t index) {
+    const FlatNode *node = &flat->nodes[index];
+    char *value = NULL;
+    if (node->value) {
+        const char *text = flat->strings + node->value - 1;
+        value = ast_strndup(owner, text, strlen(text));
+    }
+    ASTNode *result = create_ast_node(owner, (ASTNodeType)node->type, (TokenType)node->op_type,
+                                      value, NULL, NULL, NULL);
+    result->symbol = node->symbol;
+    if (node->children == FLAT_BLOCK) result->extra = (ASTNode*)create_block(owner);
+    return result;
+}
+
+typedef struct {
+    ASTNode *node;
+    uint32_t index;
+    uint32_t next;   // Позиция next_flat_child
+} UnflattenFrame;
+
+// Поддерево узла index; каждый потомок подвешивается в слот, из которого
+// его выдал next_flat_child
+static ASTNode *unflatten_tree(AST *owner, const FlatAST *flat, uint32_t index, WorkStack *stack) {
+    ASTNode *root = unflatten_node(owner, flat, index);
+    *(UnflattenFrame*)work_push(stack, sizeof(UnflattenFrame)) = (UnflattenFrame){ root, index, 0 };
+    while (stack->count) {
+        UnflattenFrame *top = WORK_TOP(stack, UnflattenFrame);
+        uint32_t child = next_flat_child(flat, top->index, ALL_SLOTS, &top->next);
+        if (child == FLAT_NONE) {
+            stack->count--;
+            continue;
+        }
+        ASTNode *node = unflatten_node(owner, flat, child);
+        if (flat->nodes[top->index].children == FLAT_BLOCK) {
+            add_ast_node(owner, (AST*)top->node->extra, node);
+        } else if (top->next == 1) {
+            top->node->left = node;
+        } else if (top->next == 2) {
+            top->node->right = node;
+        } else {
+            top->node->extra = node;
+        }
+        *(UnflattenFrame*)work_push(stack, sizeof(UnflattenFrame)) = (UnflattenFrame){ node, child, 0 };
+    }
+    return root;
+}
+
+// Восстановление AST из байтов serialize_ast. Таблица имён создаётся
+// заново и принадлежит AST. NULL, если данные повреждены
+AST *deserialize_ast(const uint8_t *data, size_t length) {
+    // Узлы читаются на месте, поэтому образ должен быть выровнен
+    uint8_t *aligned = NULL;
+    if ((uintptr_t)data & (sizeof(uint32_t) - 1)) {
+        aligned = malloc(length ? length : 1);
+        if (!aligned) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(aligned, data, length);
+        data = aligned;
+    }
+
+    FlatAST flat;
+    AST *ast = NULL;
+    if (view_flat_ast(data, length, &flat)) {
+        SymbolTable *symbols = calloc(1, sizeof(SymbolTable));
+        if (!symbols) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        ast = create_program(symbols);
+        ast->owned_symbols = symbols;
+        bool ok = true;
+        for (uint32_t i = 0; ok && i < flat.symbol_count; i++) {
+            const char *name = flat_name(&flat, i);
+            ok = intern_symbol(symbols, name, strlen(name)) == i;
+        }
+        WorkStack stack = { 0 };
+        for (uint32_t i = 0; ok && i < flat.count; i = flat.nodes[i].end) {
+            add_ast_node(ast, ast, unflatten_tree(ast, &flat, i, &stack));
+        }
+        free(stack.items);
+        if (!ok) {
+            free_ast(ast);
+            ast = NULL;
+        }
+    }
+    free(aligned);
+    return ast;
+}
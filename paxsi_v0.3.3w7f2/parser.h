@@ -17,13 +17,18 @@ typedef enum {
     AST_BLOCK,
     AST_FUNCTION,
     AST_FUNCTION_CALL,
-    AST_START_FUNCTION
+    AST_START_FUNCTION,
+    AST_CONDITIONAL,        // left ? right : extra
+    AST_POSTFIX_OP          // left++, left--
 } ASTNodeType;
 
+#define AST_NODE_TYPE_COUNT (AST_POSTFIX_OP + 1)
+
 typedef struct ASTNode {
     ASTNodeType type;
     TokenType op_type;
     char *value;
+    uint32_t symbol;        // Имя узла в таблице символов лексера или SYMBOL_NONE
     struct ASTNode *left;
     struct ASTNode *right;
     struct ASTNode *extra;  // Дополнительное поле для условий/блоков
@@ -33,11 +38,75 @@ typedef struct {
     ASTNode **nodes;
     int count;
     int capacity;
+    const SymbolTable *symbols;  // Имена узлов; таблица принадлежит лексеру
+    SymbolTable *owned_symbols;  // Таблица AST, загруженного без лексера (deserialize_ast)
+    struct ASTChunk *arena;      // Память узлов, блоков и строк; только у корневого AST
 } AST;
 
-AST *parse(Token *tokens, int token_count);
+// Плоское AST: все узлы в одном массиве в прямом порядке обхода, потомки
+// задаются не указателями, а расположением. Потомки узла i - поддеревья,
+// идущие подряд в [i + 1, end): слоты из children по порядку left, right,
+// extra, у блока (FLAT_BLOCK) - его операторы. Операторы верхнего уровня -
+// поддеревья подряд в [0, count). Ссылок нет, поэтому образ (flatten_ast,
+// serialize_ast) можно записать на диск и читать на месте (view_flat_ast)
+enum {
+    FLAT_LEFT = 1,
+    FLAT_RIGHT = 2,
+    FLAT_EXTRA = 4,
+    FLAT_BLOCK = 8
+};
+
+#define FLAT_NONE UINT32_MAX
+
+typedef struct {
+    uint8_t type;       // ASTNodeType
+    uint8_t op_type;    // TokenType
+    uint8_t children;   // FLAT_LEFT | FLAT_RIGHT | FLAT_EXTRA или FLAT_BLOCK
+    uint8_t reserved;
+    uint32_t symbol;    // Номер имени или SYMBOL_NONE
+    uint32_t value;     // Смещение строки в strings + 1; 0 - значения нет
+    uint32_t end;       // Индекс первого узла после поддерева
+} FlatNode;
+
+typedef struct {
+    const FlatNode *nodes;
+    uint32_t count;
+    const uint32_t *name_offsets;  // Начало имени символа в names
+    uint32_t symbol_count;
+    const char *strings;           // Значения узлов, каждое с нулём в конце
+    const char *names;             // Имена символов, каждое с нулём в конце
+    void *image;                   // Образ, выделенный flatten_ast, или NULL
+    size_t image_length;
+} FlatAST;
+
+// Версия вывода лексера и парсера: увеличивается при любом изменении
+// токенов или AST и входит в ключ кэша разбора
+#define PAXSI_FRONTEND_VERSION 2
+
+// Наибольшая вложенность конструкций при разборе по умолчанию. Разбор,
+// печать и обходы AST идут на стеках в куче, поэтому предел защищает
+// только память: глубже разбор останавливается с "Nesting too deep"
+#define PARSE_DEFAULT_MAX_DEPTH 100000
+
+// Разбор не держит глобального состояния: разные потоки могут разбирать
+// одновременно. При синтаксической ошибке сообщение печатается в stderr
+// (в errors для parse_lexer_checked и parse_parallel), результат - NULL.
+// parse_parallel разбирает крупные блоки буфера на jobs потоках; AST и
+// диагностика те же, что у parse
+AST *parse(const TokenBuffer *tokens);
+AST *parse_lexer(Lexer *lexer);
+AST *parse_lexer_checked(Lexer *lexer, FILE *errors, size_t max_depth);
+AST *parse_parallel(const TokenBuffer *tokens, int jobs, FILE *errors, size_t max_depth);
 void free_ast(AST *ast);
 void print_ast(AST *ast);
+void fprint_ast(FILE *out, AST *ast);
+uint8_t *serialize_ast(const AST *ast, size_t *length);
+AST *deserialize_ast(const uint8_t *data, size_t length);
+bool flatten_ast(const AST *ast, FlatAST *flat);
+bool view_flat_ast(const void *data, size_t length, FlatAST *flat);
+uint32_t flat_child(const FlatAST *flat, uint32_t index, int slot);
+void fprint_flat_ast(FILE *out, const FlatAST *flat);
+void free_flat_ast(FlatAST *flat);
 
 #endif
 